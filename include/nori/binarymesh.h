@@ -0,0 +1,57 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_BINARYMESH_H)
+#define __NORI_BINARYMESH_H
+
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Header of a binary mesh file (extension <tt>.nmesh</tt>)
+ *
+ * The header is followed by the indexed mesh arrays exactly as they are
+ * stored by \ref Mesh (column-major, native byte order), each of which
+ * starts at a 64-byte aligned offset. This allows the "nmesh" plugin to
+ * map the file and use the arrays in place. Files are written by the
+ * \c meshconvert tool.
+ */
+struct BinaryMeshHeader {
+    /// Incremented whenever the layout of the file changes
+    static const uint32_t VERSION = 1;
+
+    char magic[8];           ///< Always "NORIMSH"
+    uint32_t version;        ///< Format version
+    uint32_t vertexCount;    ///< Number of vertices
+    uint32_t triangleCount;  ///< Number of triangles
+    uint32_t padding;        ///< Unused
+    uint64_t offsetV;        ///< Offset of the vertex positions (3 floats per vertex)
+    uint64_t offsetN;        ///< Offset of the vertex normals (0 if there are none)
+    uint64_t offsetUV;       ///< Offset of the texture coordinates (0 if there are none)
+    uint64_t offsetF;        ///< Offset of the faces (3 indices per triangle)
+    float bboxMin[3];        ///< Bounding box of the vertex positions
+    float bboxMax[3];
+};
+
+/// Write the contents of a mesh to a binary mesh file (throws a \ref NoriException on failure)
+extern void writeBinaryMesh(const Mesh *mesh, const std::string &filename);
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_BINARYMESH_H */
@@ -26,6 +26,8 @@
 #include <nori/color.h>
 #include <nori/vector.h>
 #include <tbb/mutex.h>
+#include <atomic>
+#include <memory>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
 
@@ -126,6 +128,80 @@ protected:
     mutable tbb::mutex m_mutex;
 };
 
+/**
+ * \brief Full-resolution image that accumulates rendered blocks without locking
+ *
+ * The blocks handed out by a \ref BlockGenerator cover disjoint regions of
+ * the image, and only one task works on a given block at a time. The
+ * interior of a finished block can therefore be added to the image without
+ * any synchronization. Only the filter border overlaps with neighboring
+ * blocks; it is accumulated in a separate buffer owned by the block and
+ * merged into the image by \ref resolveBorders() once no block is being
+ * rendered (e.g. at the end of a pass).
+ *
+ * Readers obtain a consistent copy with \ref snapshot(), which also adds
+ * the borders that were not merged yet and never blocks the writers: each
+ * block has a sequence counter that is odd while the block is being
+ * written, and blocks that change during the copy (or whose neighbors do)
+ * simply keep their previous contents in the target.
+ */
+class Film {
+public:
+    /**
+     * \brief Create a new film
+     * \param size
+     *     Size of the image in pixels
+     * \param filter
+     *     Reconstruction filter used by the rendered blocks
+     * \param blockSize
+     *     Block size of the \ref BlockGenerator producing the blocks
+     */
+    Film(const Vector2i &size, const ReconstructionFilter *filter, int blockSize);
+
+    /// Clear all contents
+    void clear();
+
+    /**
+     * \brief Merge a block produced by a \ref BlockGenerator
+     *
+     * This function does not lock. It is safe to call concurrently
+     * as long as no two callers merge the same block id at a time.
+     */
+    void put(const ImageBlock &block);
+
+    /**
+     * \brief Merge the accumulated block borders into the image
+     *
+     * Must not be called concurrently with \ref put()
+     */
+    void resolveBorders();
+
+    /**
+     * \brief Copy the image into \c target without blocking the writers
+     *
+     * The target must have been initialized with the same size and filter.
+     * Only the interior (non-border) pixels are copied.
+     */
+    void snapshot(ImageBlock &target) const;
+
+    /// Turn the film into a proper bitmap (no concurrent \ref put() allowed)
+    Bitmap *toBitmap() const { return m_image.toBitmap(); }
+
+    /// Return the size of the image
+    const Vector2i &getSize() const { return m_image.getSize(); }
+protected:
+    typedef Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> BorderBuffer;
+
+    /// Return the offset and size of the block with the given id
+    void getBlock(uint32_t id, Point2i &offset, Vector2i &size) const;
+
+    ImageBlock m_image;
+    int m_blockSize;
+    Vector2i m_numBlocks;
+    std::vector<BorderBuffer> m_borders;
+    std::unique_ptr<std::atomic<uint32_t>[]> m_versions;
+};
+
 /**
  * \brief Spiraling block generator
  *
@@ -20,6 +20,9 @@
 #define __NORI_BVH_H
 
 #include <nori/mesh.h>
+#include <nori/packet.h>
+#include <nori/mmap.h>
+#include <Eigen/StdVector>
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,11 +41,42 @@ NORI_NAMESPACE_BEGIN
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  *
+ * After construction, the binary tree is collapsed into a 4-ary BVH whose
+ * nodes store the bounding boxes of their four children in SoA layout.
+ * This allows traversal to test a ray against all children of a node
+ * at once using SIMD instructions, as described in
+ *
+ * "Shallow Bounding Volume Hierarchies for Fast SIMD Ray Tracing of
+ * Incoherent Rays" by H. Dammertz, J. Hanika, and A. Keller
+ * (Computer Graphics Forum, 2008)
+ *
+ * When Nori is compiled with \c NORI_BVH_COMPRESSED_NODES, the 4-ary
+ * nodes are converted once more into a compact format, which stores the
+ * child bounds quantized to 8 bits relative to the bounds of the node.
+ * This reduces the node size from 144 to 64 bytes (one cache line), see
+ *
+ * "Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide
+ * BVHs" by H. Ylitie, T. Karras, and S. Laine (High-Performance Graphics 2017)
+ *
  * \author Wenzel Jakob
  */
 class BVH {
     friend class BVHBuildTask;
+    friend class SpatialSplitBuilder;
+    friend class LinearBuilder;
 public:
+    /// Available construction algorithms
+    enum EBuildMethod {
+        /// Binned SAH build using object partitioning only (the default)
+        ESAH = 0,
+        /// Spatial split BVH, which may reference triangles multiple times
+        ESBVH,
+        /// Linear BVH emitted from Morton-sorted triangles (fastest build)
+        ELBVH,
+        /// Linear BVH whose upper levels are built using the SAH
+        EHLBVH
+    };
+
     /// Create a new and empty BVH
     BVH() { m_meshOffset.push_back(0u); }
 
@@ -59,9 +93,70 @@ public:
      */
     void addMesh(Mesh *mesh);
 
+    /**
+     * \brief Register an instance of the geometry of another BVH, which
+     * turns this BVH into a top-level hierarchy over instances
+     *
+     * A BVH contains either meshes or instances. The referenced BVH is
+     * shared by all of its instances and must outlive this one. Rays
+     * that reach an instance are transformed into its object space and
+     * traverse the referenced BVH. This function can only be used
+     * before \ref build() is called.
+     */
+    void addInstance(BVH *bvh, const Transform &toWorld);
+
+    /// Use the construction parameters (builder, bins, cache, ..) of another BVH
+    void copyParameters(const BVH &other);
+
     /// Build the BVH
     void build();
 
+    /// Select the construction algorithm used by \ref build()
+    void setBuildMethod(EBuildMethod method) { m_buildMethod = method; }
+
+    /**
+     * \brief Set the number of bins per axis that the SAH builder
+     * (\ref ESAH) uses to evaluate split candidates (2 to 64)
+     *
+     * More bins find better split planes at the cost of a slower build.
+     */
+    void setBinCount(uint32_t count);
+
+    /**
+     * \brief Limit the triangle references created by spatial splits
+     * (\ref ESBVH) to the given fraction of the triangle count
+     */
+    void setSplitBudget(float budget) { m_splitBudget = budget; }
+
+    /**
+     * \brief Rebuild in \ref refit() when the SAH cost of the refitted
+     * hierarchy exceeds that of the last build by this factor
+     */
+    void setRebuildThreshold(float threshold) { m_rebuildThreshold = threshold; }
+
+    /**
+     * \brief Update the hierarchy after the vertex positions of registered
+     * meshes have changed (see \ref Mesh::setVertexPositions())
+     *
+     * The node bounds are recomputed bottom-up while the tree topology is
+     * kept, which is much faster than a rebuild. Since the quality of the
+     * tree degrades as the geometry moves, it is rebuilt instead when the
+     * SAH cost grows beyond the rebuild threshold.
+     *
+     * \return \c true if the hierarchy had to be rebuilt
+     */
+    bool refit();
+
+    /**
+     * \brief Store built hierarchies in the given directory, and reuse
+     * them in later runs (an empty string disables the cache)
+     *
+     * Cache files are named after a hash of the mesh geometry and the
+     * build parameters, hence any change to these triggers a rebuild.
+     * Valid cache files are memory mapped and used without copying.
+     */
+    void setCacheDirectory(const std::string &directory) { m_cacheDirectory = directory; }
+
     /**
      * \brief Intersect a ray against all triangle meshes registered
      * with the BVH
@@ -80,6 +175,27 @@ public:
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const;
 
+    /**
+     * \brief Intersect a packet of rays against all triangle meshes
+     * registered with the BVH
+     *
+     * The active rays of the packet traverse the tree together, so that
+     * each node is only fetched once for all of them. This is most
+     * effective for coherent rays, such as camera rays of a pixel block.
+     *
+     * \param its
+     *    Array of \ref RayPacket::Size intersection records. Entry \c i
+     *    is filled when ray \c i hits something (unless \c shadowRay
+     *    is set, see above).
+     *
+     * \return Bit mask of the active rays that found an intersection
+     */
+    uint32_t rayIntersect(const RayPacket &packet, Intersection *its,
+        bool shadowRay = false) const;
+
+    /// Return the total number of instances registered with the BVH
+    uint32_t getInstanceCount() const { return (uint32_t) m_instances.size(); }
+
     /// Return the total number of meshes registered with the BVH
     uint32_t getMeshCount() const { return (uint32_t) m_meshes.size(); }
 
@@ -108,21 +224,154 @@ protected:
         return (uint32_t) (it - m_meshOffset.begin());
     }
 
-    //// Return an axis-aligned bounding box containing the given triangle
+    /// Return the number of primitives (triangles or instances) in the tree
+    uint32_t getPrimitiveCount() const {
+        return m_instances.empty() ? getTriangleCount() : (uint32_t) m_instances.size();
+    }
+
+    //// Return an axis-aligned bounding box containing the given triangle (or instance)
     BoundingBox3f getBoundingBox(uint32_t index) const {
+        if (!m_instances.empty())
+            return m_instances[index].bbox;
         uint32_t meshIdx = findMesh(index);
         return m_meshes[meshIdx]->getBoundingBox(index);
     }
     
-    //// Return the centroid of the given triangle
+    //// Return the centroid of the given triangle (or instance)
     Point3f getCentroid(uint32_t index) const {
+        if (!m_instances.empty())
+            return m_instances[index].bbox.getCenter();
         uint32_t meshIdx = findMesh(index);
         return m_meshes[meshIdx]->getCentroid(index);
     }
 
+    /**
+     * \brief Find the closest intersection (or any intersection for shadow
+     * rays) of a ray whose epsilon was already adjusted, without computing
+     * the final intersection record
+     *
+     * \c ray.maxt is shortened to the distance of the closest hit, and
+     * \c instance receives the index of the instance containing it (if any).
+     */
+    bool traverse(Ray3f &ray, Intersection &its, bool shadowRay, uint32_t &instance) const;
+
+    /**
+     * \brief Ray in the coordinate frame of the watertight triangle test
+     *
+     * The axes are permuted so that the dominant direction component comes
+     * last, and a shear maps the direction onto that axis. Intersections
+     * then reduce to 2D edge tests, which give exactly the same result for
+     * both triangles sharing an edge, see
+     *
+     * "Watertight Ray/Triangle Intersection" by S. Woop, C. Benthin, and
+     * I. Wald (Journal of Computer Graphics Techniques, 2013)
+     */
+    struct ShearedRay {
+        int kx, ky, kz;          ///< Axis permutation (kz: dominant axis)
+        float sx, sy, sz;        ///< Shear and scale constants
+        Eigen::Array4f o[3];     ///< Broadcast ray origin
+
+        ShearedRay() { }
+        explicit ShearedRay(const Ray3f &ray);
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    /**
+     * \brief Find the closest intersection of a ray with the triangles
+     * at positions [start, end) of the leaf order that lies within
+     * [ray.mint, ray.maxt] (or any intersection for shadow rays)
+     *
+     * \c start must be a multiple of \ref LEAF_ALIGNMENT.
+     *
+     * \return \c true on success, along with the hit record and
+     * the mesh and triangle index
+     */
+    bool intersectLeaf(uint32_t start, uint32_t end, const Ray3f &ray,
+        const ShearedRay &sray, bool shadowRay, float &u, float &v, float &t,
+        uint32_t &meshIdx, uint32_t &idx) const;
+
+    /// Compute the remaining fields of an intersection record found by traversal
+    void fillIntersection(Intersection &its) const;
+
+    /// Store the triangles in leaf order (if enabled), returns the memory usage
+    size_t precomputeTriangles();
+
+    /// Compute a hash of the meshes and build parameters (cache key)
+    uint64_t computeHash() const;
+
+    /// Try to map the hierarchy from a cache file, returns \c false if it is missing or stale
+    bool loadCache(const std::string &filename, uint64_t hash);
+
+    /// Write the built hierarchy to a cache file
+    void saveCache(const std::string &filename, uint64_t hash) const;
+
+    /// Build the binary tree using spatial splits (see sbvh.cpp)
+    void buildSpatialSplits();
+
+    /// Build the binary tree from Morton-sorted triangles (see lbvh.cpp)
+    void buildLinear(bool hierarchical);
+
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+    /// Release the hierarchy (but not the meshes)
+    void clearHierarchy();
+
+    /// Recompute the bounds of a 4-ary node and its subtree, returns the bounds of the node
+    BoundingBox3f refitNode(uint32_t node_idx, int depth);
+
+    /// Compute the SAH cost of a 4-ary subtree times the surface area of its bounds
+    float cost4(uint32_t node_idx, float surfaceArea) const;
+
+    /// Compute the SAH cost of the 4-ary BVH used for traversal
+    float getCost() const;
+
+    /**
+     * \brief Collapse the binary subtree at the given node into 4-ary
+     * nodes, while appending its leaf triangles to \c indices
+     */
+    uint32_t collapse(uint32_t node_idx, std::vector<uint32_t> &indices);
+
+    /// Append the triangles of a leaf to \c indices, padded to \ref LEAF_ALIGNMENT
+    static void appendLeaf(std::vector<uint32_t> &indices, const uint32_t *start, uint32_t count);
+
+#if defined(NORI_BVH_COMPRESSED_NODES)
+    /// Convert the 4-ary nodes into compressed ones and reorder the indices to match
+    void compressNodes();
+
+    /**
+     * \brief Store the compressed version of a 4-ary node and its subtree
+     * at the given position, while appending its leaf triangles to \c indices
+     */
+    void compressNode(uint32_t node_idx, uint32_t target, std::vector<uint32_t> &indices);
+
+    /// Split a leaf with more triangles than a compressed node can reference
+    void compressLeaf(uint32_t start, uint32_t count, const BoundingBox3f &bbox,
+        uint32_t target, std::vector<uint32_t> &indices);
+#endif
+
+    /**
+     * \brief Append the child slots below the given binary node in
+     * front-to-back order for rays within the specified direction octant
+     */
+    void traversalOrder(uint32_t node_idx, int octant, const uint32_t *children,
+        int childCount, int &position, uint8_t &order) const;
+
+    enum {
+#if defined(NORI_BVH_PRECOMPUTE_TRIANGLES)
+        /// Leaves start at a multiple of this many indices, i.e. at a \ref BVHTriangle4 block
+        LEAF_ALIGNMENT = 4
+#else
+        LEAF_ALIGNMENT = 1
+#endif
+    };
+
+    /// Round the number of triangles of a leaf up to \ref LEAF_ALIGNMENT
+    static uint32_t alignLeaf(uint32_t count) {
+        return (count + LEAF_ALIGNMENT - 1) / LEAF_ALIGNMENT * LEAF_ALIGNMENT;
+    }
+
     /* BVH node in 32 bytes */
     struct BVHNode {
         union {
@@ -142,6 +391,9 @@ protected:
         };
         BoundingBox3f bbox;
 
+        /// Create an unused node
+        BVHNode() : data(0) { }
+
         bool isLeaf() const {
             return leaf.flag == 1;
         }
@@ -162,12 +414,180 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /* 4-ary BVH node in 144 bytes (child bounds in SoA layout) */
+    struct BVH4Node {
+        /// Child bounds: min x, max x, min y, max y, min z, max z
+        Eigen::Array4f bounds[6];
+        /// Index of an inner child node, or first triangle index of a leaf
+        uint32_t child[4];
+        /// Number of triangles of a leaf child, 0 for inner (or unused) children
+        uint32_t count[4];
+        /**
+         * Front-to-back child order for each ray direction octant (bit i
+         * set = negative direction along axis i), derived from the split
+         * axes of the collapsed binary nodes. Two bits per child slot.
+         */
+        uint8_t order[8];
+
+        /// Assign the bounding box of a child, or mark it as unused
+        void setBounds(int i, const BoundingBox3f &bbox) {
+            for (int axis = 0; axis < 3; ++axis) {
+                bounds[2*axis][i] = bbox.min[axis];
+                bounds[2*axis+1][i] = bbox.max[axis];
+            }
+        }
+
+        /// Assign the bounding boxes of all four children
+        void setBounds(const BoundingBox3f *bbox) {
+            for (int i = 0; i < 4; ++i)
+                setBounds(i, bbox[i]);
+        }
+
+        /// Return the child bounds (\c temp is only used by compressed nodes)
+        const Eigen::Array4f *getBounds(Eigen::Array4f *) const { return bounds; }
+
+        /// Return the node index (count = 0) or triangle range of a child
+        void getChild(int i, uint32_t &ref, uint32_t &n) const {
+            ref = child[i];
+            n = count[i];
+        }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    /**
+     * 4-ary BVH node with quantized child bounds in 64 bytes. The inner
+     * children of a node are stored next to each other, and so are the
+     * triangles of its leaf children. Hence two base indices replace the
+     * per-child references of \ref BVH4Node.
+     */
+    struct BVH4QNode {
+        /// Lower corner of the quantization grid (the node bounds)
+        float origin[3];
+        /// Grid spacing along each axis as a power of two
+        int8_t exponent[3];
+        /// Bit i is set when child i is an inner node
+        uint8_t innerMask;
+        /// Quantized child bounds: min x, max x, min y, max y, min z, max z
+        uint8_t qbounds[6][4];
+        /// Index of the first inner child node
+        uint32_t childBase;
+        /// Index of the first triangle of the first leaf child
+        uint32_t triangleBase;
+        /// Number of triangles of a leaf child, 0 for inner (or unused) children
+        uint8_t count[4];
+        /// Front-to-back child order for each ray direction octant, see \ref BVH4Node
+        uint8_t order[8];
+        uint32_t unused;
+
+        /**
+         * \brief Quantize the bounding boxes of all four children (invalid
+         * boxes mark unused slots)
+         *
+         * Minima are rounded down and maxima up, so that the decoded bounds
+         * always contain the original ones.
+         */
+        void setBounds(const BoundingBox3f *bbox);
+
+        /// Decode the child bounds into \c temp
+        const Eigen::Array4f *getBounds(Eigen::Array4f *temp) const {
+            for (int axis = 0; axis < 3; ++axis) {
+                Eigen::Array4f base = Eigen::Array4f::Constant(origin[axis]);
+                float scale = getScale(axis);
+                for (int j = 2*axis; j < 2*axis + 2; ++j)
+                    temp[j] = base + Eigen::Array4i(qbounds[j][0], qbounds[j][1],
+                        qbounds[j][2], qbounds[j][3]).cast<float>() * scale;
+            }
+            return temp;
+        }
+
+        /// Return the node index (count = 0) or triangle range of a child
+        void getChild(int i, uint32_t &ref, uint32_t &n) const {
+            bool inner = (innerMask >> i) & 1;
+            ref = inner ? childBase : triangleBase;
+            n = count[i];
+            for (int j = 0; j < i; ++j)
+                ref += inner ? (innerMask >> j) & 1 : alignLeaf(count[j]);
+            if (!inner && n == 0)
+                ref = 0; /* Unused slot */
+        }
+
+        /// Return the grid spacing along the given axis
+        float getScale(int axis) const {
+            /* Assemble the power of two from its exponent bits */
+            uint32_t bits = (uint32_t) (exponent[axis] + 127) << 23;
+            float scale;
+            memcpy(&scale, &bits, sizeof(float));
+            return scale;
+        }
+    };
+
+#if defined(NORI_BVH_COMPRESSED_NODES)
+    typedef BVH4QNode TraversalNode;
+    typedef std::vector<BVH4QNode> TraversalNodeVector;
+#else
+    typedef BVH4Node TraversalNode;
+    typedef std::vector<BVH4Node, Eigen::aligned_allocator<BVH4Node>> TraversalNodeVector;
+#endif
+
+    /// Return the array that stores the nodes used for traversal after a build
+    TraversalNodeVector &getTraversalNodes();
+
+    /* Placement of the geometry of another BVH */
+    struct BVHInstance {
+        BVH *bvh;              ///< Shared bottom-level hierarchy
+        Transform toObject;    ///< World-to-object transformation
+        Transform toWorld;     ///< Object-to-world transformation
+        bool identity;         ///< Both transformations are the identity (no conversions needed)
+        BoundingBox3f bbox;    ///< World space bounds of the instance
+    };
+
+#if defined(NORI_BVH_PRECOMPUTE_TRIANGLES)
+    /**
+     * Four consecutive triangles of the BVH leaf order in SoA layout. Block
+     * \c i holds the triangles at positions 4i to 4i+3. Every leaf starts
+     * at a block, and the lanes after its last triangle are padding.
+     */
+    struct BVHTriangle4 {
+        /// Vertex positions, indexed by vertex and axis
+        Eigen::Array4f p[3][3];
+        /// Index of the mesh containing each triangle
+        uint32_t mesh[4];
+        /// Triangle index within that mesh
+        uint32_t primitive[4];
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+#endif
 private:
     std::vector<Mesh *> m_meshes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_meshOffset; ///< Index of the first triangle for each shape
-    std::vector<BVHNode> m_nodes;       ///< BVH nodes
+    std::vector<BVHNode> m_nodes;       ///< BVH nodes (binary, only used during the build)
+    std::vector<BVH4Node, Eigen::aligned_allocator<BVH4Node>> m_nodes4; ///< Collapsed 4-ary BVH nodes
+#if defined(NORI_BVH_COMPRESSED_NODES)
+    std::vector<BVH4QNode> m_qnodes;    ///< Compressed 4-ary BVH nodes
+#endif
     std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    std::vector<BVHInstance> m_instances; ///< Instances (top-level hierarchies only)
+#if defined(NORI_BVH_PRECOMPUTE_TRIANGLES)
+    std::vector<BVHTriangle4, Eigen::aligned_allocator<BVHTriangle4>> m_triangles; ///< Triangles in the order of \ref m_indices
+#endif
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
+
+    /* The traversal code accesses the nodes and indices through these
+       pointers, which refer either to the arrays above or to a cache file */
+    const TraversalNode *m_nodeData = nullptr; ///< 4-ary BVH nodes used for traversal
+    uint32_t m_nodeCount = 0;             ///< Number of entries in \ref m_nodeData
+    const uint32_t *m_indexData = nullptr; ///< Triangle indices used for traversal
+    uint32_t m_indexCount = 0;            ///< Number of entries in \ref m_indexData
+    EBuildMethod m_buildMethod = ESAH;    ///< Construction algorithm
+    float m_splitBudget = 0.5f;           ///< Reference budget of spatial splits
+    uint32_t m_binCount = 16;             ///< SAH bins per axis
+    float m_rebuildThreshold = 1.5f;      ///< Relative SAH cost increase that triggers a rebuild
+    float m_buildCost = 0.0f;             ///< SAH cost after the last build
+    std::string m_cacheDirectory;         ///< Location of BVH cache files (if any)
+    std::unique_ptr<MemoryMappedFile> m_cacheFile; ///< Mapped cache file (if any)
 };
 
 NORI_NAMESPACE_END
@@ -20,6 +20,7 @@
 #define __NORI_CAMERA_H
 
 #include <nori/object.h>
+#include <nori/packet.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -62,6 +63,35 @@ public:
         const Point2f &samplePosition,
         const Point2f &apertureSample) const = 0;
 
+    /**
+     * \brief Importance sample the rays of a group of nearby film
+     * positions, and collect them into a packet for coherent tracing
+     *
+     * The default implementation calls \ref sampleRayDifferential()
+     * for every sample position.
+     *
+     * \param rays
+     *    Array of \c count ray data structures to be filled
+     *
+     * \param packet
+     *    Packet that receives copies of the (non-differential) rays
+     *
+     * \param weights
+     *    Array of \c count importance weights (see \ref sampleRay())
+     *
+     * \param count
+     *    Number of rays to sample (at most \ref RayPacket::Size)
+     */
+    virtual void sampleRayPacket(RayDifferential *rays, RayPacket &packet,
+        Color3f *weights, const Point2f *samplePositions,
+        const Point2f *apertureSamples, int count) const {
+        packet.active = 0;
+        for (int i = 0; i < count; ++i) {
+            weights[i] = sampleRayDifferential(rays[i], samplePositions[i], apertureSamples[i]);
+            packet.setRay(i, rays[i]);
+        }
+    }
+
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
 
@@ -125,7 +125,9 @@ class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
 class Integrator;
+struct Intersection;
 class KDTree;
 class Emitter;
 struct EmitterQueryRecord;
@@ -137,6 +139,8 @@ class PhaseFunction;
 class ReconstructionFilter;
 class Sampler;
 class Scene;
+struct WavefrontPath;
+struct WavefrontShadowRay;
 
 /// Import cout, cerr, endl for debugging purposes
 using std::cout;
@@ -146,6 +150,10 @@ using std::endl;
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
 
+/// Read-only views of matrix data that may be owned elsewhere (e.g. a mapped file)
+typedef Eigen::Map<const MatrixXf> MatrixXfView;
+typedef Eigen::Map<const MatrixXu> MatrixXuView;
+
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
 public:
@@ -195,6 +203,9 @@ extern std::string timeString(double time, bool precise = false);
 /// Convert a memory amount in bytes into a human-readable string
 extern std::string memString(size_t size, bool precise = false);
 
+/// Quote a string for use in a JSON file
+extern std::string jsonString(const std::string &value);
+
 /// Measures associated with probability distributions
 enum EMeasure {
     EUnknownMeasure = 0,
@@ -0,0 +1,73 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_INSTANCE_H)
+#define __NORI_INSTANCE_H
+
+#include <nori/object.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a shared mesh in the scene
+ *
+ * Instances reference a mesh that was declared with an \c id attribute
+ * and place it using their \c toWorld transformation, e.g.
+ *
+ * <pre>
+ * &lt;mesh type="obj" id="tree"&gt; ... &lt;/mesh&gt;
+ * &lt;instance type="instance"&gt;
+ *     &lt;ref id="tree"/&gt;
+ *     &lt;transform name="toWorld"&gt; ... &lt;/transform&gt;
+ * &lt;/instance&gt;
+ * </pre>
+ *
+ * The geometry (and BVH) of the mesh is stored only once, no matter
+ * how many instances refer to it. A mesh that is referenced by
+ * instances is not rendered at its original location.
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &propList);
+
+    /// Return the shared mesh
+    Mesh *getMesh() const { return m_mesh; }
+
+    /// Return the object-to-world transformation
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Register the referenced mesh
+    virtual void addChild(NoriObject *child);
+
+    /// Check that a mesh was specified
+    virtual void activate();
+
+    /// Return a human-readable summary of this instance
+    virtual std::string toString() const;
+
+    virtual EClassType getClassType() const { return EInstance; }
+
+private:
+    Mesh *m_mesh = nullptr;
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_INSTANCE_H */
@@ -56,6 +56,49 @@ public:
 
     virtual Color3f Li(const Scene* scene, Sampler *sampler, const RayDifferential &rayDifferential) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose first
+     * intersection was already found by a packet query
+     *
+     * Integrators that override this function should also return \c true
+     * from \ref usesPrimaryIntersection(), which lets the renderer trace
+     * camera rays in packets. The default implementation discards the
+     * intersection and traces the ray again.
+     *
+     * \param its
+     *    Intersection of \c rayDifferential with the scene,
+     *    or \c nullptr if the ray escaped
+     */
+    virtual Color3f Li(const Scene *scene, Sampler *sampler,
+            const RayDifferential &rayDifferential, const Intersection *its) const {
+        return Li(scene, sampler, rayDifferential);
+    }
+
+    /// Does \ref Li() make use of a precomputed primary intersection?
+    virtual bool usesPrimaryIntersection() const { return false; }
+
+    /// Can the integrator be used with the \ref WavefrontRenderer?
+    virtual bool supportsWavefront() const { return false; }
+
+    /**
+     * \brief Shade the current intersection of a path in the wavefront renderer
+     *
+     * This function is called for every path whose ray was intersected in
+     * the previous stage (\c path.hit tells whether something was found).
+     * It may add radiance to the path, queue shadow rays whose contribution
+     * is added when they turn out to be unoccluded, and continue the path
+     * by replacing \c path.ray with an extension ray.
+     *
+     * \param pathIndex
+     *    Index of the path, which must be stored in queued shadow rays
+     *
+     * \return \c true if the path continues with \c path.ray
+     */
+    virtual bool shadeWavefront(const Scene *scene, Sampler *sampler, uint32_t pathIndex,
+            WavefrontPath &path, std::vector<WavefrontShadowRay> &shadowRays) const {
+        throw NoriException("Integrator::shadeWavefront(): not supported by this integrator!");
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -83,10 +83,10 @@ public:
     virtual void activate();
 
     /// Return the total number of triangles in this hsape
-    uint32_t getTriangleCount() const { return (uint32_t) m_F.cols(); }
+    uint32_t getTriangleCount() const { return (uint32_t) getIndices().cols(); }
 
     /// Return the total number of vertices in this hsape
-    uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
+    uint32_t getVertexCount() const { return (uint32_t) getVertexPositions().cols(); }
 
     /**
      * \brief Uniformly sample a position on the mesh with
@@ -134,16 +134,38 @@ public:
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
     /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    MatrixXfView getVertexPositions() const {
+        return m_mappedV ? MatrixXfView(m_mappedV, 3, m_mappedVertexCount)
+                         : MatrixXfView(m_V.data(), m_V.rows(), m_V.cols());
+    }
+
+    /**
+     * \brief Replace the vertex positions (and normals) of the mesh in place,
+     * e.g. to move on to the next frame of an animation
+     *
+     * The topology must not change. Meshes with vertex normals need new
+     * normals as well. A \ref BVH containing the mesh must be updated
+     * by calling \ref BVH::refit() afterwards.
+     */
+    void setVertexPositions(const MatrixXf &V, const MatrixXf &N = MatrixXf());
 
     /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    MatrixXfView getVertexNormals() const {
+        return m_mappedN ? MatrixXfView(m_mappedN, 3, m_mappedVertexCount)
+                         : MatrixXfView(m_N.data(), m_N.rows(), m_N.cols());
+    }
 
     /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    MatrixXfView getVertexTexCoords() const {
+        return m_mappedUV ? MatrixXfView(m_mappedUV, 2, m_mappedVertexCount)
+                          : MatrixXfView(m_UV.data(), m_UV.rows(), m_UV.cols());
+    }
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    MatrixXuView getIndices() const {
+        return m_mappedF ? MatrixXuView(m_mappedF, 3, m_mappedTriangleCount)
+                         : MatrixXuView(m_F.data(), m_F.rows(), m_F.cols());
+    }
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -185,6 +207,16 @@ protected:
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
+
+    /* Subclasses may point the following at memory that they own (e.g. a
+       memory mapped file) instead of filling the matrices above. A null
+       pointer selects the corresponding matrix. */
+    const float    *m_mappedV = nullptr;  ///< External vertex positions (3 x vertex count)
+    const float    *m_mappedN = nullptr;  ///< External vertex normals (3 x vertex count)
+    const float    *m_mappedUV = nullptr; ///< External texture coordinates (2 x vertex count)
+    const uint32_t *m_mappedF = nullptr;  ///< External faces (3 x triangle count)
+    uint32_t m_mappedVertexCount = 0;     ///< Vertex count of the external arrays
+    uint32_t m_mappedTriangleCount = 0;   ///< Triangle count of the external faces
 };
 
 NORI_NAMESPACE_END
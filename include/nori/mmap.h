@@ -0,0 +1,79 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_MMAP_H)
+#define __NORI_MMAP_H
+
+#include <nori/common.h>
+#include <functional>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only memory mapped file
+ *
+ * Maps the entire contents of a file into the address space of the
+ * process, which allows accessing it without reading it into a separate
+ * buffer first. Pages are loaded by the operating system on demand.
+ */
+class MemoryMappedFile {
+public:
+    /// Map the given file into memory (throws a \ref NoriException on failure)
+    MemoryMappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MemoryMappedFile();
+
+    /// Return a pointer to the mapped file contents
+    const uint8_t *getData() const { return (const uint8_t *) m_data; }
+
+    /// Return the size of the file in bytes
+    size_t getSize() const { return m_size; }
+
+    /// Return the name of the mapped file
+    const std::string &getFilename() const { return m_filename; }
+
+private:
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+    std::string m_filename;
+    void *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(PLATFORM_WINDOWS)
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
+
+/**
+ * \brief Atomically replace the contents of a file
+ *
+ * The callback writes the new contents into a temporary file with a unique
+ * name next to \c filename, which is then renamed over it. Other processes
+ * and threads (e.g. ones that map the file using \ref MemoryMappedFile)
+ * hence see either the previous or the complete new file, even while
+ * several writers produce the same file concurrently. Throws a \ref
+ * NoriException on failure.
+ */
+extern void writeFileAtomic(const std::string &filename,
+    const std::function<void(std::ostream &)> &write);
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_MMAP_H */
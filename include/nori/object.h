@@ -43,6 +43,7 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EInstance,
         EClassTypeCount
     };
 
@@ -72,6 +73,18 @@ public:
      */
     virtual void setParent(NoriObject *parent);
 
+    /**
+     * \brief Prepare a child object ahead of \ref addChild()
+     *
+     * The XML parser constructs meshes in parallel and calls this
+     * function on the worker thread right after a mesh has been
+     * activated, possibly concurrently for several children.
+     * Subclasses may override it to start expensive per-child work
+     * early; \ref addChild() is still called later on, in the order
+     * of the XML file. The default implementation does nothing.
+     */
+    virtual void prepareChild(NoriObject *child);
+
     /**
      * \brief Perform some action associated with the object
      *
@@ -99,6 +112,7 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EInstance:   return "instance";
             default:          return "<unknown>";
         }
     }
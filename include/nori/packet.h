@@ -0,0 +1,67 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_PACKET_H)
+#define __NORI_PACKET_H
+
+#include <nori/ray.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Small group of rays that are traced together
+ *
+ * Coherent rays (e.g. camera rays through neighboring pixels) tend to
+ * visit the same BVH nodes. Tracing them as a packet lets them share
+ * the node fetches during traversal. Only the rays whose bit is set
+ * in the \c active mask take part in a query.
+ */
+struct RayPacket {
+    /// Maximum number of rays in a packet
+    static const int Size = 8;
+
+    /// Rays of the packet
+    Ray3f rays[Size];
+
+    /// Bit mask of the rays that are in use
+    uint32_t active = 0;
+
+    /// Create an empty packet
+    RayPacket() { }
+
+    /// Assign a ray and mark it as active
+    void setRay(int i, const Ray3f &ray) {
+        rays[i] = ray;
+        active |= 1u << i;
+    }
+
+    /// Is the ray with the given index in use?
+    bool isActive(int i) const { return (active & (1u << i)) != 0; }
+
+    /// Return the number of rays that are in use
+    uint32_t getActiveCount() const {
+        uint32_t count = 0;
+        for (uint32_t mask = active; mask != 0; mask &= mask - 1)
+            count++;
+        return count;
+    }
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_PACKET_H */
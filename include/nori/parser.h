@@ -26,8 +26,19 @@ NORI_NAMESPACE_BEGIN
 /**
  * \brief Load a scene from the specified filename and
  * return its root object
+ *
+ * Meshes are constructed in parallel (on the TBB worker threads) while
+ * the rest of the file is parsed. Other objects are created before
+ * their children, so that they can start working on a mesh as soon as
+ * it has been loaded (see \ref NoriObject::prepareChild()). All meshes
+ * have finished loading when this function returns.
+ *
+ * \param sceneProperties
+ *    Properties that override those specified for the
+ *    root scene (e.g. from the command line)
  */
-extern NoriObject *loadFromXML(const std::string &filename);
+extern NoriObject *loadFromXML(const std::string &filename,
+    const PropertyList &sceneProperties = PropertyList());
 
 NORI_NAMESPACE_END
 
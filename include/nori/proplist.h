@@ -126,6 +126,12 @@ public:
 
     /// Get a transform property, and use a default value if it does not exist
     Transform getTransform(const std::string &name, const Transform &defaultValue) const;
+
+    /// Copy all properties of another list, replacing properties of the same name
+    void merge(const PropertyList &other) {
+        for (const auto &property : other.m_properties)
+            m_properties[property.first] = property.second;
+    }
 private:
     /* Custom variant data type (stores one of boolean/integer/float/...) */
     struct Property {
@@ -108,20 +108,21 @@ template<typename _PointType, typename _VectorType> struct TRayDifferential
     typedef _PointType                  PointType;
     typedef _VectorType                 VectorType;
     typedef typename PointType::Scalar  Scalar;
+    typedef TRay<_PointType, _VectorType> Base;
 
-    TRayDifferential() : TRay() {
+    TRayDifferential() : Base() {
         m_quality = 0;
         m_hasRayDifferentials = false;
     }
 
-    TRayDifferential(int quality) : TRay() {
+    TRayDifferential(int quality) : Base() {
         m_quality = quality;
     }
 
-    TRayDifferential(const PointType &o, const VectorType &d) : TRay(o, d) {}
-    TRayDifferential(const TRay &ray) : TRay(ray) {}
-    TRayDifferential(const TRay &ray, Scalar mint, Scalar maxt) : TRay(ray, mint, maxt) {}
-    TRay<_PointType, _VectorType> getRay() const { return TRay(o, d, mint, maxt); }
+    TRayDifferential(const PointType &o, const VectorType &d) : Base(o, d) {}
+    TRayDifferential(const Base &ray) : Base(ray) {}
+    TRayDifferential(const Base &ray, Scalar mint, Scalar maxt) : Base(ray, mint, maxt) {}
+    Base getRay() const { return Base(this->o, this->d, this->mint, this->maxt); }
     
     void setStencilRay(const int index, const TRay<_PointType, _VectorType>& ray) {
         m_stencilRays.at(index) = ray;
@@ -32,19 +32,107 @@ public:
     RenderThread(ImageBlock & block);
     ~RenderThread();
 
-    void renderScene(const std::string & filename, bool singleThreaded);
+    /**
+     * \brief Load the given scene and start rendering it asynchronously
+     *
+     * \return \c false if the XML root object was not a scene
+     */
+    bool renderScene(const std::string & filename, bool singleThreaded);
 
     bool isBusy();
     void stopRendering();
 
+    /**
+     * \brief Block until the current rendering has finished
+     *
+     * \return \c true if the image was rendered and saved successfully
+     */
+    bool waitUntilDone();
+
     float getProgress();
 
+    /**
+     * \brief Copy the partially rendered image into the block passed to the
+     * constructor, without blocking the render workers
+     */
+    void updateBlock();
+
+    /// Set the number of worker threads (-1: one per core)
+    void setThreadCount(int threadCount) { m_threadCount = threadCount; }
+
+    /// Override the sample count of the scene's sampler (0: use the scene's value)
+    void setSampleCount(uint32_t sampleCount) { m_sampleCount = sampleCount; }
+
+    /**
+     * \brief Set the number of samples that each tile task renders per pass
+     *
+     * A value of 1 refines the whole image progressively one sample at a
+     * time (useful for the GUI), while 0 renders all samples of a tile in a
+     * single task, so that there is no barrier between the samples.
+     */
+    void setSamplesPerPass(uint32_t samplesPerPass) { m_samplesPerPass = samplesPerPass; }
+
+    /**
+     * \brief Render with the \ref WavefrontRenderer, which processes the
+     * samples of a tile as streams of rays (if the integrator supports it)
+     */
+    void setWavefront(bool wavefront) { m_wavefront = wavefront; }
+
+    /**
+     * \brief Override the BVH construction algorithm of the scene
+     * ("sah", "sbvh", "lbvh" or "hlbvh", empty: use the scene's choice)
+     */
+    void setBVHBuilder(const std::string &builder) { m_bvhBuilder = builder; }
+
+    /// Build a separate BVH per mesh while the scene is loading (see the scene's \c bvhPerMesh)
+    void setBVHPerMesh(bool perMesh) { m_bvhPerMesh = perMesh; }
+
+    /// Override the output filename (empty: derive it from the scene filename)
+    void setOutputName(const std::string &outputName) { m_outputName = outputName; }
+
+    /**
+     * \brief Record a timeline of the loading, BVH construction and
+     * rendering phases and write it to the given Chrome trace file
+     * (empty: disabled), see \ref Tracer
+     */
+    void setTraceName(const std::string &traceName) { m_traceName = traceName; }
+
+    /// Return the time (ms) spent loading the last scene, excluding the BVH construction
+    double getLoadTime() const { return m_loadTime; }
+
+    /// Return the time (ms) spent building the BVHs of the last scene
+    double getBuildTime() const { return m_buildTime; }
+
+    /// Return the time (ms) spent in the integrator's preprocessing step (e.g. photon tracing)
+    double getPreprocessTime() const { return m_preprocessTime; }
+
+    /// Return the time (ms) spent rendering the last scene (valid once it is done)
+    double getRenderTime() const { return m_renderTime; }
+
+    /// Return the number of rays traced while rendering the last scene (valid once it is done)
+    uint64_t getRayCount() const { return m_rayCount; }
+
 protected:
     Scene* m_scene = nullptr;
     ImageBlock & m_block;
+    std::unique_ptr<Film> m_film;
     std::thread m_render_thread;
     std::atomic<int> m_render_status; // 0: free, 1: busy, 2: interruption, 3: done
     std::atomic<float> m_progress;
+    std::atomic<bool> m_render_failed;
+    int m_threadCount = -1;
+    uint32_t m_sampleCount = 0;
+    uint32_t m_samplesPerPass = 1;
+    bool m_wavefront = false;
+    bool m_bvhPerMesh = false;
+    std::string m_outputName;
+    std::string m_bvhBuilder;
+    std::string m_traceName;
+    double m_loadTime = 0;
+    double m_buildTime = 0;
+    double m_preprocessTime = 0;
+    double m_renderTime = 0;
+    std::atomic<uint64_t> m_rayCount;
 
 };
 
@@ -21,6 +21,8 @@
 
 #include <nori/bvh.h>
 #include <nori/emitter.h>
+#include <nori/stats.h>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
@@ -87,6 +89,8 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its) const {
+        NORI_STATS(Statistics::local().rays++);
+        localRayCount()++;
         return m_bvh->rayIntersect(ray, its, false);
     }
 
@@ -107,9 +111,51 @@ public:
      */
     bool rayIntersect(const Ray3f &ray) const {
         Intersection its; /* Unused */
+        NORI_STATS(Statistics::local().shadowRays++);
+        localRayCount()++;
         return m_bvh->rayIntersect(ray, its, true);
     }
 
+    /**
+     * \brief Intersect a packet of coherent rays against all triangles
+     * stored in the scene and return detailed intersection information
+     *
+     * \param packet
+     *    Up to \ref RayPacket::Size rays, e.g. camera rays of neighboring pixels
+     *
+     * \param its
+     *    Array of \ref RayPacket::Size intersection records. Entry \c i is
+     *    filled if ray \c i found an intersection
+     *
+     * \return Bit mask of the rays that found an intersection
+     */
+    uint32_t rayIntersect(const RayPacket &packet, Intersection *its) const {
+        NORI_STATS(Statistics::local().addPacket(packet.active, false));
+        localRayCount() += packet.getActiveCount();
+        return m_bvh->rayIntersect(packet, its, false);
+    }
+
+    /**
+     * \brief Intersect a packet of coherent rays against all triangles
+     * stored in the scene and \a only determine which of them are occluded
+     *
+     * \return Bit mask of the rays that found an intersection
+     */
+    uint32_t rayIntersect(const RayPacket &packet) const {
+        Intersection its[RayPacket::Size]; /* Unused */
+        NORI_STATS(Statistics::local().addPacket(packet.active, true));
+        localRayCount() += packet.getActiveCount();
+        return m_bvh->rayIntersect(packet, its, true);
+    }
+
+    /**
+     * \brief Update the acceleration data structure after the vertex
+     * positions of meshes changed (see \ref Mesh::setVertexPositions())
+     *
+     * \return \c true if the BVH had to be rebuilt
+     */
+    bool refit() { return m_bvh->refit(); }
+
     /**
      * \brief Return an axis-aligned box that bounds the scene
      */
@@ -117,6 +163,9 @@ public:
         return m_bvh->getBoundingBox();
     }
 
+    /// Return the time (in milliseconds) spent building the BVHs in \ref activate()
+    double getBuildTime() const { return m_buildTime; }
+
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
@@ -128,6 +177,16 @@ public:
     /// Add a child object to the scene (meshes, integrators etc.)
     virtual void addChild(NoriObject *obj);
 
+    /**
+     * \brief Inherited from \ref NoriObject::prepareChild()
+     *
+     * When the scene is configured with \c bvhPerMesh, this builds the
+     * bottom-level BVH of a mesh as soon as it has been loaded, while
+     * other mesh files are still being read. \ref activate() then only
+     * needs to build a top-level BVH over these.
+     */
+    virtual void prepareChild(NoriObject *obj);
+
     /// Return a string summary of the scene (for debugging purposes)
     virtual std::string toString() const;
 
@@ -135,10 +194,16 @@ public:
 private:
     std::vector<Mesh *> m_meshes;
     std::vector<Emitter *> m_emitters;
+    std::vector<Instance *> m_instances;
+    std::vector<BVH *> m_bottomLevel;       // shared BVHs of instanced geometry (if any)
+    std::map<const Mesh *, BVH *> m_meshBVHs; // per-mesh BVHs built while loading
+    std::mutex m_meshBVHMutex;              // protects m_meshBVHs
+    bool m_bvhPerMesh = false;              // one bottom-level BVH per mesh?
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     BVH *m_bvh = nullptr;
+    double m_buildTime = 0;                 // milliseconds spent building the BVHs
     int m_primitiveIds;                     // we keep a running track of primitive ids
     int m_objectIds;                        // running track of different objects
 
@@ -0,0 +1,110 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_STATS_H)
+#define __NORI_STATS_H
+
+#include <nori/common.h>
+
+/**
+ * Performance counters are only compiled in when Nori is built with
+ * \c NORI_STATISTICS. Code that updates them is wrapped into this macro,
+ * for instance
+ *
+ *     NORI_STATS(ThreadStatistics &stats = Statistics::local());
+ *     NORI_STATS(stats.nodeVisits++);
+ */
+#if defined(NORI_STATISTICS)
+#  define NORI_STATS(...) __VA_ARGS__
+#else
+#  define NORI_STATS(...)
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Performance counters of a single thread
+struct ThreadStatistics {
+    uint64_t rays = 0;          ///< Rays traced for the closest intersection
+    uint64_t shadowRays = 0;    ///< Rays traced for occlusion only
+    uint64_t packets = 0;       ///< Ray packets traced
+    uint64_t packetRays = 0;    ///< Rays of these packets (also counted above)
+    uint64_t nodeVisits = 0;    ///< Ray-node tests (one per ray and 4-ary BVH node)
+    uint64_t triangleTests = 0; ///< Ray-triangle tests
+    uint64_t samples = 0;       ///< Pixel samples rendered
+    uint64_t blocks = 0;        ///< Image blocks rendered
+    double busyTime = 0;        ///< Milliseconds spent rendering image blocks
+
+    /// Count a ray packet with the given bit mask of active rays
+    void addPacket(uint32_t active, bool shadow) {
+        uint64_t count = 0;
+        for (; active != 0; active &= active - 1)
+            count++;
+        packets++;
+        packetRays += count;
+        (shadow ? shadowRays : rays) += count;
+    }
+
+    /// Add the counters of another thread
+    void add(const ThreadStatistics &other);
+};
+
+/**
+ * \brief Return the number of rays traced by the calling thread
+ *
+ * Unlike \ref ThreadStatistics, this counter is always enabled, since one
+ * thread-local increment per ray is negligible next to the traversal. The
+ * renderer sums it up per image block to report the ray throughput.
+ */
+inline uint64_t &localRayCount() {
+    static thread_local uint64_t count = 0;
+    return count;
+}
+
+/**
+ * \brief Registry of the per-thread performance counters
+ *
+ * Every thread updates its own \ref ThreadStatistics record without
+ * synchronization. The records are summed up once the render workers
+ * are idle, which yields an end-of-render report and a JSON file for
+ * tracking the performance of a scene over time.
+ */
+class Statistics {
+public:
+    /// Return the counters of the calling thread
+    static ThreadStatistics &local();
+
+    /// Reset the counters of all threads (the workers must be idle)
+    static void reset();
+
+    /// Return the counters of all threads that did any work
+    static std::vector<ThreadStatistics> getThreads();
+
+    /// Return a human-readable report for a render that took the given time (ms)
+    static std::string report(double renderTime);
+
+    /// Write the counters of a render that took the given time (ms) to a JSON file
+    static void writeJSON(const std::string &filename, const std::string &scene,
+        double renderTime);
+
+    /// Return a high-resolution time stamp in milliseconds for measuring busy times
+    static double now();
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_STATS_H */
@@ -0,0 +1,99 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_TRACE_H)
+#define __NORI_TRACE_H
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Timeline of the phases of a run (loading, BVH construction,
+ * rendering of individual blocks, ..) across all threads
+ *
+ * While recording, every \ref TraceScope adds an event to a buffer of
+ * the calling thread. The events can be written to a JSON file in the
+ * Chrome trace event format, which can be opened in chrome://tracing or
+ * https://ui.perfetto.dev to spot idle threads, stragglers and phases
+ * that run serially. When not recording, scopes only check a flag.
+ */
+class Tracer {
+public:
+    /// Discard previously recorded events and start recording
+    static void start();
+
+    /// Stop recording and write the events to a Chrome trace file
+    static void write(const std::string &filename);
+
+    /// Are events being recorded?
+    static bool isEnabled();
+
+    /// Record an event of the calling thread that spans [start, end] (in microseconds)
+    static void record(const char *category, const char *name,
+        const std::string &detail, double start, double end);
+
+    /// Return the current time in microseconds since the recording started
+    static double now();
+};
+
+/**
+ * \brief Records a trace event that spans the lifetime of this object
+ *
+ * \code
+ * TraceScope scope("bvh", "BVH::build");
+ * \endcode
+ */
+class TraceScope {
+public:
+    /// Begin an event (the strings must outlive the recording)
+    TraceScope(const char *category, const char *name)
+        : m_category(category), m_name(name), m_active(Tracer::isEnabled()) {
+        if (m_active)
+            m_start = Tracer::now();
+    }
+
+    /// End the event and add it to the trace
+    ~TraceScope() {
+        if (m_active)
+            Tracer::record(m_category, m_name, m_detail, m_start, Tracer::now());
+    }
+
+    /// Attach a description to the event, e.g. the name of a loaded file
+    void setDetail(const std::string &detail) {
+        if (m_active)
+            m_detail = detail;
+    }
+
+    /// Is the event being recorded?
+    bool isActive() const { return m_active; }
+
+private:
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    const char *m_category;
+    const char *m_name;
+    std::string m_detail;
+    double m_start = 0;
+    bool m_active;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_TRACE_H */
@@ -0,0 +1,102 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_WAVEFRONT_H)
+#define __NORI_WAVEFRONT_H
+
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// State of a single path that is traced by the \ref WavefrontRenderer
+struct WavefrontPath {
+    /// Position of the sample on the film
+    Point2f pixelSample;
+    /// Ray that will be intersected in the next stage
+    Ray3f ray;
+    /// Intersection of \c ray with the scene (valid if \c hit is set)
+    Intersection its;
+    /// Did \c ray intersect the scene?
+    bool hit;
+    /// Product of the camera weight and the path throughput so far
+    Color3f throughput;
+    /// Radiance accumulated along the path
+    Color3f radiance;
+    /// Number of ray segments traced so far
+    uint32_t depth;
+};
+
+/// Shadow ray queued while shading a \ref WavefrontPath
+struct WavefrontShadowRay {
+    /// Ray towards the light source
+    Ray3f ray;
+    /// Radiance that is added to the path when the ray is unoccluded
+    Color3f contribution;
+    /// Index of the path that queued the ray
+    uint32_t path;
+};
+
+/**
+ * \brief Stream (wavefront) renderer for integrators that support it
+ *
+ * Instead of tracing one path at a time, this renderer processes a
+ * large batch of paths in stages: it generates the camera rays of all
+ * samples of an image block, intersects them as a stream of packets,
+ * sorts the hits by mesh (and thereby BSDF), shades them in this order
+ * and finally traces the queued shadow rays as another stream. Paths
+ * that continue repeat these stages with their extension rays.
+ *
+ * Working on one kind of task at a time keeps the BVH, mesh and BSDF
+ * data of that task in the caches, see
+ *
+ * "Megakernels Considered Harmful: Wavefront Path Tracing on GPUs"
+ * by S. Laine, T. Karras, and T. Aila (High-Performance Graphics 2013)
+ *
+ * Integrators take part by implementing \ref Integrator::shadeWavefront().
+ */
+class WavefrontRenderer {
+public:
+    /**
+     * \brief Create a renderer for the given scene
+     *
+     * \param waveSize
+     *    Maximum number of paths that are processed together
+     */
+    WavefrontRenderer(const Scene *scene, uint32_t waveSize = 65536);
+
+    /// Render \c sampleCount samples for every pixel of the given block
+    void render(Sampler *sampler, ImageBlock &block, uint32_t sampleCount);
+
+protected:
+    /// Intersect the rays of the paths in \ref m_active with the scene
+    void intersect();
+
+    /// Trace the queued shadow rays and add the contributions of unoccluded ones
+    void traceShadowRays();
+
+private:
+    const Scene *m_scene;
+    uint32_t m_waveSize;
+    std::vector<WavefrontPath> m_paths;
+    std::vector<uint32_t> m_active, m_next;
+    std::vector<WavefrontShadowRay> m_shadowRays;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_WAVEFRONT_H */
@@ -0,0 +1,44 @@
+#!python
+
+import struct
+
+# Write a binary PLY file with one quad and one triangle that together
+# cover the square [-1, 1] x [-1, 1] in the y = 0 plane, facing +y. The
+# faces carry an additional scalar property that the loader must skip.
+# The same mesh is also written as an OBJ file with CRLF line endings and
+# "p//n" face vertices. test-mesh-formats.xml checks that the quad is split
+# into two triangles which leave no holes, for both files and for the
+# binary mesh file that meshconvert creates from the PLY file.
+
+vertices = [(-1, 0, -1), (-1, 0, 1), (0, 0, 1), (0, 0, -1), (1, 0, 0)]
+faces = [(0, 1, 2, 3), (3, 2, 4)]
+
+header = "\n".join([
+    "ply",
+    "format binary_little_endian 1.0",
+    "comment Test mesh for the PLY loader (see quad-and-triangle.py)",
+    "element vertex %i" % len(vertices),
+    "property float x",
+    "property float y",
+    "property float z",
+    "element face %i" % len(faces),
+    "property list uchar int vertex_indices",
+    "property uchar material",
+    "end_header"]) + "\n"
+
+data = bytearray(header.encode("ascii"))
+for v in vertices:
+    data += struct.pack("<3f", *v)
+for f in faces:
+    data += struct.pack("<B%ii" % len(f), len(f), *f) + struct.pack("<B", 0)
+
+with open("quad-and-triangle.ply", "wb") as f:
+    f.write(data)
+
+lines = ["# Test mesh for the OBJ loader (see quad-and-triangle.py)", "o quad-and-triangle"]
+lines += ["v %g %g %g" % v for v in vertices]
+lines += ["vn 0 1 0"]
+lines += ["f " + " ".join("%i//1" % (i + 1) for i in f) for f in faces]
+
+with open("quad-and-triangle.obj", "wb") as f:
+    f.write(("\r\n".join(lines) + "\r\n").encode("ascii"))
@@ -0,0 +1,496 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/block.h>
+#include <nori/bitmap.h>
+#include <nori/render.h>
+#include <filesystem/path.h>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#  include <psapi.h>
+#else
+#  include <sys/resource.h>
+#endif
+
+/* Scene benchmark: renders a list of scenes headless and records the time
+   spent in each phase, the ray throughput, the peak memory usage and the
+   error with respect to a reference image. The results are written to a
+   JSON file, and optionally compared against the file of an earlier run
+   to catch performance regressions. The samplers are seeded with the
+   position of each image block, hence every run traces the same rays.
+   Every scene is rendered by a child process (the benchmark invokes itself
+   with --child), so that the peak memory usage is that of a single scene. */
+
+using namespace nori;
+
+static const double NaN = std::numeric_limits<double>::quiet_NaN();
+
+/* One entry of the scene list */
+struct BenchScene {
+    std::string scene;
+    std::string reference;
+    int sampleCount = 0;
+};
+
+/* Measurements of one scene (NaN: not available) */
+struct BenchResult {
+    std::string scene;
+    double loadTime = NaN, buildTime = NaN, preprocessTime = NaN, renderTime = NaN;
+    double mraysPerSecond = NaN, peakMemory = NaN, rmse = NaN;
+    bool failed = false;
+};
+
+static void help(const char *name) {
+    std::cout << "Syntax: " << name << " [options] <scene list or scene.xml> .." << std::endl
+              << "Options:" << std::endl
+              << "   -t, --threads <count>      Number of worker threads (default: one per core)" << std::endl
+              << "   -s, --spp <count>          Sample count of scenes that do not specify one" << std::endl
+              << "   -r, --repeat <count>       Render every scene several times and keep the" << std::endl
+              << "                              fastest run (default: 1)" << std::endl
+              << "   -o, --output <file>        Results file (default: benchmark.json). The" << std::endl
+              << "                              images are stored next to it" << std::endl
+              << "   -c, --compare <file>       Compare against the results of an earlier run" << std::endl
+              << "   --time-threshold <f>       Tolerated relative slowdown (default: 0.1)" << std::endl
+              << "   --memory-threshold <f>     Tolerated relative memory increase (default: 0.1)" << std::endl
+              << "   --rmse-threshold <f>       Tolerated relative error increase (default: 0.05)" << std::endl
+              << "   -h, --help                 Display this help text" << std::endl
+              << std::endl
+              << "Every line of a scene list has the form" << std::endl
+              << "   <scene.xml> [sample count or -] [reference.exr]" << std::endl
+              << "with paths relative to the list, see scenes/benchmark.txt. The exit status" << std::endl
+              << "is 1 if a scene regressed." << std::endl;
+}
+
+/* Return the peak resident set size of the process in bytes */
+static double peakMemoryUsage() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return NaN;
+    return (double) counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return NaN;
+#  if defined(__APPLE__)
+    return (double) usage.ru_maxrss;
+#  else
+    return (double) usage.ru_maxrss * 1024.0;
+#  endif
+#endif
+}
+
+/* Read a scene list (one scene per line, '#' starts a comment) */
+static std::vector<BenchScene> loadSceneList(const std::string &filename) {
+    std::ifstream is(filename);
+    if (is.fail())
+        throw NoriException("Unable to open the scene list \"%s\"!", filename);
+
+    filesystem::path base = filesystem::path(filename).parent_path();
+    auto resolve = [&](const std::string &name) {
+        filesystem::path path(name);
+        return (path.is_absolute() || base.empty()) ? path.str() : (base / path).str();
+    };
+
+    std::vector<BenchScene> scenes;
+    std::string line;
+    while (std::getline(is, line)) {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream tokens(line);
+        std::string scene, sampleCount, reference;
+        if (!(tokens >> scene))
+            continue;
+        tokens >> sampleCount >> reference;
+
+        BenchScene entry;
+        entry.scene = resolve(scene);
+        if (!sampleCount.empty() && sampleCount != "-")
+            entry.sampleCount = toInt(sampleCount);
+        if (!reference.empty())
+            entry.reference = resolve(reference);
+        scenes.push_back(entry);
+    }
+    return scenes;
+}
+
+/* Root mean square error over all pixels and channels */
+static double computeRMSE(const Bitmap &image, const Bitmap &reference) {
+    if (image.rows() != reference.rows() || image.cols() != reference.cols())
+        throw NoriException("The reference image has a resolution of %ix%i instead of %ix%i!",
+            (int) reference.cols(), (int) reference.rows(), (int) image.cols(), (int) image.rows());
+
+    double sum = 0;
+    for (int y = 0; y < image.rows(); ++y) {
+        for (int x = 0; x < image.cols(); ++x) {
+            Color3f diff = image(y, x) - reference(y, x);
+            sum += (double) diff.matrix().squaredNorm();
+        }
+    }
+    return std::sqrt(sum / (3.0 * image.size()));
+}
+
+static std::string jsonNumber(double value) {
+    return std::isnan(value) ? std::string("null") : tfm::format("%.6g", value);
+}
+
+static void writeResults(const std::string &filename, const std::vector<BenchResult> &results,
+        int threadCount) {
+    std::ofstream os(filename);
+    os << "{" << endl
+       << "  \"threads\": " << threadCount << "," << endl
+       << "  \"scenes\": [" << endl;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        os << "    {" << endl
+           << "      \"scene\": " << jsonString(r.scene) << "," << endl
+           << "      \"failed\": " << (r.failed ? "true" : "false") << "," << endl
+           << "      \"loadTime\": " << jsonNumber(r.loadTime) << "," << endl
+           << "      \"buildTime\": " << jsonNumber(r.buildTime) << "," << endl
+           << "      \"preprocessTime\": " << jsonNumber(r.preprocessTime) << "," << endl
+           << "      \"renderTime\": " << jsonNumber(r.renderTime) << "," << endl
+           << "      \"mraysPerSecond\": " << jsonNumber(r.mraysPerSecond) << "," << endl
+           << "      \"peakMemory\": " << jsonNumber(r.peakMemory) << "," << endl
+           << "      \"rmse\": " << jsonNumber(r.rmse) << endl
+           << "    }" << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    os << "  ]" << endl << "}" << endl;
+
+    if (!os.good())
+        throw NoriException("Unable to write the results file \"%s\"!", filename);
+}
+
+/* Read a results file written by \ref writeResults(). This is not a general
+   JSON parser, it relies on every value being on a line of its own */
+static std::map<std::string, BenchResult> loadResults(const std::string &filename) {
+    std::ifstream is(filename);
+    if (is.fail())
+        throw NoriException("Unable to open the results file \"%s\"!", filename);
+
+    std::map<std::string, BenchResult> results;
+    BenchResult *current = nullptr;
+    std::string line;
+    while (std::getline(is, line)) {
+        size_t colon = line.find("\":");
+        size_t quote = line.find('"');
+        if (colon == std::string::npos || quote >= colon)
+            continue;
+        std::string key = line.substr(quote + 1, colon - quote - 1);
+        std::string value = line.substr(colon + 2);
+        while (!value.empty() && (value.back() == ',' || std::isspace((unsigned char) value.back())))
+            value.pop_back();
+        value.erase(0, value.find_first_not_of(" \t"));
+
+        if (key == "scene") {
+            /* Undo the escaping of \ref jsonString() */
+            std::string scene;
+            for (size_t i = 1; i + 1 < value.size(); ++i) {
+                if (value[i] == '\\' && i + 2 < value.size())
+                    ++i;
+                scene += value[i];
+            }
+            current = &results[scene];
+            current->scene = scene;
+            continue;
+        } else if (!current) {
+            continue;
+        }
+
+        double number = value == "null" ? NaN : std::atof(value.c_str());
+        if (key == "failed") current->failed = value == "true";
+        else if (key == "loadTime") current->loadTime = number;
+        else if (key == "buildTime") current->buildTime = number;
+        else if (key == "preprocessTime") current->preprocessTime = number;
+        else if (key == "renderTime") current->renderTime = number;
+        else if (key == "mraysPerSecond") current->mraysPerSecond = number;
+        else if (key == "peakMemory") current->peakMemory = number;
+        else if (key == "rmse") current->rmse = number;
+    }
+    return results;
+}
+
+/* Quote an argument of a command that is run by std::system() */
+static std::string quote(const std::string &arg) {
+#if defined(_WIN32)
+    return "\"" + arg + "\"";
+#else
+    std::string result = "'";
+    for (char c : arg)
+        result += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    return result + "'";
+#endif
+}
+
+/* Render a scene (possibly several times) and measure it. This runs in
+   the child process that is started by \ref runScene() */
+static BenchResult benchmark(const BenchScene &entry, const std::string &imageName,
+        int threadCount, int repeat) {
+    BenchResult result;
+    result.scene = entry.scene;
+
+    for (int i = 0; i < repeat; ++i) {
+        ImageBlock block(Vector2i(720, 720), nullptr);
+        RenderThread renderThread(block);
+        renderThread.setThreadCount(threadCount);
+        renderThread.setSampleCount((uint32_t) entry.sampleCount);
+        renderThread.setSamplesPerPass(0);
+        renderThread.setOutputName(imageName);
+
+        if (!renderThread.renderScene(entry.scene, false))
+            throw NoriException("The root element of \"%s\" is not a scene!", entry.scene);
+        if (!renderThread.waitUntilDone())
+            throw NoriException("Rendering \"%s\" failed!", entry.scene);
+
+        /* Keep the fastest of the runs */
+        auto keepMin = [](double &value, double sample) {
+            value = std::isnan(value) ? sample : std::min(value, sample);
+        };
+        keepMin(result.loadTime, renderThread.getLoadTime());
+        keepMin(result.buildTime, renderThread.getBuildTime());
+        keepMin(result.preprocessTime, renderThread.getPreprocessTime());
+        keepMin(result.renderTime, renderThread.getRenderTime());
+
+        if (renderThread.getRenderTime() > 0) {
+            double mrays = renderThread.getRayCount() / (renderThread.getRenderTime() * 1000.0);
+            result.mraysPerSecond = std::isnan(result.mraysPerSecond) ? mrays
+                : std::max(result.mraysPerSecond, mrays);
+        }
+    }
+    result.peakMemory = peakMemoryUsage();
+    return result;
+}
+
+/* Benchmark a scene in a child process and compare its image against the reference */
+static BenchResult runScene(const std::string &executable, const BenchScene &entry,
+        const std::string &imageName, int threadCount, int repeat) {
+    std::string resultName = imageName;
+    size_t lastdot = resultName.find_last_of(".");
+    if (lastdot != std::string::npos)
+        resultName.erase(lastdot, std::string::npos);
+    resultName += ".json";
+
+    std::string command = tfm::format("%s --child %s --image %s --repeat %i",
+        quote(executable), quote(resultName), quote(imageName), repeat);
+    if (threadCount > 0)
+        command += tfm::format(" --threads %i", threadCount);
+    if (entry.sampleCount > 0)
+        command += tfm::format(" --spp %i", entry.sampleCount);
+    command += " " + quote(entry.scene);
+#if defined(_WIN32)
+    /* cmd.exe removes the outermost quotes of the command line */
+    command = "\"" + command + "\"";
+#endif
+
+    std::remove(resultName.c_str());
+    int status = std::system(command.c_str());
+    std::map<std::string, BenchResult> results;
+    if (status == 0)
+        results = loadResults(resultName);
+    std::remove(resultName.c_str());
+    if (results.size() != 1 || results.begin()->second.failed)
+        throw NoriException("Benchmarking \"%s\" failed!", entry.scene);
+
+    BenchResult result = results.begin()->second;
+    result.scene = entry.scene;
+    if (!entry.reference.empty())
+        result.rmse = computeRMSE(Bitmap(imageName), Bitmap(entry.reference));
+    return result;
+}
+
+/* Report the changes of a scene with respect to an earlier run. Returns
+   \c true if any of the measurements regressed beyond the thresholds */
+static bool compare(const BenchResult &current, const BenchResult &previous,
+        float timeThreshold, float memoryThreshold, float rmseThreshold) {
+    bool regressed = false;
+
+    /* Differences below the timer resolution are ignored */
+    const double minTimeDifference = 10.0;
+
+    auto check = [&](const char *name, double value, double before, float threshold,
+                     bool higherIsWorse, double minDifference) {
+        if (std::isnan(value) || std::isnan(before))
+            return;
+        double change = before > 0 ? value / before - 1.0 : 0.0;
+        double worse = higherIsWorse ? change : -change;
+        bool bad = worse > threshold && std::abs(value - before) > minDifference;
+        cout << tfm::format("    %-16s %12.4g -> %12.4g (%+.1f%%)%s", name, before, value,
+            100.0 * change, bad ? "  REGRESSION" : "") << endl;
+        regressed |= bad;
+    };
+
+    check("load (ms)", current.loadTime, previous.loadTime, timeThreshold, true, minTimeDifference);
+    check("BVH build (ms)", current.buildTime, previous.buildTime, timeThreshold, true, minTimeDifference);
+    check("preprocess (ms)", current.preprocessTime, previous.preprocessTime, timeThreshold, true, minTimeDifference);
+    check("render (ms)", current.renderTime, previous.renderTime, timeThreshold, true, minTimeDifference);
+    check("Mrays/s", current.mraysPerSecond, previous.mraysPerSecond, timeThreshold, false, 0.0);
+    check("peak memory", current.peakMemory, previous.peakMemory, memoryThreshold, true, 0.0);
+    check("RMSE", current.rmse, previous.rmse, rmseThreshold, true, 1e-6);
+
+    if (current.failed && !previous.failed) {
+        cout << "    the scene failed to render  REGRESSION" << endl;
+        regressed = true;
+    }
+    return regressed;
+}
+
+int main(int argc, char **argv) {
+    std::vector<BenchScene> scenes;
+    std::string outputName = "benchmark.json", compareName, childName, childImageName;
+    int threadCount = -1, sampleCount = 0, repeat = 1;
+    float timeThreshold = 0.1f, memoryThreshold = 0.1f, rmseThreshold = 0.05f;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string token = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (token == "-h" || token == "--help") {
+                help(argv[0]);
+                return 0;
+            } else if ((token == "-t" || token == "--threads") && hasValue) {
+                threadCount = toInt(argv[++i]);
+                if (threadCount <= 0)
+                    throw NoriException("Invalid thread count: %i", threadCount);
+            } else if ((token == "-s" || token == "--spp") && hasValue) {
+                sampleCount = toInt(argv[++i]);
+                if (sampleCount <= 0)
+                    throw NoriException("Invalid sample count: %i", sampleCount);
+            } else if ((token == "-r" || token == "--repeat") && hasValue) {
+                repeat = toInt(argv[++i]);
+                if (repeat <= 0)
+                    throw NoriException("Invalid repetition count: %i", repeat);
+            } else if ((token == "-o" || token == "--output") && hasValue) {
+                outputName = argv[++i];
+            } else if ((token == "-c" || token == "--compare") && hasValue) {
+                compareName = argv[++i];
+            } else if (token == "--time-threshold" && hasValue) {
+                timeThreshold = toFloat(argv[++i]);
+            } else if (token == "--memory-threshold" && hasValue) {
+                memoryThreshold = toFloat(argv[++i]);
+            } else if (token == "--rmse-threshold" && hasValue) {
+                rmseThreshold = toFloat(argv[++i]);
+            } else if (token == "--child" && hasValue) {
+                childName = argv[++i];
+            } else if (token == "--image" && hasValue) {
+                childImageName = argv[++i];
+            } else if (token.size() > 0 && token[0] != '-') {
+                if (filesystem::path(token).extension() == "xml") {
+                    BenchScene entry;
+                    entry.scene = token;
+                    scenes.push_back(entry);
+                } else {
+                    std::vector<BenchScene> list = loadSceneList(token);
+                    scenes.insert(scenes.end(), list.begin(), list.end());
+                }
+            } else {
+                cerr << "Error: unexpected argument \"" << token << "\"" << endl;
+                help(argv[0]);
+                return -1;
+            }
+        }
+
+        if (scenes.empty()) {
+            help(argv[0]);
+            return -1;
+        }
+
+        /* Benchmark a single scene on behalf of runScene() */
+        if (!childName.empty()) {
+            if (scenes.size() != 1 || childImageName.empty())
+                throw NoriException("--child expects a single scene and an --image filename!");
+            BenchScene entry = scenes[0];
+            if (entry.sampleCount == 0)
+                entry.sampleCount = sampleCount;
+            writeResults(childName, { benchmark(entry, childImageName, threadCount, repeat) },
+                threadCount);
+            return 0;
+        }
+
+        /* Load the earlier results first, they may be overwritten below */
+        std::map<std::string, BenchResult> previous;
+        if (!compareName.empty())
+            previous = loadResults(compareName);
+
+        std::string imageBase = outputName;
+        size_t lastdot = imageBase.find_last_of(".");
+        if (lastdot != std::string::npos)
+            imageBase.erase(lastdot, std::string::npos);
+
+        std::vector<BenchResult> results;
+        for (size_t i = 0; i < scenes.size(); ++i) {
+            BenchScene entry = scenes[i];
+            if (entry.sampleCount == 0)
+                entry.sampleCount = sampleCount;
+
+            std::string stem = filesystem::path(entry.scene).filename();
+            if (stem.find_last_of(".") != std::string::npos)
+                stem.erase(stem.find_last_of("."), std::string::npos);
+            std::string imageName = tfm::format("%s_%i_%s.exr", imageBase, i, stem);
+
+            BenchResult result;
+            try {
+                result = runScene(argv[0], entry, imageName, threadCount, repeat);
+            } catch (const std::exception &e) {
+                cerr << "Error: " << e.what() << endl;
+                result.scene = entry.scene;
+                result.failed = true;
+            }
+            results.push_back(result);
+        }
+
+        writeResults(outputName, results, threadCount);
+
+        cout << endl << "Benchmark results:" << endl;
+        bool regressed = false;
+        for (const BenchResult &r : results) {
+            cout << "  " << r.scene << (r.failed ? " (failed)" : "") << endl;
+            auto it = previous.find(r.scene);
+            if (it != previous.end()) {
+                regressed |= compare(r, it->second, timeThreshold, memoryThreshold, rmseThreshold);
+            } else if (!r.failed) {
+                cout << tfm::format("    load %s, BVH build %s, preprocess %s, render %s",
+                    timeString(r.loadTime, true), timeString(r.buildTime, true),
+                    timeString(r.preprocessTime, true), timeString(r.renderTime, true)) << endl;
+                cout << tfm::format("    %s Mrays/s, peak memory %s, RMSE %s",
+                    jsonNumber(r.mraysPerSecond), std::isnan(r.peakMemory) ? std::string("null")
+                    : memString((size_t) r.peakMemory), jsonNumber(r.rmse)) << endl;
+            }
+            regressed |= r.failed;
+        }
+        cout << "Wrote the results to \"" << outputName << "\"." << endl;
+
+        if (regressed) {
+            cerr << "Error: the benchmark found regressions!" << endl;
+            return 1;
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
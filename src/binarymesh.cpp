@@ -0,0 +1,189 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/binarymesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <nori/trace.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <atomic>
+#include <cstring>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+static_assert(sizeof(BinaryMeshHeader) == 80, "Unexpected binary mesh header size");
+
+const uint32_t BinaryMeshHeader::VERSION;
+
+/// Alignment of the arrays within a binary mesh file
+static const uint64_t BINARY_MESH_ALIGNMENT = 64;
+
+void writeBinaryMesh(const Mesh *mesh, const std::string &filename) {
+    MatrixXfView V = mesh->getVertexPositions();
+    MatrixXfView N = mesh->getVertexNormals();
+    MatrixXfView UV = mesh->getVertexTexCoords();
+    MatrixXuView F = mesh->getIndices();
+
+    BinaryMeshHeader header;
+    memset(&header, 0, sizeof(BinaryMeshHeader));
+    memcpy(header.magic, "NORIMSH", 8);
+    header.version = BinaryMeshHeader::VERSION;
+    header.vertexCount = mesh->getVertexCount();
+    header.triangleCount = mesh->getTriangleCount();
+    for (int i = 0; i < 3; ++i) {
+        header.bboxMin[i] = mesh->getBoundingBox().min[i];
+        header.bboxMax[i] = mesh->getBoundingBox().max[i];
+    }
+
+    /* Lay out the arrays */
+    uint64_t offset = sizeof(BinaryMeshHeader);
+    auto place = [&](uint64_t size) {
+        offset = (offset + BINARY_MESH_ALIGNMENT - 1) / BINARY_MESH_ALIGNMENT * BINARY_MESH_ALIGNMENT;
+        uint64_t result = offset;
+        offset += size;
+        return result;
+    };
+    header.offsetV = place(sizeof(float) * V.size());
+    if (N.size() > 0)
+        header.offsetN = place(sizeof(float) * N.size());
+    if (UV.size() > 0)
+        header.offsetUV = place(sizeof(float) * UV.size());
+    header.offsetF = place(sizeof(uint32_t) * F.size());
+
+    writeFileAtomic(filename, [&](std::ostream &os) {
+        uint64_t written = 0;
+        auto write = [&](uint64_t position, const void *data, uint64_t size) {
+            static const char zeros[BINARY_MESH_ALIGNMENT] = { 0 };
+            os.write(zeros, (std::streamsize) (position - written));
+            os.write((const char *) data, (std::streamsize) size);
+            written = position + size;
+        };
+        write(0, &header, sizeof(BinaryMeshHeader));
+        write(header.offsetV, V.data(), sizeof(float) * V.size());
+        if (header.offsetN)
+            write(header.offsetN, N.data(), sizeof(float) * N.size());
+        if (header.offsetUV)
+            write(header.offsetUV, UV.data(), sizeof(float) * UV.size());
+        write(header.offsetF, F.data(), sizeof(uint32_t) * F.size());
+    });
+}
+
+/**
+ * \brief Loader for binary mesh files (see \ref BinaryMeshHeader)
+ *
+ * The file is memory mapped and the mesh refers to the arrays in the
+ * mapping, hence loading costs little more than the page faults when
+ * the data is first accessed. Only a non-identity \c toWorld transform
+ * requires a transformed copy of the vertex data.
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        TraceScope trace("load", "BinaryMesh");
+        trace.setDetail(filename.str());
+
+        try {
+            m_file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
+            throw NoriException("Unable to open binary mesh file \"%s\"!", filename);
+        }
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        Timer timer;
+
+        const uint8_t *data = m_file->getData();
+        uint64_t size = m_file->getSize();
+        const BinaryMeshHeader *header = (const BinaryMeshHeader *) data;
+        if (size < sizeof(BinaryMeshHeader) || memcmp(header->magic, "NORIMSH", 8) != 0)
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        if (header->version != BinaryMeshHeader::VERSION)
+            throw NoriException("Binary mesh file \"%s\" has version %i, expected %i "
+                "(convert it again with meshconvert)!", filename, header->version,
+                BinaryMeshHeader::VERSION);
+
+        /* Check that all arrays lie within the file */
+        auto array = [&](uint64_t offset, uint64_t rows, uint64_t cols, bool optional) -> const uint8_t * {
+            if (offset == 0 && optional)
+                return nullptr;
+            uint64_t bytes = rows * cols * sizeof(float);
+            if (offset < sizeof(BinaryMeshHeader) || offset % sizeof(float) != 0 ||
+                offset > size || bytes > size - offset)
+                throw NoriException("Binary mesh file \"%s\" is truncated or corrupt!", filename);
+            return data + offset;
+        };
+        m_mappedVertexCount = header->vertexCount;
+        m_mappedTriangleCount = header->triangleCount;
+        m_mappedV = (const float *) array(header->offsetV, 3, header->vertexCount, false);
+        m_mappedN = (const float *) array(header->offsetN, 3, header->vertexCount, true);
+        m_mappedUV = (const float *) array(header->offsetUV, 2, header->vertexCount, true);
+        m_mappedF = (const uint32_t *) array(header->offsetF, 3, header->triangleCount, false);
+
+        /* Out of range indices would cause invalid memory accesses later on.
+           The check faults in every page of the indices, hence it runs in parallel */
+        const uint32_t *F = m_mappedF, vertexCount = header->vertexCount;
+        std::atomic<bool> invalid(false);
+        tbb::parallel_for(tbb::blocked_range<uint64_t>(0, 3 * (uint64_t) header->triangleCount, 1 << 16),
+            [&](const tbb::blocked_range<uint64_t> &range) {
+                uint32_t maxIndex = 0;
+                for (uint64_t i = range.begin(); i != range.end(); ++i)
+                    maxIndex = std::max(maxIndex, F[i]);
+                if (maxIndex >= vertexCount)
+                    invalid = true;
+            }
+        );
+        if (invalid)
+            throw NoriException("Binary mesh file \"%s\" contains out of range vertex indices!", filename);
+
+        if (trafo.getMatrix().isIdentity()) {
+            m_bbox.min = Point3f(header->bboxMin[0], header->bboxMin[1], header->bboxMin[2]);
+            m_bbox.max = Point3f(header->bboxMax[0], header->bboxMax[1], header->bboxMax[2]);
+        } else {
+            /* Store transformed copies of the positions and normals */
+            m_V.resize(3, header->vertexCount);
+            for (uint32_t i = 0; i < header->vertexCount; ++i) {
+                Point3f p = trafo * Point3f(getVertexPositions().col(i));
+                m_bbox.expandBy(p);
+                m_V.col(i) = p;
+            }
+            m_mappedV = nullptr;
+
+            if (m_mappedN) {
+                m_N.resize(3, header->vertexCount);
+                for (uint32_t i = 0; i < header->vertexCount; ++i)
+                    m_N.col(i) = (trafo * Normal3f(getVertexNormals().col(i))).normalized();
+                m_mappedN = nullptr;
+            }
+        }
+
+        m_name = filename.str();
+        cout << tfm::format("Loaded \"%s\" (V=%i, F=%i, took %s, mapped %s)", filename,
+            getVertexCount(), getTriangleCount(), timer.elapsedString(),
+            memString(m_file->getSize())) << endl;
+    }
+
+private:
+    std::unique_ptr<MemoryMappedFile> m_file;
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "nmesh");
+NORI_NAMESPACE_END
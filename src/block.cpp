@@ -137,6 +137,160 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
+Film::Film(const Vector2i &size, const ReconstructionFilter *filter, int blockSize)
+        : m_image(size, filter), m_blockSize(blockSize) {
+    m_numBlocks = Vector2i(
+        (int) std::ceil(size.x() / (float) blockSize),
+        (int) std::ceil(size.y() / (float) blockSize));
+
+    int blockCount = m_numBlocks.x() * m_numBlocks.y();
+    int extent = blockSize + 2 * m_image.getBorderSize();
+    m_borders.resize(blockCount, BorderBuffer(extent, extent));
+    m_versions.reset(new std::atomic<uint32_t>[blockCount]);
+    clear();
+}
+
+void Film::clear() {
+    m_image.clear();
+    for (size_t i = 0; i < m_borders.size(); ++i) {
+        m_borders[i].setConstant(Color4f());
+        m_versions[i] = 0;
+    }
+}
+
+void Film::getBlock(uint32_t id, Point2i &offset, Vector2i &size) const {
+    offset = Point2i(id % m_numBlocks.x(), id / m_numBlocks.x()) * m_blockSize;
+    size = (m_image.getSize() - offset).cwiseMin(Vector2i::Constant(m_blockSize));
+}
+
+void Film::put(const ImageBlock &b) {
+    int border = m_image.getBorderSize();
+    if (b.getBorderSize() != border)
+        throw NoriException("Film::put(): incompatible reconstruction filters!");
+
+    const Point2i &offset = b.getOffset();
+    const Vector2i &size = b.getSize();
+    uint32_t id = b.getBlockId();
+    int width = size.x() + 2 * border, height = size.y() + 2 * border;
+
+    /* The interior is owned by this block: add it directly to the image */
+    std::atomic<uint32_t> &version = m_versions[id];
+    version.fetch_add(1, std::memory_order_acq_rel);
+    m_image.block(offset.y() + border, offset.x() + border, size.y(), size.x())
+        += b.block(border, border, size.y(), size.x());
+
+    /* The border overlaps with other blocks and is merged later */
+    if (border > 0) {
+        BorderBuffer &buffer = m_borders[id];
+        auto add = [&](int row, int col, int rows, int cols) {
+            buffer.block(row, col, rows, cols) += b.block(row, col, rows, cols);
+        };
+        add(0, 0, border, width);
+        add(height - border, 0, border, width);
+        add(border, 0, size.y(), border);
+        add(border, width - border, size.y(), border);
+    }
+    version.fetch_add(1, std::memory_order_release);
+}
+
+void Film::resolveBorders() {
+    int border = m_image.getBorderSize();
+    if (border == 0)
+        return;
+
+    /* Mark every block as being written while the borders are merged */
+    size_t blockCount = m_borders.size();
+    for (size_t i = 0; i < blockCount; ++i)
+        m_versions[i].fetch_add(1, std::memory_order_acq_rel);
+
+    for (size_t i = 0; i < blockCount; ++i) {
+        Point2i offset;
+        Vector2i size;
+        getBlock((uint32_t) i, offset, size);
+        int width = size.x() + 2 * border, height = size.y() + 2 * border;
+
+        BorderBuffer &buffer = m_borders[i];
+        auto add = [&](int row, int col, int rows, int cols) {
+            m_image.block(offset.y() + row, offset.x() + col, rows, cols)
+                += buffer.block(row, col, rows, cols);
+        };
+        add(0, 0, border, width);
+        add(height - border, 0, border, width);
+        add(border, 0, size.y(), border);
+        add(border, width - border, size.y(), border);
+        buffer.setConstant(Color4f());
+    }
+
+    for (size_t i = 0; i < blockCount; ++i)
+        m_versions[i].fetch_add(1, std::memory_order_release);
+}
+
+void Film::snapshot(ImageBlock &target) const {
+    if (target.rows() != m_image.rows() || target.cols() != m_image.cols())
+        throw NoriException("Film::snapshot(): target has incompatible dimensions!");
+
+    int border = m_image.getBorderSize();
+    BorderBuffer scratch(m_blockSize, m_blockSize);
+
+    for (size_t i = 0; i < m_borders.size(); ++i) {
+        uint32_t before = m_versions[i].load(std::memory_order_acquire);
+        if (before & 1)
+            continue; /* Currently being written, keep the previous contents */
+
+        Point2i offset;
+        Vector2i size;
+        getBlock((uint32_t) i, offset, size);
+
+        scratch.topLeftCorner(size.y(), size.x()) =
+            m_image.block(offset.y() + border, offset.x() + border, size.y(), size.x());
+
+        /* Add the borders of the neighboring blocks that were not merged yet,
+           otherwise the preview shows seams until the end of the pass */
+        bool torn = false;
+        Point2i pos(offset.x() / m_blockSize, offset.y() / m_blockSize);
+        for (int dy = -1; dy <= 1 && border > 0 && !torn; ++dy) {
+            for (int dx = -1; dx <= 1 && !torn; ++dx) {
+                Point2i npos(pos.x() + dx, pos.y() + dy);
+                if ((dx == 0 && dy == 0) || npos.x() < 0 || npos.y() < 0 ||
+                    npos.x() >= m_numBlocks.x() || npos.y() >= m_numBlocks.y())
+                    continue;
+
+                uint32_t j = (uint32_t) (npos.y() * m_numBlocks.x() + npos.x());
+                uint32_t neighborBefore = m_versions[j].load(std::memory_order_acquire);
+                if (neighborBefore & 1) {
+                    torn = true;
+                    break;
+                }
+
+                /* Overlap of the neighbor's buffer with the interior of this
+                   block, both in the coordinates of the image (incl. border) */
+                Point2i nOffset;
+                Vector2i nSize;
+                getBlock(j, nOffset, nSize);
+                Point2i min = nOffset.cwiseMax(offset + Point2i::Constant(border));
+                Point2i max = (nOffset + nSize + Point2i::Constant(2 * border))
+                    .cwiseMin(offset + size + Point2i::Constant(border));
+                if (min.x() < max.x() && min.y() < max.y()) {
+                    Vector2i extent = max - min;
+                    Point2i src = min - nOffset, dst = min - offset - Point2i::Constant(border);
+                    scratch.block(dst.y(), dst.x(), extent.y(), extent.x()) +=
+                        m_borders[j].block(src.y(), src.x(), extent.y(), extent.x());
+                }
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                torn = m_versions[j].load(std::memory_order_relaxed) != neighborBefore;
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (torn || m_versions[i].load(std::memory_order_relaxed) != before)
+            continue; /* Torn copy, keep the previous contents */
+
+        target.block(offset.y() + border, offset.x() + border, size.y(), size.x()) =
+            scratch.topLeftCorner(size.y(), size.x());
+    }
+}
+
 BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
         : m_size(size), m_blockSize(blockSize) {
     m_numBlocks = Vector2i(
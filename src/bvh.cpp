@@ -18,9 +18,16 @@
 
 #include <nori/bvh.h>
 #include <nori/timer.h>
+#include <nori/stats.h>
+#include <nori/trace.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <fstream>
+#include <cstdio>
+#include <set>
+#include <algorithm>
+#include <limits>
 
 /*
  * =======================================================================
@@ -33,12 +40,58 @@
 
 NORI_NAMESPACE_BEGIN
 
-/* Bin data structure for counting triangles and computing their bounding box */
+/* Traversal widens the far slab distances by 1 + 2 * gamma(3), which bounds
+   the rounding error of the slab test. Otherwise, rays that pass exactly
+   through a shared edge can miss the nodes on both sides of it, see
+   "Robust BVH Ray Traversal" by T. Ize (JCGT, 2013) */
+static const float SLAB_ROUNDING = 1.00000036f;
+
+/* Index that pads a leaf to BVH::LEAF_ALIGNMENT entries */
+static const uint32_t PADDING_INDEX = 0xFFFFFFFFu;
+
+/**
+ * \brief Bounds and centroids of all triangles in SoA layout
+ *
+ * These are computed once before the build, so that the binning, partition
+ * and sorting steps neither need to look up the containing mesh nor gather
+ * the vertex positions of a triangle again.
+ */
+struct BVHPrimitives {
+    std::vector<float> centroid[3]; ///< Triangle centroids (per axis)
+    std::vector<float> min[3];      ///< Minimum of the triangle bounds (per axis)
+    std::vector<float> max[3];      ///< Maximum of the triangle bounds (per axis)
+
+    BVHPrimitives(uint32_t size) {
+        for (int axis = 0; axis < 3; ++axis) {
+            centroid[axis].resize(size);
+            min[axis].resize(size);
+            max[axis].resize(size);
+        }
+    }
+
+    /// Store the data of the given triangle
+    void set(uint32_t f, const BoundingBox3f &bbox, const Point3f &c) {
+        for (int axis = 0; axis < 3; ++axis) {
+            centroid[axis][f] = c[axis];
+            min[axis][f] = bbox.min[axis];
+            max[axis][f] = bbox.max[axis];
+        }
+    }
+
+    /// Return the bounding box of the given triangle
+    BoundingBox3f getBoundingBox(uint32_t f) const {
+        return BoundingBox3f(
+            Point3f(min[0][f], min[1][f], min[2][f]),
+            Point3f(max[0][f], max[1][f], max[2][f]));
+    }
+};
+
+/* Bin data structure for counting triangles and computing their bounding box (along all axes) */
 struct Bins {
-    static const int BIN_COUNT = 16;
-    Bins() { memset(counts, 0, sizeof(uint32_t) * BIN_COUNT); }
-    uint32_t counts[BIN_COUNT];
-    BoundingBox3f bbox[BIN_COUNT];
+    static const int MAX_BIN_COUNT = 64;
+    Bins() { memset(counts, 0, sizeof(counts)); }
+    uint32_t counts[3][MAX_BIN_COUNT];
+    BoundingBox3f bbox[3][MAX_BIN_COUNT];
 };
 
 /**
@@ -54,6 +107,7 @@ struct Bins {
 class BVHBuildTask : public tbb::task {
 private:
     BVH &bvh;
+    const BVHPrimitives &prims;
     uint32_t node_idx;
     uint32_t *start, *end, *temp;
 
@@ -80,6 +134,9 @@ public:
      * \param bvh
      *    Reference to the underlying BVH
      *
+     * \param prims
+     *    Precomputed bounds and centroids of all triangles
+     *
      * \param node_idx
      *    Index of the BVH node that should be built
      *
@@ -94,23 +151,35 @@ public:
      *    construction purposes. The usable length is <tt>end-start</tt>
      *    unsigned integers.
      */
-    BVHBuildTask(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp)
-        : bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
+    BVHBuildTask(BVH &bvh, const BVHPrimitives &prims, uint32_t node_idx,
+                 uint32_t *start, uint32_t *end, uint32_t *temp)
+        : bvh(bvh), prims(prims), node_idx(node_idx), start(start), end(end), temp(temp) { }
 
     task *execute() {
+        TraceScope trace("bvh", "BVHBuildTask");
         uint32_t size = (uint32_t) (end-start);
         BVH::BVHNode &node = bvh.m_nodes[node_idx];
 
         /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
         if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
+            execute_serially(bvh, prims, node_idx, start, end, temp);
             return nullptr;
         }
 
-        /* Always split along the largest axis */
-        int axis = node.bbox.getLargestAxis();
-        float min = node.bbox.min[axis], max = node.bbox.max[axis],
-              inv_bin_size = Bins::BIN_COUNT / (max-min);
+        /* Bin along all three axes (axes without extent are skipped) */
+        const int bin_count = (int) bvh.m_binCount;
+        float min[3], inv_bin_size[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = node.bbox.max[axis] - node.bbox.min[axis];
+            min[axis] = node.bbox.min[axis];
+            inv_bin_size[axis] = extent > 0 ? bin_count / extent : 0.0f;
+        }
+
+        auto binIndex = [&](int axis, uint32_t f) {
+            return std::min(std::max(
+                (int) ((prims.centroid[axis][f] - min[axis]) * inv_bin_size[axis]), 0),
+                bin_count - 1);
+        };
 
         /* Accumulate all triangles into bins */
         Bins bins = tbb::parallel_reduce(
@@ -120,73 +189,86 @@ public:
             [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-
-                    int index = std::min(std::max(
-                        (int) ((centroid - min) * inv_bin_size), 0),
-                        (Bins::BIN_COUNT - 1));
-
-                    result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
+                    BoundingBox3f bbox = prims.getBoundingBox(f);
+                    for (int axis = 0; axis < 3; ++axis) {
+                        int index = binIndex(axis, f);
+                        result.counts[axis][index]++;
+                        result.bbox[axis][index].expandBy(bbox);
+                    }
                 }
                 return result;
             },
             /* REDUCE: Combine two 'Bins' data structures */
-            [](const Bins &b1, const Bins &b2) {
+            [&](const Bins &b1, const Bins &b2) {
                 Bins result;
-                for (int i=0; i < Bins::BIN_COUNT; ++i) {
-                    result.counts[i] = b1.counts[i] + b2.counts[i];
-                    result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
+                for (int axis = 0; axis < 3; ++axis) {
+                    for (int i = 0; i < bin_count; ++i) {
+                        result.counts[axis][i] = b1.counts[axis][i] + b2.counts[axis][i];
+                        result.bbox[axis][i] = BoundingBox3f::merge(b1.bbox[axis][i], b2.bbox[axis][i]);
+                    }
                 }
                 return result;
             }
         );
 
         /* Choose the best split plane based on the binned data */
-        BoundingBox3f bbox_left[Bins::BIN_COUNT];
-        bbox_left[0] = bins.bbox[0];
-        for (int i=1; i<Bins::BIN_COUNT; ++i) {
-            bins.counts[i] += bins.counts[i-1];
-            bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins.bbox[i]);
-        }
-
-        BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT-1], best_bbox_right;
         int64_t best_index = -1;
+        int best_axis = -1;
+        uint32_t left_count = 0;
         float best_cost = (float) INTERSECTION_COST * size;
         float tri_factor = (float) INTERSECTION_COST / node.bbox.getSurfaceArea();
+        BoundingBox3f best_bbox_left, best_bbox_right;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (inv_bin_size[axis] == 0)
+                continue;
+
+            uint32_t *counts = bins.counts[axis];
+            BoundingBox3f bbox_left[Bins::MAX_BIN_COUNT];
+            bbox_left[0] = bins.bbox[axis][0];
+            for (int i=1; i<bin_count; ++i) {
+                counts[i] += counts[i-1];
+                bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins.bbox[axis][i]);
+            }
 
-        for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
-            uint32_t prims_left = bins.counts[i], prims_right = (uint32_t) (end - start) - bins.counts[i];
-            float sah_cost = 2.0f * TRAVERSAL_COST +
-                tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-                              prims_right * bbox_right.getSurfaceArea());
-            if (sah_cost < best_cost) {
-                best_cost = sah_cost;
-                best_index = i;
-                best_bbox_right = bbox_right;
+            BoundingBox3f bbox_right = bins.bbox[axis][bin_count-1];
+            for (int i=bin_count - 2; i >= 0; --i) {
+                uint32_t prims_left = counts[i], prims_right = size - counts[i];
+                if (prims_left > 0 && prims_right > 0) {
+                    float sah_cost = 2.0f * TRAVERSAL_COST +
+                        tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+                                      prims_right * bbox_right.getSurfaceArea());
+                    if (sah_cost < best_cost) {
+                        best_cost = sah_cost;
+                        best_index = i;
+                        best_axis = axis;
+                        left_count = prims_left;
+                        best_bbox_left = bbox_left[i];
+                        best_bbox_right = bbox_right;
+                    }
+                }
+                bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[axis][i]);
             }
-            bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
         }
 
         if (best_index == -1) {
             /* Could not find a good split plane -- retry with
                more careful serial code just to be sure.. */
-            execute_serially(bvh, node_idx, start, end, temp);
+            execute_serially(bvh, prims, node_idx, start, end, temp);
             return nullptr;
         }
 
-        uint32_t left_count = bins.counts[best_index];
         int node_idx_left = node_idx+1;
         int node_idx_right = node_idx+2*left_count;
 
-        bvh.m_nodes[node_idx_left ].bbox = bbox_left[best_index];
+        bvh.m_nodes[node_idx_left ].bbox = best_bbox_left;
         bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
         node.inner.rightChild = node_idx_right;
-        node.inner.axis = axis;
+        node.inner.axis = best_axis;
         node.inner.flag = 0;
 
         std::atomic<uint32_t> offset_left(0),
-                              offset_right(bins.counts[best_index]);
+                              offset_right(left_count);
 
         tbb::parallel_for(
             tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
@@ -194,17 +276,13 @@ public:
                 uint32_t count_left = 0, count_right = 0;
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    (index <= best_index ? count_left : count_right)++;
+                    (binIndex(best_axis, f) <= best_index ? count_left : count_right)++;
                 }
                 uint32_t idx_l = offset_left.fetch_add(count_left);
                 uint32_t idx_r = offset_right.fetch_add(count_right);
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    if (index <= best_index)
+                    if (binIndex(best_axis, f) <= best_index)
                         temp[idx_l++] = f;
                     else
                         temp[idx_r++] = f;
@@ -220,7 +298,7 @@ public:
 
         /* Post right subtree to scheduler */
         BVHBuildTask &b = *new (c.allocate_child())
-            BVHBuildTask(bvh, node_idx_right, start + left_count,
+            BVHBuildTask(bvh, prims, node_idx_right, start + left_count,
                          end, temp + left_count);
         spawn(b);
 
@@ -233,7 +311,8 @@ public:
     }
 
     /// Single-threaded build function
-    static void execute_serially(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
+    static void execute_serially(BVH &bvh, const BVHPrimitives &prims, uint32_t node_idx,
+                                 uint32_t *start, uint32_t *end, uint32_t *temp) {
         BVH::BVHNode &node = bvh.m_nodes[node_idx];
         uint32_t size = (uint32_t) (end - start);
         float best_cost = (float) INTERSECTION_COST * size;
@@ -243,14 +322,15 @@ public:
         /* Try splitting along every axis */
         for (int axis=0; axis<3; ++axis) {
             /* Sort all triangles based on their centroid positions projected on the axis */
+            const float *centroid = prims.centroid[axis].data();
             std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
+                return centroid[f1] < centroid[f2];
             });
 
             BoundingBox3f bbox;
             for (uint32_t i = 0; i<size; ++i) {
                 uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(prims.getBoundingBox(f));
                 left_areas[i] = (float) bbox.getSurfaceArea();
             }
             if (axis == 0)
@@ -262,7 +342,7 @@ public:
             float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
             for (uint32_t i = size-1; i>=1; --i) {
                 uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+                bbox.expandBy(prims.getBoundingBox(f));
 
                 float left_area = left_areas[i-1];
                 float right_area = bbox.getSurfaceArea();
@@ -289,8 +369,9 @@ public:
             return;
         }
 
+        const float *centroid = prims.centroid[best_axis].data();
         std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
+            return centroid[f1] < centroid[f2];
         });
 
         uint32_t left_count = (uint32_t) best_index;
@@ -300,94 +381,701 @@ public:
         node.inner.axis = best_axis;
         node.inner.flag = 0;
 
-        execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-        execute_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
+        execute_serially(bvh, prims, node_idx_left, start, start + left_count, temp);
+        execute_serially(bvh, prims, node_idx_right, start+left_count, end, temp + left_count);
     }
 };
 
 void BVH::addMesh(Mesh *mesh) {
+    if (!m_instances.empty())
+        throw NoriException("BVH: cannot mix meshes and instances!");
     m_meshes.push_back(mesh);
     m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
     m_bbox.expandBy(mesh->getBoundingBox());
 }
 
+void BVH::addInstance(BVH *bvh, const Transform &toWorld) {
+    if (!m_meshes.empty())
+        throw NoriException("BVH: cannot mix meshes and instances!");
+
+    /* Instances of empty geometry can be skipped */
+    const BoundingBox3f &bbox = bvh->getBoundingBox();
+    if (!bbox.isValid())
+        return;
+
+    BVHInstance instance;
+    instance.bvh = bvh;
+    instance.toObject = toWorld.inverse();
+    instance.toWorld = toWorld;
+    instance.identity = toWorld.getMatrix().isIdentity(0.0f);
+
+    /* Bound the transformed corners of the object space bounding box */
+    for (int i = 0; i < 8; ++i)
+        instance.bbox.expandBy(toWorld * bbox.getCorner(i));
+    m_instances.push_back(instance);
+    m_bbox.expandBy(instance.bbox);
+}
+
+void BVH::copyParameters(const BVH &other) {
+    m_buildMethod = other.m_buildMethod;
+    m_splitBudget = other.m_splitBudget;
+    m_binCount = other.m_binCount;
+    m_rebuildThreshold = other.m_rebuildThreshold;
+    m_cacheDirectory = other.m_cacheDirectory;
+}
+
+void BVH::setBinCount(uint32_t count) {
+    if (count < 2 || count > (uint32_t) Bins::MAX_BIN_COUNT)
+        throw NoriException("BVH: the bin count must be between 2 and %i (got %i)!",
+            (int) Bins::MAX_BIN_COUNT, count);
+    m_binCount = count;
+}
+
 void BVH::clear() {
     for (auto mesh : m_meshes)
         delete mesh;
     m_meshes.clear();
     m_meshOffset.clear();
     m_meshOffset.push_back(0u);
-    m_nodes.clear();
-    m_indices.clear();
+    m_instances.clear();
     m_bbox.reset();
-    m_nodes.shrink_to_fit();
     m_meshes.shrink_to_fit();
     m_meshOffset.shrink_to_fit();
+    m_instances.shrink_to_fit();
+    clearHierarchy();
+}
+
+void BVH::clearHierarchy() {
+    m_nodes.clear();
+    m_nodes4.clear();
+#if defined(NORI_BVH_COMPRESSED_NODES)
+    m_qnodes.clear();
+    m_qnodes.shrink_to_fit();
+#endif
+    m_indices.clear();
+    m_nodeData = nullptr;
+    m_nodeCount = 0;
+    m_indexData = nullptr;
+    m_indexCount = 0;
+    m_cacheFile.reset();
+#if defined(NORI_BVH_PRECOMPUTE_TRIANGLES)
+    m_triangles.clear();
+    m_triangles.shrink_to_fit();
+#endif
+    m_nodes.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
     m_indices.shrink_to_fit();
 }
 
 void BVH::build() {
-    uint32_t size  = getTriangleCount();
+    uint32_t size  = getPrimitiveCount();
     if (size == 0)
         return;
-    cout << "Constructing a SAH BVH (" << m_meshes.size()
-        << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
-        << size << " triangles) .. ";
-    cout.flush();
-    Timer timer;
+    TraceScope trace("bvh", "BVH::build");
+
+    /* Top-level hierarchies are built with object splits and never cached,
+       since instances of the same geometry overlap anyway and the cache
+       key does not cover the instances */
+    bool instanced = !m_instances.empty();
+    EBuildMethod buildMethod = instanced ? ESAH : m_buildMethod;
+
+    /* Reuse the hierarchy of an earlier run if the geometry did not change */
+    std::string cacheFile;
+    uint64_t hash = 0;
+    if (!m_cacheDirectory.empty() && !instanced) {
+        hash = computeHash();
+        cacheFile = m_cacheDirectory + "/" + tfm::format("%016x.bvh", hash);
+        if (loadCache(cacheFile, hash)) {
+            precomputeTriangles();
+            m_buildCost = getCost();
+            return;
+        }
+    }
 
-    /* Conservative estimate for the total number of nodes */
-    m_nodes.resize(2*size);
-    memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-    m_nodes[0].bbox = m_bbox;
-    m_indices.resize(size);
+    static const char *buildMethodNames[] = {
+        "a SAH BVH (", "an SBVH (", "an LBVH (", "an HLBVH ("
+    };
+    /* Printed in one piece once done, since the meshes of a scene may
+       build their BVHs concurrently (see Scene::prepareChild()) */
+    std::string description = instanced
+        ? tfm::format("%s%i %s)", buildMethodNames[buildMethod], size,
+                      size == 1 ? "instance" : "instances")
+        : tfm::format("%s%i %s, %i triangles)", buildMethodNames[buildMethod],
+                      m_meshes.size(), m_meshes.size() == 1 ? "mesh" : "meshes", size);
+    Timer timer;
 
     if (sizeof(BVHNode) != 32)
         throw NoriException("BVH Node is not packed! Investigate compiler settings.");
 
-    for (uint32_t i = 0; i < size; ++i)
-        m_indices[i] = i;
+    if (buildMethod == ESBVH) {
+        buildSpatialSplits();
+    } else if (buildMethod == ELBVH || buildMethod == EHLBVH) {
+        buildLinear(buildMethod == EHLBVH);
+    } else {
+        /* Conservative estimate for the total number of nodes */
+        m_nodes.assign(2*size, BVHNode());
+        m_nodes[0].bbox = m_bbox;
+        m_indices.resize(size);
 
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
-    std::pair<float, uint32_t> stats = statistics();
+        /* Gather the bounds and centroids of all triangles once */
+        BVHPrimitives prims(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                if (instanced) {
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        const BoundingBox3f &bbox = m_instances[i].bbox;
+                        prims.set(i, bbox, bbox.getCenter());
+                        m_indices[i] = i;
+                    }
+                    return;
+                }
+                uint32_t idx = range.begin();
+                uint32_t meshIdx = findMesh(idx);
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    while (i >= m_meshOffset[meshIdx + 1])
+                        ++meshIdx;
+                    const Mesh *mesh = m_meshes[meshIdx];
+                    idx = i - m_meshOffset[meshIdx];
+                    prims.set(i, mesh->getBoundingBox(idx), mesh->getCentroid(idx));
+                    m_indices[i] = i;
+                }
+            }
+        );
+
+        uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
+        BVHBuildTask& task = *new(tbb::task::allocate_root())
+            BVHBuildTask(*this, prims, 0u, indices, indices + size , temp);
+        tbb::task::spawn_root_and_wait(task);
+        delete[] temp;
+    }
 
     /* The node array was allocated conservatively and now contains
-       many unused entries -- do a compactification pass. */
-    std::vector<BVHNode> compactified(stats.second);
-    std::vector<uint32_t> skipped_accum(m_nodes.size());
+       many unused entries -- do a compactification pass. The new index
+       of a node is the number of used nodes in front of it, which is
+       computed by a parallel prefix sum over blocks of nodes. Left
+       children directly follow their parent, hence only the right
+       child references need to be remapped. */
+    const uint32_t blockSize = 16384;
+    uint32_t nodeCount = (uint32_t) m_nodes.size(),
+             blockCount = (nodeCount + blockSize - 1) / blockSize;
+    std::vector<uint32_t> newIndex(nodeCount), blockOffset(blockCount + 1, 0u);
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, blockCount, 1),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t b = range.begin(); b != range.end(); ++b) {
+                uint32_t used = 0;
+                for (uint32_t j = b * blockSize; j < std::min(nodeCount, (b+1) * blockSize); ++j)
+                    used += m_nodes[j].isUnused() ? 0 : 1;
+                blockOffset[b + 1] = used;
+            }
+        }
+    );
+    for (uint32_t b = 0; b < blockCount; ++b)
+        blockOffset[b + 1] += blockOffset[b];
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, blockCount, 1),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t b = range.begin(); b != range.end(); ++b) {
+                uint32_t index = blockOffset[b];
+                for (uint32_t j = b * blockSize; j < std::min(nodeCount, (b+1) * blockSize); ++j) {
+                    newIndex[j] = index;
+                    index += m_nodes[j].isUnused() ? 0 : 1;
+                }
+            }
+        }
+    );
+
+    std::vector<BVHNode> compactified(blockOffset[blockCount]);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, nodeCount, blockSize),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t j = range.begin(); j != range.end(); ++j) {
+                if (m_nodes[j].isUnused())
+                    continue;
+                BVHNode &new_node = compactified[newIndex[j]];
+                new_node = m_nodes[j];
+                if (new_node.isInner())
+                    new_node.inner.rightChild = newIndex[new_node.inner.rightChild];
+            }
+        }
+    );
+    m_nodes = std::move(compactified);
+    std::pair<float, uint32_t> stats = statistics();
 
-    for (int64_t i = stats.second-1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-        while (m_nodes[--j].isUnused())
-            skipped++;
-        BVHNode &new_node = compactified[i];
-        new_node = m_nodes[j];
-        skipped_accum[j] = (uint32_t) skipped;
+    /* Collapse the binary tree into a 4-ary BVH for traversal */
+    m_nodes4.clear();
+    m_nodes4.reserve(m_nodes.size() / 2 + 1);
+    std::vector<uint32_t> indices;
+    indices.reserve(m_indices.size());
+    collapse(0, indices);
+    m_indices = std::move(indices);
+    m_nodes.clear();
+    m_nodes.shrink_to_fit();
+#if defined(NORI_BVH_COMPRESSED_NODES)
+    compressNodes();
+#endif
+
+    m_nodeData = getTraversalNodes().data();
+    m_nodeCount = (uint32_t) getTraversalNodes().size();
+    m_indexData = m_indices.data();
+    m_indexCount = (uint32_t) m_indices.size();
+    size_t triangleMemory = precomputeTriangles();
+    m_buildCost = getCost();
+
+    /* Only count actual triangles, not the padding of the leaves */
+    uint32_t referenceCount = m_indexCount - (uint32_t) std::count(
+        m_indices.begin(), m_indices.end(), PADDING_INDEX);
+    std::string references;
+    if (referenceCount != size)
+        references = tfm::format(", %i references", referenceCount);
+    cout << tfm::format("Constructing %s .. done (took %s and %s, SAH cost = %s%s).",
+        description, timer.elapsedString(),
+        memString(sizeof(TraversalNode) * m_nodeCount + sizeof(uint32_t)*m_indices.size()
+            + triangleMemory), stats.first, references) << endl;
+
+    if (!cacheFile.empty())
+        saveCache(cacheFile, hash);
+}
 
-        if (new_node.isInner()) {
-            new_node.inner.rightChild = (uint32_t)
-                (i + new_node.inner.rightChild - j -
-                (skipped - skipped_accum[new_node.inner.rightChild]));
+size_t BVH::precomputeTriangles() {
+#if defined(NORI_BVH_PRECOMPUTE_TRIANGLES)
+    /* Store the triangles in leaf order, so that the traversal code can
+       stream through them without looking up the containing mesh */
+    if (!m_instances.empty())
+        return 0;
+    uint32_t size = m_indexCount;
+    m_triangles.resize((size + 3) / 4);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, (uint32_t) m_triangles.size()),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t block = range.begin(); block != range.end(); ++block) {
+                BVHTriangle4 &tri = m_triangles[block];
+                for (int k = 0; k < 4; ++k) {
+                    uint32_t i = 4 * block + k;
+                    if (i >= size || m_indexData[i] == PADDING_INDEX) {
+                        /* Padding after the last triangle of a leaf. All edge
+                           tests fail on NaN vertices, hence it never reports a
+                           hit (and never takes the double precision fallback) */
+                        for (int j = 0; j < 3; ++j)
+                            for (int axis = 0; axis < 3; ++axis)
+                                tri.p[j][axis][k] = std::numeric_limits<float>::quiet_NaN();
+                        tri.mesh[k] = tri.primitive[k] = 0;
+                        continue;
+                    }
+
+                    uint32_t idx = m_indexData[i];
+                    uint32_t meshIdx = findMesh(idx);
+                    MatrixXfView V = m_meshes[meshIdx]->getVertexPositions();
+                    MatrixXuView F = m_meshes[meshIdx]->getIndices();
+                    for (int j = 0; j < 3; ++j)
+                        for (int axis = 0; axis < 3; ++axis)
+                            tri.p[j][axis][k] = V(axis, F(j, idx));
+                    tri.mesh[k] = meshIdx;
+                    tri.primitive[k] = idx;
+                }
+            }
         }
+    );
+    return sizeof(BVHTriangle4) * m_triangles.size();
+#else
+    return 0;
+#endif
+}
+
+/* Layout of a BVH cache file: this header, the nodes, and the indices */
+struct BVHCacheHeader {
+    /// Incremented whenever the layout of the cached data changes
+    static const uint32_t VERSION = 3;
+
+    char magic[8];        ///< Always "NORIBVH"
+    uint32_t version;     ///< Format version
+    uint32_t nodeSize;    ///< Size of a single node in bytes
+    uint64_t hash;        ///< Hash of the meshes and build parameters
+    uint32_t nodeCount;   ///< Number of 4-ary nodes
+    uint32_t indexCount;  ///< Number of triangle indices
+    uint8_t padding[32];  ///< Keeps the nodes 64-byte aligned
+};
+
+/* 64-bit FNV-1a hash, processes eight bytes at a time */
+static uint64_t hashData(uint64_t hash, const void *data, size_t size) {
+    const uint64_t prime = 0x100000001b3ull;
+    const uint8_t *ptr = (const uint8_t *) data;
+    for (; size >= 8; size -= 8, ptr += 8) {
+        uint64_t value;
+        memcpy(&value, ptr, 8);
+        hash = (hash ^ value) * prime;
     }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
+    for (; size > 0; --size, ++ptr)
+        hash = (hash ^ *ptr) * prime;
+    return hash;
+}
 
-    m_nodes = std::move(compactified);
+uint64_t BVH::computeHash() const {
+    /* Parameters that influence the built hierarchy */
+    uint32_t splitBudget;
+    memcpy(&splitBudget, &m_splitBudget, sizeof(float));
+    const uint64_t params[] = {
+        BVHCacheHeader::VERSION, sizeof(TraversalNode), LEAF_ALIGNMENT, m_binCount,
+        BVHBuildTask::SERIAL_THRESHOLD, BVHBuildTask::TRAVERSAL_COST,
+        BVHBuildTask::INTERSECTION_COST, m_meshes.size(),
+        (uint64_t) m_buildMethod, m_buildMethod == ESBVH ? splitBudget : 0u
+    };
+    uint64_t hash = hashData(0xcbf29ce484222325ull, params, sizeof(params));
+
+    /* Mesh vertices are already transformed to world space when loading,
+       hence this also covers the 'toWorld' transformations */
+    for (const Mesh *mesh : m_meshes) {
+        MatrixXfView V = mesh->getVertexPositions();
+        MatrixXuView F = mesh->getIndices();
+        const uint64_t sizes[] = { (uint64_t) V.cols(), (uint64_t) F.cols() };
+        hash = hashData(hash, sizes, sizeof(sizes));
+        hash = hashData(hash, V.data(), sizeof(float) * V.size());
+        hash = hashData(hash, F.data(), sizeof(uint32_t) * F.size());
+    }
+    return hash;
+}
+
+bool BVH::loadCache(const std::string &filename, uint64_t hash) {
+    std::unique_ptr<MemoryMappedFile> file;
+    try {
+        file.reset(new MemoryMappedFile(filename));
+    } catch (const NoriException &) {
+        return false; /* Not cached yet */
+    }
+
+    const BVHCacheHeader *header = (const BVHCacheHeader *) file->getData();
+    if (file->getSize() < sizeof(BVHCacheHeader) ||
+        memcmp(header->magic, "NORIBVH", 8) != 0 ||
+        header->version != BVHCacheHeader::VERSION ||
+        header->nodeSize != sizeof(TraversalNode) ||
+        header->hash != hash ||
+        header->indexCount < getTriangleCount() ||
+        header->nodeCount == 0 ||
+        file->getSize() != sizeof(BVHCacheHeader) + (size_t) header->nodeCount * sizeof(TraversalNode)
+            + (size_t) header->indexCount * sizeof(uint32_t)) {
+        cerr << "Warning: ignoring invalid BVH cache file \"" << filename << "\"" << endl;
+        return false;
+    }
+
+    const uint8_t *data = file->getData() + sizeof(BVHCacheHeader);
+    const TraversalNode *nodes = (const TraversalNode *) data;
+    const uint32_t *indices = (const uint32_t *) (data + (size_t) header->nodeCount * sizeof(TraversalNode));
+
+    /* Out of range references would cause invalid memory accesses later on.
+       Children are stored after their parent, which also rules out cycles */
+    bool valid = true;
+    for (uint32_t i = 0; i < header->nodeCount && valid; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            uint32_t child, count;
+            nodes[i].getChild(j, child, count);
+            if (count > 0)
+                valid &= count <= header->indexCount &&
+                    (uint64_t) child + alignLeaf(count) <= header->indexCount;
+            else if (child != 0)
+                valid &= child > i && child < header->nodeCount;
+        }
+    }
+    uint32_t triangleCount = getTriangleCount();
+    for (uint32_t i = 0; i < header->indexCount && valid; ++i)
+        valid &= indices[i] < triangleCount || indices[i] == PADDING_INDEX;
+    if (!valid) {
+        cerr << "Warning: ignoring corrupt BVH cache file \"" << filename << "\"" << endl;
+        return false;
+    }
+
+    m_nodeData = nodes;
+    m_nodeCount = header->nodeCount;
+    m_indexData = indices;
+    m_indexCount = header->indexCount;
+    m_cacheFile = std::move(file);
+
+    cout << "Loaded the BVH (" << m_meshes.size()
+        << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
+        << getTriangleCount() << " triangles) from \"" << filename << "\"." << endl;
+    return true;
+}
+
+void BVH::saveCache(const std::string &filename, uint64_t hash) const {
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(BVHCacheHeader));
+    memcpy(header.magic, "NORIBVH", 8);
+    header.version = BVHCacheHeader::VERSION;
+    header.nodeSize = sizeof(TraversalNode);
+    header.hash = hash;
+    header.nodeCount = m_nodeCount;
+    header.indexCount = m_indexCount;
+
+    /* Other runs (or identical meshes of this one) may map
+       or write the same cache file at the same time */
+    try {
+        writeFileAtomic(filename, [&](std::ostream &os) {
+            os.write((const char *) &header, sizeof(BVHCacheHeader));
+            os.write((const char *) m_nodeData, sizeof(TraversalNode) * m_nodeCount);
+            os.write((const char *) m_indexData, sizeof(uint32_t) * header.indexCount);
+        });
+    } catch (const NoriException &) {
+        cerr << "Warning: unable to write the BVH cache file \"" << filename << "\"" << endl;
+    }
+}
+
+void BVH::appendLeaf(std::vector<uint32_t> &indices, const uint32_t *start, uint32_t count) {
+    indices.insert(indices.end(), start, start + count);
+    indices.resize(indices.size() + alignLeaf(count) - count, PADDING_INDEX);
+}
+
+uint32_t BVH::collapse(uint32_t node_idx, std::vector<uint32_t> &indices) {
+    uint32_t idx = (uint32_t) m_nodes4.size();
+    m_nodes4.emplace_back();
+
+    /* Pull up grandchildren until there are four children, always
+       opening the inner child with the largest surface area */
+    uint32_t children[4];
+    int childCount = 0;
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        children[childCount++] = node_idx;
+    } else {
+        children[childCount++] = node_idx + 1;
+        children[childCount++] = node.inner.rightChild;
+    }
+
+    while (childCount < 4) {
+        int best = -1;
+        float bestArea = -1;
+        for (int i = 0; i < childCount; ++i) {
+            const BVHNode &child = m_nodes[children[i]];
+            if (child.isInner() && child.bbox.getSurfaceArea() > bestArea) {
+                best = i;
+                bestArea = child.bbox.getSurfaceArea();
+            }
+        }
+        if (best == -1)
+            break;
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[childCount++] = m_nodes[opened].inner.rightChild;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        uint32_t child = 0, count = 0;
+        BoundingBox3f bbox;
+        if (i < childCount) {
+            const BVHNode &c = m_nodes[children[i]];
+            bbox = c.bbox;
+            if (c.isLeaf()) {
+                child = (uint32_t) indices.size();
+                count = c.leaf.size;
+                appendLeaf(indices, m_indices.data() + c.start(), count);
+            } else {
+                /* Note: the recursion may reallocate 'm_nodes4' */
+                child = collapse(children[i], indices);
+            }
+        }
+        BVH4Node &node4 = m_nodes4[idx];
+        node4.setBounds(i, bbox);
+        node4.child[i] = child;
+        node4.count[i] = count;
+    }
+
+    /* Unused slots come last -- they are never intersected anyway */
+    for (int octant = 0; octant < 8; ++octant) {
+        int position = 0;
+        uint8_t order = 0;
+        traversalOrder(node_idx, octant, children, childCount, position, order);
+        for (int i = childCount; i < 4; ++i)
+            order |= (uint8_t) (i << (2 * position++));
+        m_nodes4[idx].order[octant] = order;
+    }
+
+    return idx;
+}
+
+void BVH::traversalOrder(uint32_t node_idx, int octant, const uint32_t *children,
+        int childCount, int &position, uint8_t &order) const {
+    for (int i = 0; i < childCount; ++i) {
+        if (children[i] == node_idx) {
+            order |= (uint8_t) (i << (2 * position++));
+            return;
+        }
+    }
+
+    /* The left child contains the primitives with smaller centroids
+       along the split axis -- visit it first unless the ray points
+       towards the negative end of that axis */
+    const BVHNode &node = m_nodes[node_idx];
+    uint32_t left = node_idx + 1, right = node.inner.rightChild;
+    if (octant & (1 << node.inner.axis))
+        std::swap(left, right);
+
+    traversalOrder(left, octant, children, childCount, position, order);
+    traversalOrder(right, octant, children, childCount, position, order);
+}
+
+BVH::TraversalNodeVector &BVH::getTraversalNodes() {
+#if defined(NORI_BVH_COMPRESSED_NODES)
+    return m_qnodes;
+#else
+    return m_nodes4;
+#endif
+}
+
+void BVH::BVH4QNode::setBounds(const BoundingBox3f *bbox) {
+    BoundingBox3f parent;
+    for (int i = 0; i < 4; ++i) {
+        if (bbox[i].isValid())
+            parent.expandBy(bbox[i]);
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float base = parent.isValid() ? parent.min[axis] : 0.0f,
+              top = parent.isValid() ? parent.max[axis] : 0.0f;
+
+        /* Smallest power of two spacing whose grid covers the node bounds.
+           Since products of an 8-bit integer and a power of two are exact,
+           decoding rounds the same way here and during traversal */
+        int exp;
+        std::frexp((top - base) / 255.0f, &exp);
+        exponent[axis] = (int8_t) clamp(exp, -126, 127);
+        while (base + 255.0f * getScale(axis) < top && exponent[axis] < 127)
+            exponent[axis]++;
+        origin[axis] = base;
+        float scale = getScale(axis);
+
+        for (int i = 0; i < 4; ++i) {
+            if (!bbox[i].isValid()) {
+                /* An inverted box is never intersected */
+                qbounds[2*axis][i] = 255;
+                qbounds[2*axis+1][i] = 0;
+                continue;
+            }
+            int qmin = clamp((int) std::floor((bbox[i].min[axis] - base) / scale), 0, 255);
+            int qmax = clamp((int) std::ceil((bbox[i].max[axis] - base) / scale), 0, 255);
+            while (qmin > 0 && base + qmin * scale > bbox[i].min[axis])
+                qmin--;
+            while (qmax < 255 && base + qmax * scale < bbox[i].max[axis])
+                qmax++;
+            qbounds[2*axis][i] = (uint8_t) qmin;
+            qbounds[2*axis+1][i] = (uint8_t) qmax;
+        }
+    }
+}
+
+#if defined(NORI_BVH_COMPRESSED_NODES)
+void BVH::compressNodes() {
+    std::vector<uint32_t> indices;
+    indices.reserve(m_indices.size());
+    m_qnodes.clear();
+    m_qnodes.reserve(m_nodes4.size());
+    m_qnodes.emplace_back();
+    compressNode(0, 0, indices);
+
+    m_indices = std::move(indices);
+    m_nodes4.clear();
+    m_nodes4.shrink_to_fit();
+}
+
+void BVH::compressNode(uint32_t node_idx, uint32_t target, std::vector<uint32_t> &indices) {
+    const BVH4Node &node = m_nodes4[node_idx];
+    BVH4QNode qnode;
+    memset(&qnode, 0, sizeof(BVH4QNode));
+    memcpy(qnode.order, node.order, sizeof(node.order));
+
+    /* Append the triangles of the leaf children. Leaves with more
+       triangles than fit into a count become inner children */
+    BoundingBox3f bounds[4];
+    qnode.triangleBase = (uint32_t) indices.size();
+    for (int i = 0; i < 4; ++i) {
+        bounds[i] = BoundingBox3f(
+            Point3f(node.bounds[0][i], node.bounds[2][i], node.bounds[4][i]),
+            Point3f(node.bounds[1][i], node.bounds[3][i], node.bounds[5][i]));
+        if (node.count[i] > 0 && node.count[i] <= 255) {
+            appendLeaf(indices, m_indices.data() + node.child[i], node.count[i]);
+            qnode.count[i] = (uint8_t) node.count[i];
+        } else if (node.count[i] > 0 || node.child[i] != 0) {
+            qnode.innerMask |= (uint8_t) (1 << i);
+        }
+    }
+    qnode.setBounds(bounds);
+
+    /* Reserve consecutive entries for the inner children, then fill them.
+       Note: the recursion reallocates 'm_qnodes' */
+    qnode.childBase = (uint32_t) m_qnodes.size();
+    for (int i = 0; i < 4; ++i) {
+        if (qnode.innerMask & (1 << i))
+            m_qnodes.emplace_back();
+    }
+    m_qnodes[target] = qnode;
+
+    uint32_t childIdx = qnode.childBase;
+    for (int i = 0; i < 4; ++i) {
+        if (!(qnode.innerMask & (1 << i)))
+            continue;
+        if (node.count[i] > 0)
+            compressLeaf(node.child[i], node.count[i], bounds[i], childIdx++, indices);
+        else
+            compressNode(node.child[i], childIdx++, indices);
+    }
+}
+
+void BVH::compressLeaf(uint32_t start, uint32_t count, const BoundingBox3f &bbox,
+        uint32_t target, std::vector<uint32_t> &indices) {
+    BVH4QNode qnode;
+    memset(&qnode, 0, sizeof(BVH4QNode));
+    memset(qnode.order, 0xE4, sizeof(qnode.order)); /* Slots 0, 1, 2, 3 */
+
+    /* Distribute the triangles over four children. Their bounds are
+       clipped to the leaf, since spatial splits may have clipped it */
+    uint32_t chunkSize = (count + 3) / 4;
+    BoundingBox3f bounds[4];
+    qnode.triangleBase = (uint32_t) indices.size();
+    for (int i = 0; i < 4; ++i) {
+        uint32_t chunkStart = std::min(count, i * chunkSize),
+                 chunkEnd = std::min(count, (i + 1) * chunkSize);
+        for (uint32_t k = start + chunkStart; k < start + chunkEnd; ++k)
+            bounds[i].expandBy(getBoundingBox(m_indices[k]));
+        bounds[i].clip(bbox);
+        if (chunkEnd - chunkStart > 255) {
+            qnode.innerMask |= (uint8_t) (1 << i);
+        } else if (chunkEnd > chunkStart) {
+            appendLeaf(indices, m_indices.data() + start + chunkStart, chunkEnd - chunkStart);
+            qnode.count[i] = (uint8_t) (chunkEnd - chunkStart);
+        }
+    }
+    qnode.setBounds(bounds);
+
+    qnode.childBase = (uint32_t) m_qnodes.size();
+    for (int i = 0; i < 4; ++i) {
+        if (qnode.innerMask & (1 << i))
+            m_qnodes.emplace_back();
+    }
+    m_qnodes[target] = qnode;
+
+    uint32_t childIdx = qnode.childBase;
+    for (int i = 0; i < 4; ++i) {
+        if (qnode.innerMask & (1 << i))
+            compressLeaf(start + i * chunkSize, std::min(chunkSize, count - i * chunkSize),
+                bounds[i], childIdx++, indices);
+    }
 }
+#endif
 
 std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
     const BVHNode &node = m_nodes[node_idx];
     if (node.isLeaf()) {
         return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
     } else {
-        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
+        std::pair<float, uint32_t> stats_left, stats_right;
+
+        /* Process large subtrees in parallel. The nodes are stored in
+           depth-first order, hence the left subtree ends before the right child */
+        if (node.inner.rightChild - node_idx > 4096) {
+            tbb::parallel_invoke(
+                [&] { stats_left = statistics(node_idx + 1u); },
+                [&] { stats_right = statistics(node.inner.rightChild); }
+            );
+        } else {
+            stats_left = statistics(node_idx + 1u);
+            stats_right = statistics(node.inner.rightChild);
+        }
         float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
         float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
         float saCur = node.bbox.getSurfaceArea();
@@ -401,9 +1089,262 @@ std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
     }
 }
 
-bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+bool BVH::refit() {
+    if (m_nodeCount == 0)
+        return false;
+    TraceScope trace("bvh", "BVH::refit");
+
+    Timer timer;
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+
+    if (!m_instances.empty()) {
+        /* Update the shared hierarchies first (once each), then the instance bounds */
+        std::set<BVH *> shared;
+        for (const BVHInstance &instance : m_instances)
+            shared.insert(instance.bvh);
+        for (BVH *bvh : shared)
+            bvh->refit();
+
+        for (BVHInstance &instance : m_instances) {
+            const BoundingBox3f &bbox = instance.bvh->getBoundingBox();
+            instance.bbox.reset();
+            for (int i = 0; i < 8; ++i)
+                instance.bbox.expandBy(instance.toWorld * bbox.getCorner(i));
+            m_bbox.expandBy(instance.bbox);
+        }
+    }
+
+    /* Nodes that were mapped from a cache file are read-only */
+    TraversalNodeVector &nodes = getTraversalNodes();
+    if (m_nodeData != nodes.data()) {
+        nodes.assign(m_nodeData, m_nodeData + m_nodeCount);
+        m_nodeData = nodes.data();
+    }
 
+    refitNode(0, 0);
+    precomputeTriangles();
+
+    float cost = getCost();
+    if (cost <= m_buildCost * m_rebuildThreshold) {
+        cout << "Refitted the BVH (took " << timer.elapsedString()
+            << ", SAH cost = " << cost << " vs. " << m_buildCost
+            << " after the last build)." << endl;
+        return false;
+    }
+
+    cout << "Refitted the BVH, but its SAH cost grew from " << m_buildCost
+        << " to " << cost << " -- rebuilding." << endl;
+    clearHierarchy();
+    build();
+    return true;
+}
+
+BoundingBox3f BVH::refitNode(uint32_t node_idx, int depth) {
+    TraversalNode &node = getTraversalNodes()[node_idx];
+    BoundingBox3f bounds[4];
+
+    auto refitChild = [&](int i) {
+        uint32_t child, count;
+        node.getChild(i, child, count);
+        if (count > 0) {
+            for (uint32_t k = child; k < child + count; ++k)
+                bounds[i].expandBy(getBoundingBox(m_indexData[k]));
+        } else if (child != 0) {
+            bounds[i] = refitNode(child, depth + 1);
+        }
+    };
+
+    /* Process the upper levels of the tree in parallel */
+    if (depth < 6)
+        tbb::parallel_for(0, 4, refitChild);
+    else
+        for (int i = 0; i < 4; ++i)
+            refitChild(i);
+
+    BoundingBox3f result;
+    for (int i = 0; i < 4; ++i)
+        result.expandBy(bounds[i]);
+    node.setBounds(bounds);
+    return result;
+}
+
+float BVH::cost4(uint32_t node_idx, float surfaceArea) const {
+    const TraversalNode &node = m_nodeData[node_idx];
+    float cost = BVHBuildTask::TRAVERSAL_COST * surfaceArea;
+    Eigen::Array4f temp[6];
+    const Eigen::Array4f *bounds = node.getBounds(temp);
+
+    for (int i = 0; i < 4; ++i) {
+        uint32_t child, count;
+        node.getChild(i, child, count);
+        if (count == 0 && child == 0)
+            continue; /* Unused slot */
+        BoundingBox3f bbox(
+            Point3f(bounds[0][i], bounds[2][i], bounds[4][i]),
+            Point3f(bounds[1][i], bounds[3][i], bounds[5][i]));
+        float childArea = bbox.getSurfaceArea();
+        if (count > 0)
+            cost += BVHBuildTask::INTERSECTION_COST * count * childArea;
+        else
+            cost += cost4(child, childArea);
+    }
+    return cost;
+}
+
+float BVH::getCost() const {
+    float surfaceArea = m_bbox.getSurfaceArea();
+    if (m_nodeCount == 0 || !(surfaceArea > 0))
+        return 0.0f;
+    return cost4(0, surfaceArea) / surfaceArea;
+}
+
+BVH::ShearedRay::ShearedRay(const Ray3f &ray) {
+    /* Let z be the dominant axis of the direction, and swap x and y
+       when it points towards negative z to preserve the winding */
+    ray.d.cwiseAbs().maxCoeff(&kz);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (ray.d[kz] < 0)
+        std::swap(kx, ky);
+
+    sx = ray.d[kx] / ray.d[kz];
+    sy = ray.d[ky] / ray.d[kz];
+    sz = 1.0f / ray.d[kz];
+    for (int i = 0; i < 3; ++i)
+        o[i] = Eigen::Array4f::Constant(ray.o[i]);
+}
+
+bool BVH::intersectLeaf(uint32_t start, uint32_t end, const Ray3f &ray,
+        const ShearedRay &sray, bool shadowRay, float &u, float &v, float &t,
+        uint32_t &meshIdx, uint32_t &idx) const {
+    bool foundIntersection = false;
+#if defined(NORI_BVH_PRECOMPUTE_TRIANGLES)
+    const Eigen::Array4f zero = Eigen::Array4f::Zero();
+    float maxt = ray.maxt;
+
+    /* Leaves start at a block, and their padding lanes never report a hit */
+    for (uint32_t block = start / 4, last = (end + 3) / 4; block < last; ++block) {
+        const BVHTriangle4 &tri = m_triangles[block];
+
+        /* Transform the vertices into the sheared ray space,
+           in which the ray starts at the origin and runs along z */
+        Eigen::Array4f x[3], y[3], z[3];
+        for (int j = 0; j < 3; ++j) {
+            Eigen::Array4f pz = tri.p[j][sray.kz] - sray.o[sray.kz];
+            x[j] = tri.p[j][sray.kx] - sray.o[sray.kx] - sray.sx * pz;
+            y[j] = tri.p[j][sray.ky] - sray.o[sray.ky] - sray.sy * pz;
+            z[j] = sray.sz * pz;
+        }
+
+        /* Scaled barycentric coordinates from 2D edge tests. The ray hits
+           the triangle (including its edges) when they share a sign */
+        Eigen::Array4f U = x[2] * y[1] - y[2] * x[1],
+                       V = x[0] * y[2] - y[0] * x[2],
+                       W = x[1] * y[0] - y[1] * x[0];
+
+        /* A coordinate that is exactly zero may have the wrong sign after
+           cancellation, hence recompute it in double precision. This keeps
+           the test watertight along shared edges, see "Watertight Ray/Triangle
+           Intersection" by S. Woop, C. Benthin and I. Wald (JCGT, 2013) */
+        if ((U == zero).any() || (V == zero).any() || (W == zero).any()) {
+            for (int k = 0; k < 4; ++k) {
+                if (U[k] != 0.0f && V[k] != 0.0f && W[k] != 0.0f)
+                    continue;
+                U[k] = (float) ((double) x[2][k] * (double) y[1][k] - (double) y[2][k] * (double) x[1][k]);
+                V[k] = (float) ((double) x[0][k] * (double) y[2][k] - (double) y[0][k] * (double) x[2][k]);
+                W[k] = (float) ((double) x[1][k] * (double) y[0][k] - (double) y[1][k] * (double) x[0][k]);
+            }
+        }
+
+        Eigen::Array4f det = U + V + W;
+        Eigen::Array4f tHit = (U * z[0] + V * z[1] + W * z[2]) / det;
+        auto inside = (U.min(V).min(W) >= zero || U.max(V).max(W) <= zero) && det != zero;
+
+        /* Keep the closest hit */
+        for (int k = 0; k < 4; ++k) {
+            if (!inside[k] || !(tHit[k] >= ray.mint && tHit[k] <= maxt))
+                continue;
+            maxt = t = tHit[k];
+            u = V[k] / det[k];
+            v = W[k] / det[k];
+            meshIdx = tri.mesh[k];
+            idx = tri.primitive[k];
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+        }
+    }
+#else
+    Ray3f shortened(ray);
+    for (uint32_t i = start; i < end; ++i) {
+        uint32_t triIdx = m_indexData[i];
+        uint32_t triMesh = findMesh(triIdx);
+        float triU, triV, triT;
+        if (m_meshes[triMesh]->rayIntersect(triIdx, shortened, triU, triV, triT)) {
+            shortened.maxt = t = triT;
+            u = triU;
+            v = triV;
+            meshIdx = triMesh;
+            idx = triIdx;
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+        }
+    }
+#endif
+    return foundIntersection;
+}
+
+void BVH::fillIntersection(Intersection &its) const {
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-its.uv.sum(), its.uv;
+
+    /* References to all relevant mesh buffers */
+    const Mesh *mesh   = its.mesh;
+    MatrixXfView V  = mesh->getVertexPositions();
+    MatrixXfView N  = mesh->getVertexNormals();
+    MatrixXfView UV = mesh->getVertexTexCoords();
+    MatrixXuView F  = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t f = (uint32_t) its.m_primitiveId;
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (UV.size() > 0)
+        its.uv = bary.x() * UV.col(idx0) +
+            bary.y() * UV.col(idx1) +
+            bary.z() * UV.col(idx2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * N.col(idx0) +
+             bary.y() * N.col(idx1) +
+             bary.z() * N.col(idx2)).normalized());
+    } else {
+        its.shFrame = its.geoFrame;
+    }
+}
+
+bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
     its.t = std::numeric_limits<float>::infinity();
 
     /* Use an adaptive ray epsilon */
@@ -411,97 +1352,297 @@ bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) con
     if (ray.mint == Epsilon)
         ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
+    uint32_t instance = 0;
+    if (!traverse(ray, its, shadowRay, instance))
         return false;
 
-    bool foundIntersection = false;
-    uint32_t f = 0;
-
-    while (true) {
-        const BVHNode &node = m_nodes[node_idx];
+    if (shadowRay)
+        return true;
 
-        if (!node.bbox.rayIntersect(ray)) {
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
+    if (m_instances.empty()) {
+        fillIntersection(its);
+    } else {
+        /* Complete the record in object space and transform it to world space */
+        const BVHInstance &inst = m_instances[instance];
+        inst.bvh->fillIntersection(its);
+        if (!inst.identity) {
+            its.p = inst.toWorld * its.p;
+            its.geoFrame = Frame((inst.toWorld * its.geoFrame.n).normalized());
+            its.shFrame = Frame((inst.toWorld * its.shFrame.n).normalized());
         }
+    }
+    return true;
+}
 
-        if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
-            assert(stack_idx<64);
-        } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Mesh *mesh = m_meshes[findMesh(idx)];
+bool BVH::traverse(Ray3f &ray, Intersection &its, bool shadowRay, uint32_t &instance) const {
+    /* Traversal stack: node (or first triangle index), triangle count,
+       and the distance at which the ray enters the entry's bounds */
+    struct StackEntry {
+        uint32_t ref, count;
+        float tNear;
+    };
+    uint32_t stack_idx = 0;
+    StackEntry stack[128];
 
-                float u, v, t;
-                if (mesh->rayIntersect(idx, ray, u, v, t)) {
+    if (m_nodeCount == 0 || ray.maxt < ray.mint)
+        return false;
+
+    /* Broadcast the ray into SIMD registers. Reciprocals of zero direction
+       components are replaced by large finite values, which avoids NaNs
+       when the ray origin lies exactly on a slab boundary */
+    Eigen::Array4f o[3], dRcp[3];
+    int nearIdx[3], octant = 0;
+    for (int i = 0; i < 3; ++i) {
+        float rcp = ray.dRcp[i];
+        if (!std::isfinite(rcp))
+            rcp = std::copysign(std::numeric_limits<float>::max(), ray.d[i]);
+        o[i] = Eigen::Array4f::Constant(ray.o[i]);
+        dRcp[i] = Eigen::Array4f::Constant(rcp);
+        nearIdx[i] = 2 * i + (rcp < 0 ? 1 : 0);
+        octant |= (rcp < 0 ? 1 : 0) << i;
+    }
+
+    ShearedRay sray(ray);
+    bool foundIntersection = false;
+    NORI_STATS(ThreadStatistics &stats = Statistics::local());
+
+    stack[stack_idx++] = StackEntry { 0u, 0u, ray.mint };
+
+    while (stack_idx > 0) {
+        const StackEntry &entry = stack[--stack_idx];
+
+        /* Skip entries that lie behind the closest hit found so far */
+        if (entry.tNear > ray.maxt)
+            continue;
+        uint32_t ref = entry.ref, count = entry.count;
+
+        if (count == 0) {
+            /* Inner node: slab test against all four children at once */
+            const TraversalNode &node = m_nodeData[ref];
+            NORI_STATS(stats.nodeVisits++);
+            Eigen::Array4f temp[6];
+            const Eigen::Array4f *bounds = node.getBounds(temp);
+            Eigen::Array4f tNear = Eigen::Array4f::Constant(ray.mint);
+            Eigen::Array4f tFar = Eigen::Array4f::Constant(ray.maxt);
+            for (int i = 0; i < 3; ++i) {
+                tNear = tNear.max((bounds[nearIdx[i]] - o[i]) * dRcp[i]);
+                tFar = tFar.min((bounds[nearIdx[i] ^ 1] - o[i]) * dRcp[i] * SLAB_ROUNDING);
+            }
+            auto hit = tNear <= tFar;
+
+            /* Push the children back to front so that the
+               nearest one is popped first */
+            uint8_t order = node.order[octant];
+            for (int k = 3; k >= 0; --k) {
+                int i = (order >> (2 * k)) & 3;
+                if (!hit[i])
+                    continue;
+                uint32_t child, count;
+                node.getChild(i, child, count);
+                /* Unused slots pass the slab test when the rounding margin
+                   exceeds the size of their (inverted) bounds */
+                if (count == 0 && child == 0)
+                    continue;
+                stack[stack_idx++] = StackEntry { child, count, tNear[i] };
+                assert(stack_idx < 128);
+            }
+        } else if (!m_instances.empty()) {
+            /* Continue in the shared hierarchy of each instance. Affine
+               transformations preserve the ray parameterization, hence
+               distances need not be converted */
+            for (uint32_t i = ref, end = ref + count; i < end; ++i) {
+                const BVHInstance &inst = m_instances[m_indexData[i]];
+                Ray3f localRay = inst.identity ? ray : inst.toObject * ray;
+                uint32_t unused;
+                if (inst.bvh->traverse(localRay, its, shadowRay, unused)) {
                     if (shadowRay)
                         return true;
                     foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = mesh;
-                    its.m_primitiveId = idx;
-                    f = idx;
+                    ray.maxt = its.t;
+                    instance = m_indexData[i];
                 }
             }
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
+        } else {
+            float u, v, t;
+            uint32_t meshIdx, idx;
+            NORI_STATS(stats.triangleTests += count);
+            if (intersectLeaf(ref, ref + count, ray, sray, shadowRay, u, v, t, meshIdx, idx)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+                ray.maxt = its.t = t;
+                its.uv = Point2f(u, v);
+                its.mesh = m_meshes[meshIdx];
+                its.m_primitiveId = (int) idx;
+            }
         }
     }
 
-    if (foundIntersection) {
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
+    return foundIntersection;
+}
 
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
+uint32_t BVH::rayIntersect(const RayPacket &packet, Intersection *its, bool shadowRay) const {
+    const int N = RayPacket::Size;
 
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+    if (!m_instances.empty()) {
+        /* The rays of a packet generally take different paths through the
+           instances, hence top-level hierarchies trace them one by one */
+        uint32_t hits = 0;
+        for (int k = 0; k < N; ++k) {
+            if (packet.isActive(k) && rayIntersect(packet.rays[k], its[k], shadowRay))
+                hits |= 1u << k;
+        }
+        return hits;
+    }
 
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+    /* Traversal stack: node (or first triangle index), triangle count,
+       the mask of rays that intersect the entry's bounds, and the
+       distances at which these rays enter them */
+    struct StackEntry {
+        uint32_t ref, count, mask;
+        float tNear[N];
+    };
+    uint32_t stack_idx = 0;
+    StackEntry stack[128];
+
+    /* Per-ray traversal state (see the single ray version above) */
+    Ray3f rays[N];
+    ShearedRay srays[N];
+    Eigen::Array4f o[N][3], dRcp[N][3];
+    int nearIdx[N][3], octant = -1;
+    uint32_t active = 0, hits = 0;
+
+    for (int k = 0; k < N; ++k) {
+        if (!packet.isActive(k))
+            continue;
+        its[k].t = std::numeric_limits<float>::infinity();
 
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+        Ray3f &ray = rays[k];
+        ray = packet.rays[k];
+        if (ray.mint == Epsilon)
+            ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+        if (ray.maxt < ray.mint)
+            continue;
 
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
+        int rayOctant = 0;
+        for (int i = 0; i < 3; ++i) {
+            float rcp = ray.dRcp[i];
+            if (!std::isfinite(rcp))
+                rcp = std::copysign(std::numeric_limits<float>::max(), ray.d[i]);
+            o[k][i] = Eigen::Array4f::Constant(ray.o[i]);
+            dRcp[k][i] = Eigen::Array4f::Constant(rcp);
+            nearIdx[k][i] = 2 * i + (rcp < 0 ? 1 : 0);
+            rayOctant |= (rcp < 0 ? 1 : 0) << i;
+        }
 
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+        srays[k] = ShearedRay(ray);
 
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
+        /* The children are visited in the order of the first ray */
+        if (octant < 0)
+            octant = rayOctant;
+        active |= 1u << k;
+    }
 
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
+    if (m_nodeCount == 0 || active == 0)
+        return 0;
+    NORI_STATS(ThreadStatistics &stats = Statistics::local());
+
+    stack[stack_idx].ref = stack[stack_idx].count = 0;
+    stack[stack_idx].mask = active;
+    for (int k = 0; k < N; ++k)
+        stack[stack_idx].tNear[k] = rays[k].mint;
+    stack_idx++;
+
+    while (stack_idx > 0) {
+        const StackEntry &entry = stack[--stack_idx];
+
+        /* Skip rays that already found an occluder, or
+           whose closest hit lies in front of the entry */
+        uint32_t mask = entry.mask & active;
+        for (int k = 0; k < N; ++k) {
+            if ((mask & (1u << k)) && entry.tNear[k] > rays[k].maxt)
+                mask &= ~(1u << k);
+        }
+        if (mask == 0)
+            continue;
+        uint32_t ref = entry.ref, count = entry.count;
+
+        if (count == 0) {
+            /* Inner node: slab test of every ray against all four children */
+            const TraversalNode &node = m_nodeData[ref];
+            Eigen::Array4f temp[6];
+            const Eigen::Array4f *bounds = node.getBounds(temp);
+            uint32_t childMask[4] = { 0, 0, 0, 0 };
+            float childNear[4][N];
+
+            for (int k = 0; k < N; ++k) {
+                if (!(mask & (1u << k)))
+                    continue;
+                NORI_STATS(stats.nodeVisits++);
+                Eigen::Array4f tNear = Eigen::Array4f::Constant(rays[k].mint);
+                Eigen::Array4f tFar = Eigen::Array4f::Constant(rays[k].maxt);
+                for (int i = 0; i < 3; ++i) {
+                    tNear = tNear.max((bounds[nearIdx[k][i]] - o[k][i]) * dRcp[k][i]);
+                    tFar = tFar.min((bounds[nearIdx[k][i] ^ 1] - o[k][i]) * dRcp[k][i] * SLAB_ROUNDING);
+                }
+                auto hit = tNear <= tFar;
+                for (int i = 0; i < 4; ++i) {
+                    childNear[i][k] = tNear[i];
+                    if (hit[i])
+                        childMask[i] |= 1u << k;
+                }
+            }
+
+            uint8_t order = node.order[octant];
+            for (int j = 3; j >= 0; --j) {
+                int i = (order >> (2 * j)) & 3;
+                if (childMask[i] == 0)
+                    continue;
+                uint32_t ref, count;
+                node.getChild(i, ref, count);
+                if (count == 0 && ref == 0)
+                    continue; /* Unused slot, see traverse() */
+                StackEntry &child = stack[stack_idx++];
+                child.ref = ref;
+                child.count = count;
+                child.mask = childMask[i];
+                memcpy(child.tNear, childNear[i], sizeof(float) * N);
+                assert(stack_idx < 128);
+            }
         } else {
-            its.shFrame = its.geoFrame;
+            /* Leaf node: intersect the triangles with all rays in the mask */
+            for (int k = 0; k < N; ++k) {
+                if (!(mask & (1u << k)))
+                    continue;
+                float u, v, t;
+                uint32_t meshIdx, idx;
+                NORI_STATS(stats.triangleTests += count);
+                if (intersectLeaf(ref, ref + count, rays[k], srays[k], shadowRay,
+                        u, v, t, meshIdx, idx)) {
+                    hits |= 1u << k;
+                    if (shadowRay) {
+                        active &= ~(1u << k);
+                        continue;
+                    }
+                    rays[k].maxt = its[k].t = t;
+                    its[k].uv = Point2f(u, v);
+                    its[k].mesh = m_meshes[meshIdx];
+                    its[k].m_primitiveId = (int) idx;
+                }
+            }
+            if (active == 0)
+                break;
         }
     }
 
-    return foundIntersection;
+    if (!shadowRay) {
+        for (int k = 0; k < N; ++k) {
+            if (hits & (1u << k))
+                fillIntersection(its[k]);
+        }
+    }
+
+    return hits;
 }
 
 NORI_NAMESPACE_END
@@ -0,0 +1,330 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/stats.h>
+#include <nori/warp.h>
+#include <tbb/task_scheduler_init.h>
+#include <Eigen/Geometry>
+#include <pcg32.h>
+#include <functional>
+
+/* Microbenchmark of the acceleration structure: builds BVHs over synthetic
+   meshes and OBJ files with each construction algorithm, and measures the
+   cost of closest-hit and shadow queries of coherent (camera) and
+   incoherent (random) rays without running an integrator. The visited
+   nodes and tested triangles are only reported when NORI_STATISTICS is
+   enabled, since the counters slow down the traversal. */
+
+using namespace nori;
+
+/* Mesh whose triangles are generated by the benchmark */
+class SyntheticMesh : public Mesh {
+public:
+    SyntheticMesh(const std::string &name, const MatrixXf &V, const MatrixXu &F) {
+        m_name = name;
+        m_V = V;
+        m_F = F;
+        for (int i = 0; i < m_V.cols(); ++i)
+            m_bbox.expandBy(Point3f(m_V.col(i)));
+    }
+
+    std::string toString() const {
+        return tfm::format("SyntheticMesh[name=\"%s\", triangles=%i]",
+            m_name, getTriangleCount());
+    }
+};
+
+/* Triangles of similar size at uniformly distributed positions in the unit cube */
+static Mesh *createRandomTriangles(uint32_t count) {
+    pcg32 rng;
+    float size = 1.5f / std::cbrt((float) count);
+    MatrixXf V(3, 3 * count);
+    MatrixXu F(3, count);
+    for (uint32_t i = 0; i < count; ++i) {
+        Point3f center(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
+        for (uint32_t k = 0; k < 3; ++k) {
+            Vector3f offset(rng.nextFloat() - 0.5f, rng.nextFloat() - 0.5f, rng.nextFloat() - 0.5f);
+            V.col(3 * i + k) = center + size * offset;
+            F(k, i) = 3 * i + k;
+        }
+    }
+    return new SyntheticMesh("random", V, F);
+}
+
+/* Unit sphere tessellated along the lines of latitude and longitude */
+static Mesh *createSphere(uint32_t count) {
+    uint32_t rings = std::max(2u, (uint32_t) std::sqrt(count / 4.0f));
+    uint32_t segments = 2 * rings;
+    MatrixXf V(3, (rings + 1) * (segments + 1));
+    MatrixXu F(3, 2 * rings * segments);
+
+    for (uint32_t i = 0; i <= rings; ++i) {
+        float theta = M_PI * i / rings;
+        for (uint32_t j = 0; j <= segments; ++j) {
+            float phi = 2 * M_PI * j / segments;
+            V.col(i * (segments + 1) + j) = Vector3f(std::sin(theta) * std::cos(phi),
+                std::sin(theta) * std::sin(phi), std::cos(theta));
+        }
+    }
+
+    uint32_t idx = 0;
+    for (uint32_t i = 0; i < rings; ++i) {
+        for (uint32_t j = 0; j < segments; ++j) {
+            uint32_t a = i * (segments + 1) + j, b = a + 1,
+                     c = a + segments + 1, d = c + 1;
+            F.col(idx++) << a, c, b;
+            F.col(idx++) << b, c, d;
+        }
+    }
+    return new SyntheticMesh("sphere", V, F);
+}
+
+/* Long and thin triangles in random orientations, with the same area as
+   those of \ref createRandomTriangles(). Their bounding boxes overlap
+   heavily, which is a worst case for object partitioning and the
+   motivation for spatial splits */
+static Mesh *createThinTriangles(uint32_t count) {
+    pcg32 rng;
+    float size = 1.5f / std::cbrt((float) count);
+    float length = 4 * size, width = size / 4;
+    MatrixXf V(3, 3 * count);
+    MatrixXu F(3, count);
+    for (uint32_t i = 0; i < count; ++i) {
+        Point3f p0(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
+        Vector3f dir = Warp::squareToUniformSphere(Point2f(rng.nextFloat(), rng.nextFloat()));
+        Vector3f offset = Warp::squareToUniformSphere(Point2f(rng.nextFloat(), rng.nextFloat()));
+        V.col(3 * i) = p0;
+        V.col(3 * i + 1) = p0 + length * dir;
+        V.col(3 * i + 2) = p0 + width * offset;
+        for (uint32_t k = 0; k < 3; ++k)
+            F(k, i) = 3 * i + k;
+    }
+    return new SyntheticMesh("thin", V, F);
+}
+
+/* Camera rays of a pinhole camera that looks at the mesh from outside,
+   in scanline order so that consecutive rays are coherent */
+static std::vector<Ray3f> createCoherentRays(const BoundingBox3f &bbox, uint32_t count) {
+    Point3f center = bbox.getCenter();
+    float radius = 0.5f * bbox.getExtents().norm();
+    Point3f origin = center + Vector3f(0.6f, 0.8f, 1.5f).normalized() * (2.5f * radius);
+
+    Vector3f forward = (center - origin).normalized();
+    Vector3f right = forward.cross(Vector3f(0, 1, 0)).normalized();
+    Vector3f up = right.cross(forward);
+    float scale = std::tan(degToRad(45.0f) * 0.5f);
+
+    uint32_t res = std::max(1u, (uint32_t) std::sqrt((float) count));
+    std::vector<Ray3f> rays;
+    rays.reserve(res * res);
+    for (uint32_t y = 0; y < res; ++y) {
+        for (uint32_t x = 0; x < res; ++x) {
+            float u = (2.0f * (x + 0.5f) / res - 1.0f) * scale;
+            float v = (1.0f - 2.0f * (y + 0.5f) / res) * scale;
+            rays.push_back(Ray3f(origin, (forward + u * right + v * up).normalized()));
+        }
+    }
+    return rays;
+}
+
+/* Rays with random origins inside the bounding box and random directions */
+static std::vector<Ray3f> createIncoherentRays(pcg32 &rng, const BoundingBox3f &bbox,
+        uint32_t count) {
+    std::vector<Ray3f> rays;
+    rays.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        Vector3f t(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
+        Point3f origin = bbox.min + bbox.getExtents().cwiseProduct(t);
+        Vector3f dir = Warp::squareToUniformSphere(Point2f(rng.nextFloat(), rng.nextFloat()));
+        rays.push_back(Ray3f(origin, dir));
+    }
+    return rays;
+}
+
+/* Trace a set of rays and print the time and work per ray */
+static void benchmarkQueries(const BVH &bvh, const std::vector<Ray3f> &rays,
+        bool shadowRay, const char *name) {
+    uint32_t hits = 0;
+    Intersection its;
+
+    double start = Statistics::now();
+    for (const Ray3f &ray : rays)
+        hits += bvh.rayIntersect(ray, its, shadowRay) ? 1 : 0;
+    double elapsed = Statistics::now() - start;
+    double count = (double) rays.size();
+
+    std::string counters;
+#if defined(NORI_STATISTICS)
+    /* Trace the rays once more to collect the counters, outside of the timed loop */
+    Statistics::reset();
+    for (const Ray3f &ray : rays)
+        bvh.rayIntersect(ray, its, shadowRay);
+
+    ThreadStatistics total;
+    for (const ThreadStatistics &stats : Statistics::getThreads())
+        total.add(stats);
+    counters = tfm::format(", %6.2f nodes/ray, %6.2f triangles/ray",
+        total.nodeVisits / count, total.triangleTests / count);
+#endif
+
+    cout << tfm::format("    %-20s: %8.1f ns/ray%s, %5.1f%% hits",
+        name, elapsed * 1e6 / count, counters, 100.0 * hits / count) << endl;
+}
+
+/* Creates the meshes of a benchmark. Every BVH takes ownership of its
+   meshes, hence they are created anew for each builder */
+typedef std::function<std::vector<Mesh *>()> MeshFactory;
+
+static void benchmarkMeshes(const std::string &name, const MeshFactory &createMeshes,
+        const std::vector<BVH::EBuildMethod> &methods, uint32_t rayCount, int repeat) {
+    static const char *methodNames[] = { "sah", "sbvh", "lbvh", "hlbvh" };
+    std::vector<Ray3f> coherent, incoherent;
+
+    for (size_t i = 0; i < methods.size(); ++i) {
+        BVH bvh;
+        bvh.setBuildMethod(methods[i]);
+        for (Mesh *mesh : createMeshes())
+            bvh.addMesh(mesh);
+        uint32_t triangleCount = bvh.getTriangleCount();
+
+        /* All builders are measured with the same rays */
+        if (i == 0) {
+            pcg32 rng;
+            coherent = createCoherentRays(bvh.getBoundingBox(), rayCount);
+            incoherent = createIncoherentRays(rng, bvh.getBoundingBox(), rayCount);
+            cout << endl << name << " (" << triangleCount << " triangles)" << endl;
+        }
+
+        /* Keep the fastest of several builds */
+        double buildTime = std::numeric_limits<double>::infinity();
+        for (int j = 0; j < repeat; ++j) {
+            double start = Statistics::now();
+            bvh.build();
+            buildTime = std::min(buildTime, Statistics::now() - start);
+        }
+
+        cout << tfm::format("  %s: built in %s (%.2f Mtriangles/s)", methodNames[methods[i]],
+            timeString(buildTime, true), triangleCount / (buildTime * 1000.0)) << endl;
+        benchmarkQueries(bvh, coherent, false, "closest, coherent");
+        benchmarkQueries(bvh, incoherent, false, "closest, incoherent");
+        benchmarkQueries(bvh, coherent, true, "shadow, coherent");
+        benchmarkQueries(bvh, incoherent, true, "shadow, incoherent");
+    }
+}
+
+static void help(const char *name) {
+    std::cout << "Syntax: " << name << " [options] [mesh.obj ..]" << std::endl
+              << "Options:" << std::endl
+              << "   -n, --triangles <count>  Triangles per synthetic mesh (default: 250000)" << std::endl
+              << "   -r, --rays <count>       Rays per query type (default: 1048576)" << std::endl
+              << "   -b, --builder <name>     Benchmark only this builder (sah, sbvh, lbvh or" << std::endl
+              << "                            hlbvh), may be given several times (default: all)" << std::endl
+              << "   --repeat <count>         Number of builds, the fastest is reported (default: 3)" << std::endl
+              << "   -t, --threads <count>    Number of threads for the BVH construction" << std::endl
+              << "   --no-synthetic           Only benchmark the given OBJ files" << std::endl
+              << "   -h, --help               Display this help text" << std::endl
+              << std::endl
+              << "The rays are traced on a single thread. The node visits and triangle" << std::endl
+              << "tests per ray are reported when Nori is built with NORI_STATISTICS, but" << std::endl
+              << "the timings of such a build include the cost of the counters." << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> filenames;
+    std::vector<BVH::EBuildMethod> methods;
+    uint32_t triangleCount = 250000, rayCount = 1u << 20;
+    int threadCount = -1, repeat = 3;
+    bool synthetic = true;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string token = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (token == "-h" || token == "--help") {
+                help(argv[0]);
+                return 0;
+            } else if ((token == "-n" || token == "--triangles") && hasValue) {
+                triangleCount = toUInt(argv[++i]);
+            } else if ((token == "-r" || token == "--rays") && hasValue) {
+                rayCount = toUInt(argv[++i]);
+            } else if ((token == "-b" || token == "--builder") && hasValue) {
+                std::string builder = argv[++i];
+                if (builder == "sah")
+                    methods.push_back(BVH::ESAH);
+                else if (builder == "sbvh")
+                    methods.push_back(BVH::ESBVH);
+                else if (builder == "lbvh")
+                    methods.push_back(BVH::ELBVH);
+                else if (builder == "hlbvh")
+                    methods.push_back(BVH::EHLBVH);
+                else
+                    throw NoriException("Unknown BVH builder \"%s\"!", builder);
+            } else if (token == "--repeat" && hasValue) {
+                repeat = toInt(argv[++i]);
+                if (repeat <= 0)
+                    throw NoriException("Invalid repetition count: %i", repeat);
+            } else if ((token == "-t" || token == "--threads") && hasValue) {
+                threadCount = toInt(argv[++i]);
+                if (threadCount <= 0)
+                    throw NoriException("Invalid thread count: %i", threadCount);
+            } else if (token == "--no-synthetic") {
+                synthetic = false;
+            } else if (token.size() > 0 && token[0] != '-') {
+                filenames.push_back(token);
+            } else {
+                cerr << "Error: unexpected argument \"" << token << "\"" << endl;
+                help(argv[0]);
+                return -1;
+            }
+        }
+
+        if (triangleCount == 0 || rayCount == 0)
+            throw NoriException("The triangle and ray counts must be positive!");
+        if (methods.empty())
+            methods = { BVH::ESAH, BVH::ESBVH, BVH::ELBVH, BVH::EHLBVH };
+
+        tbb::task_scheduler_init init(threadCount);
+
+        if (synthetic) {
+            benchmarkMeshes("Uniform random triangles", [&]() {
+                return std::vector<Mesh *> { createRandomTriangles(triangleCount) };
+            }, methods, rayCount, repeat);
+            benchmarkMeshes("Tessellated sphere", [&]() {
+                return std::vector<Mesh *> { createSphere(triangleCount) };
+            }, methods, rayCount, repeat);
+            benchmarkMeshes("Long and thin triangles", [&]() {
+                return std::vector<Mesh *> { createThinTriangles(triangleCount) };
+            }, methods, rayCount, repeat);
+        }
+
+        for (const std::string &filename : filenames) {
+            benchmarkMeshes(filename, [&]() {
+                PropertyList propList;
+                propList.setString("filename", filename);
+                return std::vector<Mesh *> { static_cast<Mesh *>(
+                    NoriObjectFactory::createInstance("obj", propList)) };
+            }, methods, rayCount, repeat);
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
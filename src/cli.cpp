@@ -0,0 +1,123 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/block.h>
+#include <nori/render.h>
+#include <filesystem/path.h>
+
+/* Headless renderer: loads a scene, renders it and exits without a GUI */
+
+static void help(const char *name) {
+    std::cout << "Syntax: " << name << " [options] <scene.xml>" << std::endl
+              << "Options:" << std::endl
+              << "   -t, --threads <count>   Number of worker threads (default: one per core)" << std::endl
+              << "   -s, --spp <count>       Override the sample count of the scene's sampler" << std::endl
+              << "   -b, --batch <count>     Samples rendered per tile task (default: 0 = all," << std::endl
+              << "                           1 = progressive refinement)" << std::endl
+              << "   -o, --output <file>     Output filename (.exr or .png, default: <scene>.exr)" << std::endl
+              << "   --single-threaded       Render the image blocks on a single thread" << std::endl
+              << "   --wavefront             Trace the samples of each tile as ray streams" << std::endl
+              << "   --bvh <builder>         Override the BVH builder of the scene (sah, sbvh," << std::endl
+              << "                           lbvh or hlbvh)" << std::endl
+              << "   --bvh-per-mesh          Build a BVH per mesh while the scene is loading" << std::endl
+              << "   --trace <file>          Write a timeline of the run in Chrome trace format" << std::endl
+              << "   -h, --help              Display this help text" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    using namespace nori;
+
+    std::string sceneName, outputName, bvhBuilder, traceName;
+    int threadCount = -1;
+    int sampleCount = 0;
+    int samplesPerPass = 0;
+    bool singleThreaded = false;
+    bool wavefront = false;
+    bool bvhPerMesh = false;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string token = argv[i];
+            bool hasValue = i + 1 < argc;
+
+            if (token == "-h" || token == "--help") {
+                help(argv[0]);
+                return 0;
+            } else if ((token == "-t" || token == "--threads") && hasValue) {
+                threadCount = toInt(argv[++i]);
+                if (threadCount <= 0)
+                    throw NoriException("Invalid thread count: %i", threadCount);
+            } else if ((token == "-s" || token == "--spp") && hasValue) {
+                sampleCount = toInt(argv[++i]);
+                if (sampleCount <= 0)
+                    throw NoriException("Invalid sample count: %i", sampleCount);
+            } else if ((token == "-b" || token == "--batch") && hasValue) {
+                samplesPerPass = toInt(argv[++i]);
+                if (samplesPerPass < 0)
+                    throw NoriException("Invalid batch size: %i", samplesPerPass);
+            } else if ((token == "-o" || token == "--output") && hasValue) {
+                outputName = argv[++i];
+            } else if (token == "--single-threaded") {
+                singleThreaded = true;
+            } else if (token == "--wavefront") {
+                wavefront = true;
+            } else if (token == "--bvh" && hasValue) {
+                bvhBuilder = argv[++i];
+            } else if (token == "--bvh-per-mesh") {
+                bvhPerMesh = true;
+            } else if (token == "--trace" && hasValue) {
+                traceName = argv[++i];
+            } else if (sceneName.empty() && filesystem::path(token).extension() == "xml") {
+                sceneName = token;
+            } else {
+                cerr << "Error: unexpected argument \"" << token << "\"" << endl;
+                help(argv[0]);
+                return -1;
+            }
+        }
+
+        if (sceneName.empty()) {
+            help(argv[0]);
+            return -1;
+        }
+
+        ImageBlock block(Vector2i(720, 720), nullptr);
+        RenderThread renderThread(block);
+        renderThread.setThreadCount(threadCount);
+        renderThread.setSampleCount((uint32_t) sampleCount);
+        renderThread.setSamplesPerPass((uint32_t) samplesPerPass);
+        renderThread.setWavefront(wavefront);
+        renderThread.setBVHBuilder(bvhBuilder);
+        renderThread.setBVHPerMesh(bvhPerMesh);
+        renderThread.setOutputName(outputName);
+        renderThread.setTraceName(traceName);
+
+        if (!renderThread.renderScene(sceneName, singleThreaded)) {
+            cerr << "Error: the root element of \"" << sceneName
+                 << "\" is not a scene" << endl;
+            return -1;
+        }
+
+        if (!renderThread.waitUntilDone())
+            return -1;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
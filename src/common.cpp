@@ -184,6 +184,30 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+std::string jsonString(const std::string &value) {
+    std::string result = "\"";
+    for (char c : value) {
+        switch (c) {
+            case '"':  result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                /* Other control characters must be written as code points */
+                if ((unsigned char) c < 0x20) {
+                    const char *hex = "0123456789abcdef";
+                    result += "\\u00";
+                    result += hex[c >> 4];
+                    result += hex[c & 15];
+                } else {
+                    result += c;
+                }
+        }
+    }
+    return result + "\"";
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
@@ -142,7 +142,9 @@ NoriScreen::~NoriScreen() {
 }
 
 void NoriScreen::drawContents() {
-    /* Reload the partially rendered image onto the GPU */
+    /* Reload the partially rendered image onto the GPU. Fetching it
+       from the render thread does not block the render workers */
+    m_renderThread.updateBlock();
     m_block.lock();
     int borderSize = m_block.getBorderSize();
     const Vector2i &size = m_block.getSize();
@@ -0,0 +1,54 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) {
+    m_toWorld = propList.getTransform("toWorld", Transform());
+}
+
+void Instance::addChild(NoriObject *child) {
+    if (child->getClassType() != EMesh)
+        throw NoriException("Instance::addChild(<%s>) is not supported!",
+            classTypeName(child->getClassType()));
+    if (m_mesh)
+        throw NoriException("Instance: tried to reference multiple meshes!");
+    m_mesh = static_cast<Mesh *>(child);
+}
+
+void Instance::activate() {
+    if (!m_mesh)
+        throw NoriException("Instance: no mesh was referenced (use <ref id=\"..\"/>)!");
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  mesh = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_mesh ? m_mesh->getName() : std::string("null"),
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
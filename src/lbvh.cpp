@@ -0,0 +1,376 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <tbb/tbb.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Linear BVH (LBVH / HLBVH) builder
+ *
+ * This builder trades tree quality for construction speed, which is useful
+ * for interactive previews. The triangle centroids are quantized to a grid
+ * and sorted along a Morton (Z-order) curve using a parallel radix sort.
+ * Triangles that are close along the curve are close in space, hence the
+ * hierarchy can be emitted directly by splitting each range of triangles
+ * where the next bit of their Morton codes changes (LBVH), see
+ *
+ * "Fast BVH Construction on GPUs"
+ * by C. Lauterbach, M. Garland, S. Sengupta, D. Luebke, and D. Manocha
+ * (Computer Graphics Forum, Proc. Eurographics 2009)
+ *
+ * Since the upper levels of such trees are of particularly low quality,
+ * the hierarchical variant (HLBVH) only emits treelets for the triangles
+ * sharing the leading Morton code bits in this way, and combines these
+ * treelets using the surface area heuristic, see
+ *
+ * "Simpler and Faster HLBVH with Work Queues"
+ * by K. Garanzha, J. Pantaleoni, and D. McAllister
+ * (Proc. High-Performance Graphics 2011)
+ *
+ * Like the SAH builder, nodes are allocated conservatively (a subtree with
+ * \c n triangles starts 2n nodes after the left sibling), which allows
+ * building disjoint subtrees in parallel. The unused entries are removed
+ * by the compaction pass in \ref BVH::build().
+ */
+class LinearBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Bits per axis of the Morton codes (30 bits in total)
+        MORTON_BITS = 10,
+
+        /// Number of Morton code bits that are sorted per radix sort pass
+        RADIX_BITS = 8,
+
+        /// Leading Morton code bits shared by the triangles of an HLBVH treelet
+        TREELET_BITS = 12,
+
+        /// Ranges with at most this many triangles become leaves
+        LEAF_SIZE = 4,
+
+        /// Build subtrees with more triangles than this in parallel
+        PARALLEL_THRESHOLD = 4096,
+
+        /// Process triangles in batches for the purpose of parallelization
+        GRAIN_SIZE = 4096
+    };
+
+    /**
+     * \brief Prepare the build
+     *
+     * \param hierarchical
+     *    Combine the treelets using the SAH (HLBVH) instead of
+     *    continuing to split at Morton code bits (LBVH)
+     */
+    LinearBuilder(BVH &bvh, bool hierarchical)
+        : m_bvh(bvh), m_hierarchical(hierarchical) { }
+
+    /// Build the binary tree into \ref BVH::m_nodes and \ref BVH::m_indices
+    void build() {
+        uint32_t size = m_bvh.getPrimitiveCount();
+
+        /* Gather the triangle bounds and the bounds of their centroids */
+        m_bounds.resize(size);
+        BoundingBox3f centroidBounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_bounds[i] = m_bvh.getBoundingBox(i);
+                    result.expandBy(m_bounds[i].getCenter());
+                }
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        /* Quantize the centroids and compute their Morton codes */
+        m_codes.resize(size);
+        Vector3f extents = centroidBounds.getExtents();
+        Vector3f scale;
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? (1 << MORTON_BITS) / extents[axis] : 0.0f;
+
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    Vector3f p = (m_bounds[i].getCenter() - centroidBounds.min).cwiseProduct(scale);
+                    uint32_t code = 0;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        uint32_t value = (uint32_t) std::min(std::max(p[axis], 0.0f),
+                            (float) ((1 << MORTON_BITS) - 1));
+                        code |= expandBits(value) << axis;
+                    }
+                    m_codes[i].code = code;
+                    m_codes[i].index = i;
+                }
+            }
+        );
+
+        radixSort();
+
+        m_bvh.m_indices.resize(size);
+        for (uint32_t i = 0; i < size; ++i)
+            m_bvh.m_indices[i] = m_codes[i].index;
+
+        m_bvh.m_nodes.assign(2 * size, BVH::BVHNode());
+
+        if (!m_hierarchical) {
+            emitNode(0, 0, size, 3 * MORTON_BITS - 1);
+        } else {
+            /* Split the sorted triangles into treelets that share the leading bits */
+            const int shift = 3 * MORTON_BITS - TREELET_BITS;
+            std::vector<Treelet> treelets;
+            for (uint32_t start = 0, end = 1; end <= size; ++end) {
+                if (end == size || (m_codes[start].code >> shift) != (m_codes[end].code >> shift)) {
+                    treelets.push_back(Treelet { start, end, BoundingBox3f() });
+                    start = end;
+                }
+            }
+
+            tbb::parallel_for(
+                tbb::blocked_range<size_t>(0u, treelets.size()),
+                [&](const tbb::blocked_range<size_t> &range) {
+                    for (size_t i = range.begin(); i != range.end(); ++i) {
+                        Treelet &treelet = treelets[i];
+                        for (uint32_t k = treelet.start; k < treelet.end; ++k)
+                            treelet.bbox.expandBy(m_bounds[m_codes[k].index]);
+                    }
+                }
+            );
+
+            buildUpper(0, treelets.data(), treelets.data() + treelets.size());
+        }
+
+        m_bounds.clear();
+        m_codes.clear();
+    }
+
+private:
+    /// Morton code of a triangle
+    struct MortonPrimitive {
+        uint32_t code, index;
+    };
+
+    /// Triangles that share the leading Morton code bits (HLBVH)
+    struct Treelet {
+        uint32_t start, end;
+        BoundingBox3f bbox;
+    };
+
+    /// Insert two zero bits in front of each of the 10 lowest bits
+    static uint32_t expandBits(uint32_t v) {
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v <<  8)) & 0x0300F00F;
+        v = (v | (v <<  4)) & 0x030C30C3;
+        v = (v | (v <<  2)) & 0x09249249;
+        return v;
+    }
+
+    /**
+     * \brief Stable parallel LSD radix sort of \ref m_codes
+     *
+     * Each pass counts the digits of a block of codes in parallel, turns the
+     * counts into per-block output offsets and scatters the blocks in parallel.
+     */
+    void radixSort() {
+        const uint32_t bucketCount = 1 << RADIX_BITS, size = (uint32_t) m_codes.size();
+        const uint32_t blockCount = (size + GRAIN_SIZE - 1) / GRAIN_SIZE;
+        std::vector<MortonPrimitive> temp(size);
+        std::vector<uint32_t> offsets((size_t) blockCount * bucketCount);
+
+        for (int shift = 0; shift < 3 * MORTON_BITS; shift += RADIX_BITS) {
+            const uint32_t mask = bucketCount - 1;
+
+            tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, blockCount, 1),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    for (uint32_t b = range.begin(); b != range.end(); ++b) {
+                        uint32_t *counts = &offsets[(size_t) b * bucketCount];
+                        memset(counts, 0, sizeof(uint32_t) * bucketCount);
+                        for (uint32_t i = b * GRAIN_SIZE; i < std::min(size, (b+1) * GRAIN_SIZE); ++i)
+                            counts[(m_codes[i].code >> shift) & mask]++;
+                    }
+                }
+            );
+
+            /* Exclusive prefix sum in digit-major order keeps the sort stable */
+            uint32_t sum = 0;
+            for (uint32_t digit = 0; digit < bucketCount; ++digit) {
+                for (uint32_t b = 0; b < blockCount; ++b) {
+                    uint32_t &offset = offsets[(size_t) b * bucketCount + digit];
+                    uint32_t count = offset;
+                    offset = sum;
+                    sum += count;
+                }
+            }
+
+            tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, blockCount, 1),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    for (uint32_t b = range.begin(); b != range.end(); ++b) {
+                        uint32_t *offset = &offsets[(size_t) b * bucketCount];
+                        for (uint32_t i = b * GRAIN_SIZE; i < std::min(size, (b+1) * GRAIN_SIZE); ++i)
+                            temp[offset[(m_codes[i].code >> shift) & mask]++] = m_codes[i];
+                    }
+                }
+            );
+            m_codes.swap(temp);
+        }
+    }
+
+    /**
+     * \brief Emit the subtree for the sorted triangles <tt>[start, end)</tt>,
+     * which agree in all Morton code bits above \c bit
+     *
+     * \return The bounding box of the subtree
+     */
+    BoundingBox3f emitNode(uint32_t node_idx, uint32_t start, uint32_t end, int bit) {
+        BVH::BVHNode &node = m_bvh.m_nodes[node_idx];
+        uint32_t size = end - start;
+
+        if (size <= LEAF_SIZE) {
+            node.bbox.reset();
+            for (uint32_t i = start; i < end; ++i)
+                node.bbox.expandBy(m_bounds[m_codes[i].index]);
+            node.leaf.flag = 1;
+            node.leaf.start = start;
+            node.leaf.size = size;
+            return node.bbox;
+        }
+
+        /* Split where the highest differing bit changes from 0 to 1. Triangles
+           with identical codes are simply split in the middle */
+        uint32_t split = start + size / 2;
+        int axis = 0;
+        for (; bit >= 0; --bit) {
+            uint32_t mask = 1u << bit;
+            if ((m_codes[start].code & mask) == (m_codes[end - 1].code & mask))
+                continue;
+            split = (uint32_t) (std::partition_point(m_codes.begin() + start,
+                m_codes.begin() + end, [&](const MortonPrimitive &p) {
+                    return (p.code & mask) == 0;
+                }) - m_codes.begin());
+            axis = bit % 3;
+            break;
+        }
+
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * (split - start);
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = axis;
+        node.inner.flag = 0;
+
+        BoundingBox3f bbox_left, bbox_right;
+        if (size > PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { bbox_left = emitNode(node_idx_left, start, split, bit - 1); },
+                [&] { bbox_right = emitNode(node_idx_right, split, end, bit - 1); }
+            );
+        } else {
+            bbox_left = emitNode(node_idx_left, start, split, bit - 1);
+            bbox_right = emitNode(node_idx_right, split, end, bit - 1);
+        }
+        node.bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+        return node.bbox;
+    }
+
+    /// Combine a set of treelets using the surface area heuristic (HLBVH)
+    BoundingBox3f buildUpper(uint32_t node_idx, Treelet *begin, Treelet *end) {
+        uint32_t count = (uint32_t) (end - begin);
+        if (count == 1)
+            return emitNode(node_idx, begin->start, begin->end, 3 * MORTON_BITS - TREELET_BITS - 1);
+
+        /* Try all partitions of the treelets sorted along each axis. Unlike in the
+           SAH builder, there is no leaf option: the triangles of different
+           treelets are not stored next to each other */
+        std::vector<float> left_areas(count);
+        float best_cost = std::numeric_limits<float>::infinity();
+        uint32_t best_index = 1;
+        int best_axis = 0;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            sortTreelets(begin, end, axis);
+
+            BoundingBox3f bbox;
+            for (uint32_t i = 0; i < count; ++i) {
+                bbox.expandBy(begin[i].bbox);
+                left_areas[i] = bbox.getSurfaceArea();
+            }
+
+            bbox.reset();
+            uint32_t prims_right = 0, prims_total = 0;
+            for (uint32_t i = 0; i < count; ++i)
+                prims_total += begin[i].end - begin[i].start;
+
+            for (uint32_t i = count - 1; i >= 1; --i) {
+                bbox.expandBy(begin[i].bbox);
+                prims_right += begin[i].end - begin[i].start;
+                float cost = left_areas[i - 1] * (prims_total - prims_right) +
+                    bbox.getSurfaceArea() * prims_right;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_index = i;
+                    best_axis = axis;
+                }
+            }
+        }
+        sortTreelets(begin, end, best_axis);
+
+        uint32_t left_count = 0;
+        for (uint32_t i = 0; i < best_index; ++i)
+            left_count += begin[i].end - begin[i].start;
+
+        BVH::BVHNode &node = m_bvh.m_nodes[node_idx];
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = best_axis;
+        node.inner.flag = 0;
+
+        BoundingBox3f bbox_left, bbox_right;
+        tbb::parallel_invoke(
+            [&] { bbox_left = buildUpper(node_idx_left, begin, begin + best_index); },
+            [&] { bbox_right = buildUpper(node_idx_right, begin + best_index, end); }
+        );
+        node.bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+        return node.bbox;
+    }
+
+    /// Sort treelets by the centroids of their bounds along the given axis
+    static void sortTreelets(Treelet *begin, Treelet *end, int axis) {
+        std::sort(begin, end, [axis](const Treelet &t1, const Treelet &t2) {
+            return t1.bbox.min[axis] + t1.bbox.max[axis] <
+                   t2.bbox.min[axis] + t2.bbox.max[axis];
+        });
+    }
+
+    BVH &m_bvh;
+    bool m_hierarchical;
+    std::vector<BoundingBox3f> m_bounds;
+    std::vector<MortonPrimitive> m_codes;
+};
+
+void BVH::buildLinear(bool hierarchical) {
+    LinearBuilder(*this, hierarchical).build();
+}
+
+NORI_NAMESPACE_END
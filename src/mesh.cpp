@@ -40,17 +40,43 @@ void Mesh::activate() {
     }
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V, const MatrixXf &N) {
+    bool hasNormals = getVertexNormals().size() > 0;
+    if (V.rows() != 3 || (uint32_t) V.cols() != getVertexCount())
+        throw NoriException("Mesh \"%s\": expected %i new vertex positions, got %i!",
+            m_name, getVertexCount(), V.cols());
+    if (hasNormals && (N.rows() != 3 || (uint32_t) N.cols() != getVertexCount()))
+        throw NoriException("Mesh \"%s\": expected %i new vertex normals, got %i!",
+            m_name, getVertexCount(), N.cols());
+
+    /* Mapped data is read-only, the new positions are stored in the mesh */
+    m_V = V;
+    m_mappedV = nullptr;
+    if (hasNormals) {
+        m_N = N;
+        m_mappedN = nullptr;
+    }
+
+    m_bbox.reset();
+    for (uint32_t i = 0; i < (uint32_t) m_V.cols(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    MatrixXfView V = getVertexPositions();
+    MatrixXuView F = getIndices();
+    uint32_t i0 = F(0, index), i1 = F(1, index), i2 = F(2, index);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    MatrixXfView V = getVertexPositions();
+    MatrixXuView F = getIndices();
+    uint32_t i0 = F(0, index), i1 = F(1, index), i2 = F(2, index);
+    const Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
@@ -88,17 +114,21 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    MatrixXfView V = getVertexPositions();
+    MatrixXuView F = getIndices();
+    BoundingBox3f result(V.col(F(0, index)));
+    result.expandBy(V.col(F(1, index)));
+    result.expandBy(V.col(F(2, index)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
+    MatrixXfView V = getVertexPositions();
+    MatrixXuView F = getIndices();
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (V.col(F(0, index)) +
+         V.col(F(1, index)) +
+         V.col(F(2, index)));
 }
 
 void Mesh::addChild(NoriObject *obj) {
@@ -135,8 +165,8 @@ std::string Mesh::toString() const {
         "  emitter = %s\n"
         "]",
         m_name,
-        m_V.cols(),
-        m_F.cols(),
+        getVertexCount(),
+        getTriangleCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
@@ -0,0 +1,77 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/binarymesh.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <memory>
+
+/* Mesh converter: loads a mesh with the plugin matching its extension and
+   writes it to a binary mesh file, which the "nmesh" plugin maps without
+   parsing it again */
+
+using namespace nori;
+
+static void help(const char *name) {
+    std::cout << "Syntax: " << name << " <input.obj|input.ply> [output.nmesh]" << std::endl
+              << "The output defaults to the input filename with the extension .nmesh" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3 || std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help") {
+        help(argv[0]);
+        return argc == 2 ? 0 : -1;
+    }
+
+    try {
+        filesystem::path input(argv[1]);
+        std::string outputName;
+        if (argc == 3) {
+            outputName = argv[2];
+        } else {
+            outputName = input.str();
+            size_t lastdot = outputName.find_last_of(".");
+            if (lastdot != std::string::npos)
+                outputName.erase(lastdot, std::string::npos);
+            outputName += ".nmesh";
+        }
+
+        std::string type = input.extension();
+        for (char &c : type)
+            c = (char) tolower(c);
+        if (type == "nmesh")
+            throw NoriException("\"%s\" already is a binary mesh file!", input);
+
+        PropertyList propList;
+        propList.setString("filename", input.str());
+        std::unique_ptr<NoriObject> object(NoriObjectFactory::createInstance(type, propList));
+        const Mesh *mesh = dynamic_cast<const Mesh *>(object.get());
+        if (!mesh)
+            throw NoriException("\"%s\" is not a mesh format!", type);
+
+        Timer timer;
+        writeBinaryMesh(mesh, outputName);
+        cout << "Wrote \"" << outputName << "\" (V=" << mesh->getVertexCount()
+             << ", F=" << mesh->getTriangleCount() << ", took "
+             << timer.elapsedString() << ")." << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
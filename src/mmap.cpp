@@ -0,0 +1,155 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mmap.h>
+#include <cstdio>
+#include <fstream>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+#if defined(PLATFORM_WINDOWS)
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename)
+    : m_filename(filename) {
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        throw NoriException("Unable to open file \"%s\"!", filename);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw NoriException("Unable to determine the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) size.QuadPart;
+    if (m_size == 0)
+        return;
+
+    m_mapping = CreateFileMapping(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data) {
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw NoriException("Unable to map \"%s\" into memory!", filename);
+    }
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+}
+
+/// Create a temporary file with a unique name next to the given file
+static std::string createTempFile(const std::string &filename) {
+    return filename + tfm::format(".%i.%i.tmp",
+        (uint32_t) GetCurrentProcessId(), (uint32_t) GetCurrentThreadId());
+}
+
+/// Replace 'target' by 'source' (atomically if 'target' exists)
+static bool replaceFile(const std::string &source, const std::string &target) {
+    return MoveFileExA(source.c_str(), target.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+#else
+
+MemoryMappedFile::MemoryMappedFile(const std::string &filename)
+    : m_filename(filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw NoriException("Unable to open file \"%s\": %s", filename, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw NoriException("Unable to determine the size of \"%s\": %s", filename, strerror(errno));
+    }
+    m_size = (size_t) st.st_size;
+
+    if (m_size > 0) {
+        m_data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m_data == MAP_FAILED) {
+            m_data = nullptr;
+            close(fd);
+            throw NoriException("Unable to map \"%s\" into memory: %s", filename, strerror(errno));
+        }
+    }
+
+    /* The mapping stays valid after the file descriptor is closed */
+    close(fd);
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        munmap(m_data, m_size);
+}
+
+/// Create a temporary file with a unique name next to the given file
+static std::string createTempFile(const std::string &filename) {
+    std::string tempName = filename + ".XXXXXX";
+    int fd = mkstemp(&tempName[0]);
+    if (fd == -1)
+        throw NoriException("Unable to create a temporary file for \"%s\": %s",
+            filename, strerror(errno));
+    /* mkstemp() only grants access to the owner */
+    fchmod(fd, 0644);
+    close(fd);
+    return tempName;
+}
+
+/// Replace 'target' by 'source' (atomic on POSIX systems)
+static bool replaceFile(const std::string &source, const std::string &target) {
+    return rename(source.c_str(), target.c_str()) == 0;
+}
+
+#endif
+
+void writeFileAtomic(const std::string &filename,
+        const std::function<void(std::ostream &)> &write) {
+    std::string tempName = createTempFile(filename);
+    try {
+        std::ofstream os(tempName, std::ios::binary | std::ios::trunc);
+        write(os);
+        os.close();
+        if (!os.good() || !replaceFile(tempName, filename))
+            throw NoriException("Unable to write \"%s\"!", filename);
+    } catch (...) {
+        std::remove(tempName.c_str());
+        throw;
+    }
+}
+
+NORI_NAMESPACE_END
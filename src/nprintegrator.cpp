@@ -33,89 +33,107 @@ public:
         if (!scene->rayIntersect(ray, its)) {
             return Color3f(1.f);
         }
-        else {
-            const BSDF* currBSDF = its.mesh->getBSDF();
-            if (currBSDF != nullptr) {
-                // create the emitter query record and sample a light source
-                // assuming just one light source for now.
-                EmitterQueryRecord eRec;
-                const Emitter* light = scene->getLights()[0];
-                if (light != nullptr) {
-                    // Sample the light source
-                    eRec.ref = its.p;
-                    Color3f Li = light->sample(eRec, sampler->next2D());
-
-                    // compute the bsdf contribution
-                    const Vector3f wo = its.shFrame.toLocal(-ray.d.normalized());
-                    const Vector3f wi = its.shFrame.toLocal(eRec.wi);
-                    BSDFQueryRecord bRec(wo, wi, ESolidAngle);
-                    const Color3f f = currBSDF->eval(bRec);
-
-                    // Compute visibility;
-                    Ray3f shadowRay(its.p, eRec.wi, Epsilon, (1.0f - Epsilon) * eRec.dist);
-                    const float vis = scene->rayIntersect(shadowRay) ? 0.f : 1.f;
-
-                    // compute other terms and the final color
-                    const float cosTheta = std::abs(Frame::cosTheta(wi));
-                    Color3f L = Li * f * cosTheta * vis;
-
-                    // Compute the edge color
-                    if (ray.m_hasRayDifferentials) {
-                        std::unique_ptr<Intersection> stencilHits(new Intersection[ray.m_totalStencilRays]);
-                        for (int rd = 0; rd < ray.m_totalStencilRays; rd++) {
-                            scene->rayIntersect(ray.getStencilRay(rd), stencilHits.get()[rd]);
-                        }
-
-                        // count m
-                        int m = 0;
-                        const Mesh* gS = its.mesh;
-                        for (int i = 0; i < ray.m_totalStencilRays; i++) {
-                            const Mesh* gR = stencilHits.get()[i].mesh;
-                            if (gR != gS)
-                                m++;
-                        }
-
-                        // check if m == 0
-                        // we can shade crease edges
-                        if (m == 0) {
-                            // m == 0 only when all the intersections are actually valid
-                            const Normal3f& n0 = stencilHits.get()[0].geoFrame.n;
-                            const Normal3f& n1 = stencilHits.get()[1].geoFrame.n;
-                            const Normal3f& n2 = stencilHits.get()[2].geoFrame.n;
-                            const Normal3f& n3 = stencilHits.get()[3].geoFrame.n;
-                            const Normal3f& n4 = stencilHits.get()[4].geoFrame.n;
-                            const Normal3f& n5 = stencilHits.get()[5].geoFrame.n;
-                            const Normal3f& n6 = stencilHits.get()[6].geoFrame.n;
-                            const Normal3f& n7 = stencilHits.get()[7].geoFrame.n;
-
-                            // front and sideways
-                            float dot1 = n0.dot(n4);
-                            float dot2 = n1.dot(n5);
-                            float dot3 = n2.dot(n6);
-                            float dot4 = n3.dot(n7);
-
-                            // check for creases
-                            if (abs(dot1) < m_threshCrease) m += 4;
-                            else if (abs(dot2) < m_threshCrease) m += 4;
-                            else if (abs(dot3) < m_threshCrease) m += 4;
-                            else if (abs(dot4) < m_threshCrease) m += 4;
-                        }
-
-                        // compute the edge strength metric
-                        const float factor = 0.5f * ray.m_totalStencilRays;
-                        const float edgeStrength = clamp(1.0f - std::abs(m - factor) / factor, 0.f, 1.f);
-
-                        // lerp between L and edge strength
-                        return (1.0f - edgeStrength) * L;
+        return shade(scene, sampler, ray, its);
+    }
+
+    // Integrator function for camera rays that were intersected as a packet
+    virtual Color3f Li(const Scene *scene, Sampler *sampler,
+            const RayDifferential& ray, const Intersection *its) const {
+        if (its == nullptr)
+            return Color3f(1.f);
+        return shade(scene, sampler, ray, *its);
+    }
+
+    virtual bool usesPrimaryIntersection() const { return true; }
+
+private:
+    // Shading and edge detection at the first intersection along a ray
+    Color3f shade(const Scene *scene, Sampler *sampler, const RayDifferential& ray, const Intersection &its) const {
+        const BSDF* currBSDF = its.mesh->getBSDF();
+        if (currBSDF != nullptr) {
+            // create the emitter query record and sample a light source
+            // assuming just one light source for now.
+            EmitterQueryRecord eRec;
+            const Emitter* light = scene->getLights()[0];
+            if (light != nullptr) {
+                // Sample the light source
+                eRec.ref = its.p;
+                Color3f Li = light->sample(eRec, sampler->next2D());
+
+                // compute the bsdf contribution
+                const Vector3f wo = its.shFrame.toLocal(-ray.d.normalized());
+                const Vector3f wi = its.shFrame.toLocal(eRec.wi);
+                BSDFQueryRecord bRec(wo, wi, ESolidAngle);
+                const Color3f f = currBSDF->eval(bRec);
+
+                // Compute visibility;
+                Ray3f shadowRay(its.p, eRec.wi, Epsilon, (1.0f - Epsilon) * eRec.dist);
+                const float vis = scene->rayIntersect(shadowRay) ? 0.f : 1.f;
+
+                // compute other terms and the final color
+                const float cosTheta = std::abs(Frame::cosTheta(wi));
+                Color3f L = Li * f * cosTheta * vis;
+
+                // Compute the edge color
+                if (ray.m_hasRayDifferentials) {
+                    // The stencil rays are coherent, trace them in packets
+                    std::unique_ptr<Intersection[]> stencilHits(new Intersection[ray.m_totalStencilRays]);
+                    for (int rd = 0; rd < ray.m_totalStencilRays; rd += RayPacket::Size) {
+                        RayPacket packet;
+                        int count = std::min(RayPacket::Size, ray.m_totalStencilRays - rd);
+                        for (int i = 0; i < count; i++)
+                            packet.setRay(i, ray.getStencilRay(rd + i));
+                        scene->rayIntersect(packet, stencilHits.get() + rd);
                     }
-                    return L;
+
+                    // count m
+                    int m = 0;
+                    const Mesh* gS = its.mesh;
+                    for (int i = 0; i < ray.m_totalStencilRays; i++) {
+                        const Mesh* gR = stencilHits.get()[i].mesh;
+                        if (gR != gS)
+                            m++;
+                    }
+
+                    // check if m == 0
+                    // we can shade crease edges
+                    if (m == 0) {
+                        // m == 0 only when all the intersections are actually valid
+                        const Normal3f& n0 = stencilHits.get()[0].geoFrame.n;
+                        const Normal3f& n1 = stencilHits.get()[1].geoFrame.n;
+                        const Normal3f& n2 = stencilHits.get()[2].geoFrame.n;
+                        const Normal3f& n3 = stencilHits.get()[3].geoFrame.n;
+                        const Normal3f& n4 = stencilHits.get()[4].geoFrame.n;
+                        const Normal3f& n5 = stencilHits.get()[5].geoFrame.n;
+                        const Normal3f& n6 = stencilHits.get()[6].geoFrame.n;
+                        const Normal3f& n7 = stencilHits.get()[7].geoFrame.n;
+
+                        // front and sideways
+                        float dot1 = n0.dot(n4);
+                        float dot2 = n1.dot(n5);
+                        float dot3 = n2.dot(n6);
+                        float dot4 = n3.dot(n7);
+
+                        // check for creases
+                        if (abs(dot1) < m_threshCrease) m += 4;
+                        else if (abs(dot2) < m_threshCrease) m += 4;
+                        else if (abs(dot3) < m_threshCrease) m += 4;
+                        else if (abs(dot4) < m_threshCrease) m += 4;
+                    }
+
+                    // compute the edge strength metric
+                    const float factor = 0.5f * ray.m_totalStencilRays;
+                    const float edgeStrength = clamp(1.0f - std::abs(m - factor) / factor, 0.f, 1.f);
+
+                    // lerp between L and edge strength
+                    return (1.0f - edgeStrength) * L;
                 }
+                return L;
             }
-            return Color3f(1.f);
         }
+        return Color3f(1.f);
     }
 
-private:
     float m_threshCrease;
 };
 
@@ -17,158 +17,526 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
+#include <nori/trace.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include <tbb/blocked_range.h>
+#include <atomic>
+#include <cfloat>
+#include <cstring>
+#include <tuple>
 
 NORI_NAMESPACE_BEGIN
 
+/// Vertex indices used by the OBJ format
+struct OBJVertex {
+    uint32_t p = (uint32_t) -1;
+    uint32_t n = (uint32_t) -1;
+    uint32_t uv = (uint32_t) -1;
+
+    inline OBJVertex() { }
+
+    inline OBJVertex(const std::string &string) {
+        std::vector<std::string> tokens = tokenize(string, "/", true);
+
+        if (tokens.size() < 1 || tokens.size() > 3)
+            throw NoriException("Invalid vertex data: \"%s\"", string);
+
+        p = toUInt(tokens[0]);
+
+        if (tokens.size() >= 2 && !tokens[1].empty())
+            uv = toUInt(tokens[1]);
+
+        if (tokens.size() >= 3 && !tokens[2].empty())
+            n = toUInt(tokens[2]);
+    }
+
+    inline bool operator==(const OBJVertex &v) const {
+        return v.p == p && v.n == n && v.uv == uv;
+    }
+};
+
+/// Contents of a range of lines of an OBJ file, which is parsed by one task
+struct OBJChunk {
+    const char *start, *end;
+    std::vector<Vector3f>  positions;
+    std::vector<Vector2f>  texcoords;
+    std::vector<Vector3f>  normals;
+    std::vector<OBJVertex> vertices; ///< Triangle vertices (quads are split)
+    BoundingBox3f bbox;
+    bool failed = false;
+    std::string error;               ///< First error of the range (if any)
+};
+
+/* Hand-written scanner for the common case of well-formed lines. Whenever
+   it encounters anything unusual, the line is passed to the std::istream
+   based parser instead, so that the results never differ from it */
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline const char *skipSpace(const char *s, const char *end) {
+    while (s < end && isSpace(*s))
+        ++s;
+    return s;
+}
+
+/* Is the given double exactly halfway between two single precision floats?
+   Rounding it to float could then differ from rounding the exact value */
+static inline bool isFloatMidpoint(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(double));
+    const uint64_t lowBits = (1ull << (DBL_MANT_DIG - FLT_MANT_DIG)) - 1;
+    return (bits & lowBits) == (lowBits + 1) / 2;
+}
+
+/**
+ * Parse a decimal number that is followed by whitespace or the end of the
+ * line, rounded exactly like std::istream (i.e. strtof) does. Returns the
+ * position after the number or \c nullptr if the caller should fall back
+ * to the std::istream parser.
+ */
+static const char *parseFloat(const char *s, const char *end, float &value) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *start = s;
+    bool negative = false, exact = true, anyDigits = false;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+
+    if (s < end && (*s == '+' || *s == '-'))
+        negative = *s++ == '-';
+
+    /* Integer and fractional digits (leading zeros do not count) */
+    for (bool fraction = false; s < end; ++s) {
+        if (*s == '.' && !fraction) {
+            fraction = true;
+            continue;
+        } else if (!isDigit(*s)) {
+            break;
+        }
+        anyDigits = true;
+        if (mantissa != 0 || *s != '0') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t) (*s - '0');
+                digits++;
+            } else {
+                exact = false;
+            }
+        }
+        if (fraction)
+            exponent--;
+    }
+    if (!anyDigits)
+        return nullptr;
+
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        ++s;
+        bool negativeExponent = false;
+        if (s < end && (*s == '+' || *s == '-'))
+            negativeExponent = *s++ == '-';
+        if (s >= end || !isDigit(*s))
+            return nullptr;
+        int value = 0;
+        for (; s < end && isDigit(*s); ++s)
+            value = std::min(value * 10 + (*s - '0'), 100000);
+        exponent += negativeExponent ? -value : value;
+    }
+    if (s < end && !isSpace(*s))
+        return nullptr;
+
+    /* Fast path: the mantissa and the power of ten are exact doubles, so a
+       single division or multiplication rounds correctly. Rounding the
+       result once more to float is exact unless it lies on a midpoint */
+    if (exact && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        double result = exponent < 0 ? mantissa / powers[-exponent]
+                                     : mantissa * powers[exponent];
+        if (result == 0 || (result >= FLT_MIN && result <= FLT_MAX && !isFloatMidpoint(result))) {
+            value = negative ? -(float) result : (float) result;
+            return s;
+        }
+    }
+
+    /* Otherwise, let strtof do the rounding */
+    char buf[128];
+    size_t length = (size_t) (s - start);
+    if (length >= sizeof(buf))
+        return nullptr;
+    memcpy(buf, start, length);
+    buf[length] = '\0';
+    char *endPtr = nullptr;
+    value = strtof(buf, &endPtr);
+    if (endPtr != buf + length || std::abs(value) > FLT_MAX)
+        return nullptr; /* std::istream treats overflows as errors */
+    return s;
+}
+
+/**
+ * Parse a face vertex ("p", "p/uv", "p//n" or "p/uv/n") that is followed
+ * by whitespace or the end of the line. Returns the position after the
+ * vertex or \c nullptr if the caller should fall back to \ref OBJVertex.
+ */
+static const char *parseVertex(const char *s, const char *end, OBJVertex &vertex) {
+    uint32_t values[3];
+    bool present[3] = { false, false, false };
+    int count = 0;
+
+    while (true) {
+        uint32_t value = 0;
+        int digits = 0;
+        for (; s < end && isDigit(*s); ++s) {
+            if (++digits > 9)
+                return nullptr;
+            value = value * 10 + (uint32_t) (*s - '0');
+        }
+        values[count] = value;
+        present[count++] = digits > 0;
+        if (s < end && *s == '/' && count < 3) {
+            ++s;
+            continue;
+        }
+        break;
+    }
+    if ((s < end && !isSpace(*s)) || !present[0])
+        return nullptr;
+
+    vertex = OBJVertex();
+    vertex.p = values[0];
+    if (present[1])
+        vertex.uv = values[1];
+    if (present[2])
+        vertex.n = values[2];
+    return s;
+}
+
+/// Parse a line with std::istream (used when the scanner gives up)
+static void parseLineSlow(const std::string &line_str, const Transform &trafo, OBJChunk &chunk) {
+    std::istringstream line(line_str);
+
+    std::string prefix;
+    line >> prefix;
+
+    if (prefix == "v") {
+        Point3f p;
+        line >> p.x() >> p.y() >> p.z();
+        p = trafo * p;
+        chunk.bbox.expandBy(p);
+        chunk.positions.push_back(p);
+    } else if (prefix == "vt") {
+        Point2f tc;
+        line >> tc.x() >> tc.y();
+        chunk.texcoords.push_back(tc);
+    } else if (prefix == "vn") {
+        Normal3f n;
+        line >> n.x() >> n.y() >> n.z();
+        chunk.normals.push_back((trafo * n).normalized());
+    } else if (prefix == "f") {
+        std::string v1, v2, v3, v4;
+        line >> v1 >> v2 >> v3 >> v4;
+
+        chunk.vertices.push_back(OBJVertex(v1));
+        chunk.vertices.push_back(OBJVertex(v2));
+        chunk.vertices.push_back(OBJVertex(v3));
+
+        if (!v4.empty()) {
+            /* This is a quad, split into two triangles */
+            size_t size = chunk.vertices.size();
+            chunk.vertices.push_back(OBJVertex(v4));
+            chunk.vertices.push_back(chunk.vertices[size - 3]);
+            chunk.vertices.push_back(chunk.vertices[size - 1]);
+        }
+    }
+}
+
+/// Parse a line, returns \c false if the scanner gave up
+static bool parseLine(const char *s, const char *end, const Transform &trafo, OBJChunk &chunk) {
+    s = skipSpace(s, end);
+    const char *prefix = s;
+    while (s < end && !isSpace(*s))
+        ++s;
+    size_t prefixLength = (size_t) (s - prefix);
+
+    if (prefixLength == 1 && prefix[0] == 'v') {
+        Point3f p;
+        for (int i = 0; i < 3; ++i) {
+            if (!(s = parseFloat(skipSpace(s, end), end, p[i])))
+                return false;
+        }
+        p = trafo * p;
+        chunk.bbox.expandBy(p);
+        chunk.positions.push_back(p);
+    } else if (prefixLength == 2 && prefix[0] == 'v' && prefix[1] == 't') {
+        Point2f tc;
+        for (int i = 0; i < 2; ++i) {
+            if (!(s = parseFloat(skipSpace(s, end), end, tc[i])))
+                return false;
+        }
+        chunk.texcoords.push_back(tc);
+    } else if (prefixLength == 2 && prefix[0] == 'v' && prefix[1] == 'n') {
+        Normal3f n;
+        for (int i = 0; i < 3; ++i) {
+            if (!(s = parseFloat(skipSpace(s, end), end, n[i])))
+                return false;
+        }
+        chunk.normals.push_back((trafo * n).normalized());
+    } else if (prefixLength == 1 && prefix[0] == 'f') {
+        OBJVertex verts[4];
+        int nVertices = 0;
+        for (; nVertices < 4; ++nVertices) {
+            s = skipSpace(s, end);
+            if (s == end)
+                break;
+            if (!(s = parseVertex(s, end, verts[nVertices])))
+                return false;
+        }
+        if (nVertices < 3)
+            return false;
+
+        chunk.vertices.push_back(verts[0]);
+        chunk.vertices.push_back(verts[1]);
+        chunk.vertices.push_back(verts[2]);
+        if (nVertices == 4) {
+            /* This is a quad, split into two triangles */
+            chunk.vertices.push_back(verts[3]);
+            chunk.vertices.push_back(verts[0]);
+            chunk.vertices.push_back(verts[2]);
+        }
+    }
+    return true;
+}
+
+static void parseChunk(OBJChunk &chunk, const Transform &trafo) {
+    try {
+        const char *s = chunk.start;
+        while (s < chunk.end) {
+            const char *lineEnd = (const char *) memchr(s, '\n', (size_t) (chunk.end - s));
+            if (!lineEnd)
+                lineEnd = chunk.end;
+            if (!parseLine(s, lineEnd, trafo, chunk))
+                parseLineSlow(std::string(s, lineEnd), trafo, chunk);
+            s = lineEnd + 1;
+        }
+    } catch (const std::exception &e) {
+        chunk.failed = true;
+        chunk.error = e.what();
+    }
+}
+
+/// Concatenate one of the arrays of all chunks (and release them)
+template <typename T> static std::vector<T> concatenate(std::vector<OBJChunk> &chunks,
+        std::vector<T> OBJChunk::*member) {
+    std::vector<size_t> offsets(chunks.size() + 1, 0);
+    for (size_t i = 0; i < chunks.size(); ++i)
+        offsets[i + 1] = offsets[i] + (chunks[i].*member).size();
+
+    std::vector<T> result(offsets.back());
+    tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+        std::vector<T> &values = chunks[i].*member;
+        std::copy(values.begin(), values.end(), result.begin() + offsets[i]);
+        std::vector<T>().swap(values);
+    });
+    return result;
+}
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory mapped and split into ranges of lines that are
+ * parsed in parallel. The results are then merged, and the vertices
+ * are deduplicated in the order of their first use, which yields the
+ * same mesh as parsing the file sequentially.
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
+        TraceScope trace("load", "WavefrontOBJ");
+        trace.setDetail(filename.str());
 
-        std::ifstream is(filename.str());
-        if (is.fail())
+        std::unique_ptr<MemoryMappedFile> file;
+        try {
+            file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
             throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+        }
         Transform trafo = propList.getTransform("toWorld", Transform());
 
-        cout << "Loading \"" << filename << "\" .. ";
-        cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+        /* Split the file into chunks that end at line breaks */
+        const size_t chunkSize = 512 * 1024;
+        const char *data = (const char *) file->getData();
+        const char *dataEnd = data + file->getSize();
+        std::vector<OBJChunk> chunks;
+        for (const char *s = data; s < dataEnd; ) {
+            OBJChunk chunk;
+            chunk.start = s;
+            chunk.end = s + std::min(chunkSize, (size_t) (dataEnd - s));
+            if (chunk.end < dataEnd) {
+                const char *lineEnd = (const char *) memchr(chunk.end, '\n',
+                    (size_t) (dataEnd - chunk.end));
+                chunk.end = lineEnd ? lineEnd + 1 : dataEnd;
             }
+            s = chunk.end;
+            chunks.push_back(std::move(chunk));
         }
 
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            parseChunk(chunks[i], trafo);
+        });
+
+        /* Report the first error in the file */
+        for (const OBJChunk &chunk : chunks) {
+            if (chunk.failed)
+                throw NoriException("%s", chunk.error);
+            m_bbox.expandBy(chunk.bbox);
+        }
+
+        std::vector<Vector3f>  positions = concatenate(chunks, &OBJChunk::positions);
+        std::vector<Vector2f>  texcoords = concatenate(chunks, &OBJChunk::texcoords);
+        std::vector<Vector3f>  normals   = concatenate(chunks, &OBJChunk::normals);
+        std::vector<OBJVertex> faceVertices = concatenate(chunks, &OBJChunk::vertices);
+        chunks.clear();
+        file.reset();
+
+        std::vector<uint32_t> indices;
+        std::vector<OBJVertex> vertices;
+        deduplicate(faceVertices, indices, vertices);
+
         m_F.resize(3, indices.size()/3);
         memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
 
         m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+        resolve(vertices, &OBJVertex::p, positions, m_V);
 
         if (!normals.empty()) {
             m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+            resolve(vertices, &OBJVertex::n, normals, m_N);
         }
 
         if (!texcoords.empty()) {
             m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+            resolve(vertices, &OBJVertex::uv, texcoords, m_UV);
         }
 
         m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+        /* Print a single line, since meshes may be loaded in parallel */
+        cout << tfm::format("Loaded \"%s\" (V=%i, F=%i, took %s and %s)", filename,
+            m_V.cols(), m_F.cols(), timer.elapsedString(),
+            memString(m_F.size() * sizeof(uint32_t) +
+                      sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))) << endl;
     }
 
 protected:
-    /// Vertex indices used by the OBJ format
-    struct OBJVertex {
-        uint32_t p = (uint32_t) -1;
-        uint32_t n = (uint32_t) -1;
-        uint32_t uv = (uint32_t) -1;
+    /**
+     * \brief Convert the face vertices into an indexed vertex list
+     *
+     * Vertices are numbered in the order of their first occurrence. The
+     * face vertices are sorted to find the duplicates, and a prefix sum
+     * over the first occurrences yields the final numbering.
+     */
+    static void deduplicate(const std::vector<OBJVertex> &faceVertices,
+            std::vector<uint32_t> &indices, std::vector<OBJVertex> &vertices) {
+        struct VertexRef {
+            OBJVertex vertex;
+            uint32_t index;
+        };
+        uint32_t count = (uint32_t) faceVertices.size();
+        typedef tbb::blocked_range<uint32_t> Range;
 
-        inline OBJVertex() { }
+        std::vector<VertexRef> sorted(count);
+        tbb::parallel_for(Range(0, count), [&](const Range &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                sorted[i] = VertexRef { faceVertices[i], i };
+        });
+        tbb::parallel_sort(sorted.begin(), sorted.end(), [](const VertexRef &a, const VertexRef &b) {
+            return std::tie(a.vertex.p, a.vertex.uv, a.vertex.n, a.index) <
+                   std::tie(b.vertex.p, b.vertex.uv, b.vertex.n, b.index);
+        });
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        /* Find the first occurrence of every face vertex. Each run of equal
+           vertices is processed by the task that contains its beginning */
+        std::vector<uint32_t> first(count);
+        tbb::parallel_for(Range(0, count), [&](const Range &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                if (i > 0 && sorted[i].vertex == sorted[i - 1].vertex)
+                    continue;
+                for (uint32_t j = i; j < count && sorted[j].vertex == sorted[i].vertex; ++j)
+                    first[sorted[j].index] = sorted[i].index;
+            }
+        });
+        std::vector<VertexRef>().swap(sorted);
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+        /* Number the first occurrences (a blocked parallel prefix sum) */
+        const uint32_t blockSize = 65536;
+        uint32_t blockCount = (count + blockSize - 1) / blockSize;
+        std::vector<uint32_t> blockOffset(blockCount + 1, 0);
+        tbb::parallel_for(uint32_t(0), blockCount, [&](uint32_t block) {
+            uint32_t sum = 0;
+            for (uint32_t i = block * blockSize; i < std::min(count, (block + 1) * blockSize); ++i)
+                sum += first[i] == i ? 1 : 0;
+            blockOffset[block + 1] = sum;
+        });
+        for (uint32_t block = 0; block < blockCount; ++block)
+            blockOffset[block + 1] += blockOffset[block];
 
-            p = toUInt(tokens[0]);
+        std::vector<uint32_t> id(count);
+        vertices.resize(blockOffset[blockCount]);
+        tbb::parallel_for(uint32_t(0), blockCount, [&](uint32_t block) {
+            uint32_t next = blockOffset[block];
+            for (uint32_t i = block * blockSize; i < std::min(count, (block + 1) * blockSize); ++i) {
+                if (first[i] == i) {
+                    vertices[next] = faceVertices[i];
+                    id[i] = next++;
+                }
+            }
+        });
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+        indices.resize(count);
+        tbb::parallel_for(Range(0, count), [&](const Range &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i)
+                indices[i] = id[first[i]];
+        });
+    }
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
-        }
+    /**
+     * \brief Look up one attribute of all vertices. Invalid indices throw
+     * the same exception as a sequential lookup would for the first one
+     */
+    template <typename T, typename Matrix> static void resolve(
+            const std::vector<OBJVertex> &vertices, uint32_t OBJVertex::*member,
+            const std::vector<T> &values, Matrix &matrix) {
+        uint32_t count = (uint32_t) vertices.size();
+        std::atomic<uint32_t> invalid(count);
+        typedef tbb::blocked_range<uint32_t> Range;
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
-        }
-    };
+        tbb::parallel_for(Range(0, count), [&](const Range &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t index = vertices[i].*member - 1;
+                if (index < values.size()) {
+                    matrix.col(i) = values[index];
+                } else {
+                    uint32_t current = invalid;
+                    while (i < current && !invalid.compare_exchange_weak(current, i))
+                        ;
+                }
+            }
+        });
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
-        }
-    };
+        if (invalid < count)
+            values.at(vertices[invalid].*member - 1);
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -0,0 +1,229 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <filesystem/path.h>
+#include <unordered_map>
+#include <fstream>
+#include <memory>
+
+/* OBJ loader check: loads each given file with the "obj" plugin and with
+   the simple line-by-line istream parser that the plugin replaced, and
+   verifies that both produce exactly the same vertex positions, normals,
+   texture coordinates and triangles. Run it on all OBJ files of the
+   scenes directory after changing src/obj.cpp. These include quads,
+   "p//n" face vertices and CRLF line endings (quad-and-triangle.obj). */
+
+using namespace nori;
+
+/* Mesh data as produced by the reference parser */
+struct ReferenceMesh {
+    MatrixXf V, N, UV;
+    MatrixXu F;
+};
+
+/* Vertex indices used by the OBJ format */
+struct OBJVertex {
+    uint32_t p = (uint32_t) -1;
+    uint32_t n = (uint32_t) -1;
+    uint32_t uv = (uint32_t) -1;
+
+    OBJVertex() { }
+
+    OBJVertex(const std::string &string) {
+        std::vector<std::string> tokens = tokenize(string, "/", true);
+
+        if (tokens.size() < 1 || tokens.size() > 3)
+            throw NoriException("Invalid vertex data: \"%s\"", string);
+
+        p = toUInt(tokens[0]);
+
+        if (tokens.size() >= 2 && !tokens[1].empty())
+            uv = toUInt(tokens[1]);
+
+        if (tokens.size() >= 3 && !tokens[2].empty())
+            n = toUInt(tokens[2]);
+    }
+
+    bool operator==(const OBJVertex &v) const {
+        return v.p == p && v.n == n && v.uv == uv;
+    }
+};
+
+/* Hash function for OBJVertex */
+struct OBJVertexHash {
+    std::size_t operator()(const OBJVertex &v) const {
+        size_t hash = std::hash<uint32_t>()(v.p);
+        hash = hash * 37 + std::hash<uint32_t>()(v.uv);
+        hash = hash * 37 + std::hash<uint32_t>()(v.n);
+        return hash;
+    }
+};
+
+/* The original istream-based parser of the "obj" plugin */
+static ReferenceMesh readReference(const std::string &filename) {
+    std::ifstream is(filename);
+    if (is.fail())
+        throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+
+    std::vector<Vector3f> positions;
+    std::vector<Vector2f> texcoords;
+    std::vector<Vector3f> normals;
+    std::vector<uint32_t> indices;
+    std::vector<OBJVertex> vertices;
+    std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> vertexMap;
+
+    /* The plugin applies its (default: identity) 'toWorld' transformation
+       to every vertex, which among other things maps -0 to +0 */
+    Transform trafo;
+
+    std::string line_str;
+    while (std::getline(is, line_str)) {
+        std::istringstream line(line_str);
+
+        std::string prefix;
+        line >> prefix;
+
+        if (prefix == "v") {
+            Point3f p;
+            line >> p.x() >> p.y() >> p.z();
+            positions.push_back(trafo * p);
+        } else if (prefix == "vt") {
+            Point2f tc;
+            line >> tc.x() >> tc.y();
+            texcoords.push_back(tc);
+        } else if (prefix == "vn") {
+            Normal3f n;
+            line >> n.x() >> n.y() >> n.z();
+            normals.push_back((trafo * n).normalized());
+        } else if (prefix == "f") {
+            std::string v1, v2, v3, v4;
+            line >> v1 >> v2 >> v3 >> v4;
+            OBJVertex verts[6];
+            int nVertices = 3;
+
+            verts[0] = OBJVertex(v1);
+            verts[1] = OBJVertex(v2);
+            verts[2] = OBJVertex(v3);
+
+            if (!v4.empty()) {
+                /* This is a quad, split into two triangles */
+                verts[3] = OBJVertex(v4);
+                verts[4] = verts[0];
+                verts[5] = verts[2];
+                nVertices = 6;
+            }
+            /* Convert to an indexed vertex list */
+            for (int i = 0; i < nVertices; ++i) {
+                const OBJVertex &v = verts[i];
+                auto it = vertexMap.find(v);
+                if (it == vertexMap.end()) {
+                    vertexMap[v] = (uint32_t) vertices.size();
+                    indices.push_back((uint32_t) vertices.size());
+                    vertices.push_back(v);
+                } else {
+                    indices.push_back(it->second);
+                }
+            }
+        }
+    }
+
+    ReferenceMesh mesh;
+    mesh.F.resize(3, indices.size() / 3);
+    memcpy(mesh.F.data(), indices.data(), sizeof(uint32_t) * indices.size());
+
+    mesh.V.resize(3, vertices.size());
+    for (uint32_t i = 0; i < vertices.size(); ++i)
+        mesh.V.col(i) = positions.at(vertices[i].p - 1);
+
+    if (!normals.empty()) {
+        mesh.N.resize(3, vertices.size());
+        for (uint32_t i = 0; i < vertices.size(); ++i)
+            mesh.N.col(i) = normals.at(vertices[i].n - 1);
+    }
+
+    if (!texcoords.empty()) {
+        mesh.UV.resize(2, vertices.size());
+        for (uint32_t i = 0; i < vertices.size(); ++i)
+            mesh.UV.col(i) = texcoords.at(vertices[i].uv - 1);
+    }
+    return mesh;
+}
+
+/* Compare two matrices bit by bit, returns a description of the first difference */
+template <typename Matrix, typename View>
+static std::string compare(const char *name, const Matrix &expected, const View &actual) {
+    if (expected.rows() != actual.rows() || expected.cols() != actual.cols())
+        return tfm::format("%s has size %ix%i instead of %ix%i", name,
+            actual.rows(), actual.cols(), expected.rows(), expected.cols());
+    for (Eigen::Index j = 0; j < expected.cols(); ++j) {
+        for (Eigen::Index i = 0; i < expected.rows(); ++i) {
+            auto a = expected(i, j), b = actual(i, j);
+            if (memcmp(&a, &b, sizeof(a)) != 0)
+                return tfm::format("%s(%i, %i) is %s instead of %s", name, i, j, b, a);
+        }
+    }
+    return "";
+}
+
+/* Check a single file, returns true when both parsers agree */
+static bool check(const std::string &filename) {
+    ReferenceMesh expected = readReference(filename);
+
+    PropertyList propList;
+    propList.setString("filename", filename);
+    std::unique_ptr<NoriObject> object(NoriObjectFactory::createInstance("obj", propList));
+    const Mesh *mesh = static_cast<const Mesh *>(object.get());
+
+    std::string differences[] = {
+        compare("V", expected.V, mesh->getVertexPositions()),
+        compare("N", expected.N, mesh->getVertexNormals()),
+        compare("UV", expected.UV, mesh->getVertexTexCoords()),
+        compare("F", expected.F, mesh->getIndices())
+    };
+
+    bool success = true;
+    for (const std::string &difference : differences) {
+        if (!difference.empty()) {
+            cerr << "Mismatch in \"" << filename << "\": " << difference << endl;
+            success = false;
+        }
+    }
+    return success;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help") {
+        std::cout << "Syntax: " << argv[0] << " <mesh.obj> [mesh.obj ..]" << std::endl;
+        return argc == 2 ? 0 : -1;
+    }
+
+    int failures = 0;
+    for (int i = 1; i < argc; ++i) {
+        try {
+            if (!check(argv[i]))
+                failures++;
+        } catch (const std::exception &e) {
+            cerr << "Error while checking \"" << argv[i] << "\": " << e.what() << endl;
+            failures++;
+        }
+    }
+
+    cout << argc - 1 - failures << " of " << argc - 1 << " OBJ files match the reference parser." << endl;
+    return failures == 0 ? 0 : -1;
+}
@@ -28,6 +28,7 @@ void NoriObject::addChild(NoriObject *) {
 
 void NoriObject::activate() { /* Do nothing */ }
 void NoriObject::setParent(NoriObject *) { /* Do nothing */ }
+void NoriObject::prepareChild(NoriObject *) { /* Do nothing */ }
 
 std::map<std::string, NoriObjectFactory::Constructor> *NoriObjectFactory::m_constructors = nullptr;
 
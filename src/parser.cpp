@@ -18,14 +18,22 @@
 
 #include <nori/parser.h>
 #include <nori/proplist.h>
+#include <nori/trace.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/task_group.h>
+#include <chrono>
 #include <fstream>
+#include <future>
+#include <memory>
 #include <set>
 
 NORI_NAMESPACE_BEGIN
 
-NoriObject *loadFromXML(const std::string &filename) {
+NoriObject *loadFromXML(const std::string &filename, const PropertyList &sceneProperties) {
+    TraceScope trace("load", "loadFromXML");
+    trace.setDetail(filename);
+
     /* Load the XML file using 'pugi' (a tiny self-contained XML parser implemented in C++) */
     pugi::xml_document doc;
     pugi::xml_parse_result result = doc.load_file(filename.c_str());
@@ -67,6 +75,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EInstance             = NoriObject::EInstance,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -83,6 +92,9 @@ NoriObject *loadFromXML(const std::string &filename) {
         EScale,
         ELookAt,
 
+        /* Reference to an object declared earlier */
+        ERef,
+
         EInvalid
     };
 
@@ -99,6 +111,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["instance"]   = EInstance;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -112,6 +125,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["rotate"]     = ERotate;
     tags["scale"]      = EScale;
     tags["lookat"]     = ELookAt;
+    tags["ref"]        = ERef;
 
     /* Helper function to check if attributes are fully specified */
     auto check_attributes = [&](const pugi::xml_node &node, std::set<std::string> attrs) {
@@ -129,12 +143,77 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
-    /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    /* Meshes are constructed in parallel while the parser moves on, hence
+       objects are passed around as futures. An invalid future stands for
+       a node that does not create an object. */
+    typedef std::shared_future<NoriObject *> ObjectFuture;
+
+    /* Objects with an 'id' attribute, which can be passed to other objects using <ref> */
+    std::map<std::string, ObjectFuture> namedObjects;
+
+    /* Helper function to instantiate an object */
+    auto create = [](int tag, const std::string &type, const PropertyList &propList) -> NoriObject * {
+        NoriObject *result = NoriObjectFactory::createInstance(type, propList);
+
+        if (result->getClassType() != tag) {
+            throw NoriException(
+                "Unexpectedly constructed an object "
+                "of type <%s> (expected type <%s>): %s",
+                NoriObject::classTypeName(result->getClassType()),
+                NoriObject::classTypeName((NoriObject::EClassType) tag),
+                result->toString());
+        }
+        return result;
+    };
+
+    /* Helper function to add the children to an object and activate it */
+    auto finish = [](NoriObject *object, const std::vector<NoriObject *> &children) {
+        /* Add all children */
+        for (auto ch: children) {
+            object->addChild(ch);
+            ch->setParent(object);
+        }
+
+        /* Activate / configure the object */
+        object->activate();
+    };
+
+    /* Helper function to attach the location of a node to an error message */
+    auto locate = [&](const NoriException &e, ptrdiff_t position) {
+        return NoriException("Error while parsing \"%s\": %s (at %s)", filename,
+                             e.what(), offset(position));
+    };
+
+    /* Helper function to check whether a node declares or references an object */
+    auto isObject = [&](const pugi::xml_node &node) {
+        if (node.type() != pugi::node_element)
+            return false;
+        auto it = tags.find(node.name());
+        if (it == tags.end())
+            return false;
+        int tag = it->second;
+        return tag < NoriObject::EClassTypeCount || tag == ERef;
+    };
+
+    /* Pending mesh constructions. Declared after the helpers that they use,
+       since its destructor waits for the tasks when an error occurred */
+    tbb::task_group meshTasks;
+
+    /* Helper function to wait for an object. The current thread
+       helps with the pending mesh constructions in the meantime */
+    auto resolve = [&](const ObjectFuture &future) -> NoriObject * {
+        if (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            meshTasks.wait();
+        return future.get();
+    };
+
+    /* Helper function to parse a Nori XML node (recursive). 'parent' is the
+       object that was already created for the parent node (if any) */
+    std::function<ObjectFuture(pugi::xml_node &, PropertyList &, int, NoriObject *)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag, NoriObject *parent) -> ObjectFuture {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
-            return nullptr;
+            return ObjectFuture();
 
         if (node.type() != pugi::node_element)
             throw NoriException(
@@ -173,42 +252,86 @@ NoriObject *loadFromXML(const std::string &filename) {
         else if (tag == ETransform)
             transform.setIdentity();
 
+        /* Parse the properties first, the child objects are handled below */
         PropertyList propList;
-        std::vector<NoriObject *> children;
         for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
-            if (child)
-                children.push_back(child);
+            if (!isObject(ch))
+                parseTag(ch, propList, tag, nullptr);
         }
 
-        NoriObject *result = nullptr;
-        try {
-            if (currentIsObject) {
+        if (tag == EScene && !hasParent)
+            propList.merge(sceneProperties);
+
+        /* Objects other than meshes are instantiated before their child
+           objects are parsed, which lets them prepare the meshes that are
+           constructed in parallel (see NoriObject::prepareChild()) */
+        bool hasId = false;
+        std::string type;
+        NoriObject *object = nullptr;
+        if (currentIsObject) {
+            hasId = !node.attribute("id").empty();
+            if (hasId)
+                check_attributes(node, { "type", "id" });
+            else
                 check_attributes(node, { "type" });
 
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
-
-                if (result->getClassType() != (int) tag) {
-                    throw NoriException(
-                        "Unexpectedly constructed an object "
-                        "of type <%s> (expected type <%s>): %s",
-                        NoriObject::classTypeName(result->getClassType()),
-                        NoriObject::classTypeName((NoriObject::EClassType) tag),
-                        result->toString());
+            type = node.attribute("type").value();
+            if (tag != EMesh) {
+                try {
+                    object = create(tag, type, propList);
+                } catch (const NoriException &e) {
+                    throw locate(e, node.offset_debug());
                 }
+            }
+        }
+
+        std::vector<ObjectFuture> childFutures;
+        for (pugi::xml_node &ch: node.children()) {
+            if (!isObject(ch))
+                continue;
+            ObjectFuture child = parseTag(ch, propList, tag, object);
+            if (child.valid())
+                childFutures.push_back(child);
+        }
 
-                /* Add all children */
-                for (auto ch: children) {
-                    result->addChild(ch);
-                    ch->setParent(result);
+        /* Wait for the children. Errors of meshes that were constructed
+           in parallel already refer to the location of the mesh */
+        std::vector<NoriObject *> children;
+        for (const ObjectFuture &child : childFutures)
+            children.push_back(resolve(child));
+
+        ObjectFuture result;
+        try {
+            if (currentIsObject) {
+                if (tag == EMesh) {
+                    /* Meshes load their files while parsing continues */
+                    ptrdiff_t position = node.offset_debug();
+                    auto task = std::make_shared<std::packaged_task<NoriObject *()>>(
+                        [&create, &finish, &locate, tag, type, propList, children, parent, position]() {
+                            try {
+                                NoriObject *mesh = create(tag, type, propList);
+                                finish(mesh, children);
+                                if (parent)
+                                    parent->prepareChild(mesh);
+                                return mesh;
+                            } catch (const NoriException &e) {
+                                throw locate(e, position);
+                            }
+                        });
+                    result = task->get_future().share();
+                    meshTasks.run([task]() { (*task)(); });
+                } else {
+                    finish(object, children);
+                    std::promise<NoriObject *> promise;
+                    promise.set_value(object);
+                    result = promise.get_future().share();
                 }
 
-                /* Activate / configure the object */
-                result->activate();
+                if (hasId) {
+                    std::string id = node.attribute("id").value();
+                    if (!namedObjects.insert(std::make_pair(id, result)).second)
+                        throw NoriException("Duplicate object id \"%s\"", id);
+                }
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -317,19 +440,35 @@ NoriObject *loadFromXML(const std::string &filename) {
                         }
                         break;
 
+                    case ERef: {
+                            check_attributes(node, { "id" });
+                            /* Only instances share the referenced object
+                               instead of taking over its ownership */
+                            if (parentTag != EInstance)
+                                throw NoriException("<ref> can only be used within <instance> (found within <%s>)",
+                                    NoriObject::classTypeName((NoriObject::EClassType) parentTag));
+                            std::string id = node.attribute("id").value();
+                            auto it = namedObjects.find(id);
+                            if (it == namedObjects.end())
+                                throw NoriException("Reference to an unknown object id \"%s\"", id);
+                            result = it->second;
+                        }
+                        break;
+
                     default: throw NoriException("Unhandled element \"%s\"", node.name());
                 };
             }
         } catch (const NoriException &e) {
-            throw NoriException("Error while parsing \"%s\": %s (at %s)", filename,
-                                e.what(), offset(node.offset_debug()));
+            throw locate(e, node.offset_debug());
         }
 
         return result;
     };
 
     PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    NoriObject *root = resolve(parseTag(*doc.begin(), list, EInvalid, nullptr));
+    meshTasks.wait();
+    return root;
 }
 
 NORI_NAMESPACE_END
@@ -3,6 +3,7 @@
 #include <nori/integrator.h>
 #include <nori/sampler.h>
 #include <nori/scene.h>
+#include <nori/wavefront.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -27,42 +28,83 @@ public:
         if (!scene->rayIntersect(ray, its)) {
             return Color3f(0.f);
         }
-        else {
-            const BSDF* currBSDF = its.mesh->getBSDF();
-            if (currBSDF != nullptr) {
-                // create the emitter query record and sample a light source
-                // assuming just one light source for now.
-                EmitterQueryRecord eRec;
-                const Emitter* light = scene->getLights()[0];
-                if (light != nullptr) {
-                    // Sample the light source
-                    eRec.ref = its.p;
-                    Color3f Li = light->sample(eRec, sampler->next2D());
-
-                    // compute the bsdf contribution
-                    const Vector3f wo = its.shFrame.toLocal(-ray.d.normalized());
-                    const Vector3f wi = its.shFrame.toLocal(eRec.wi);
-                    BSDFQueryRecord bRec(wo, wi, ESolidAngle);
-                    const Color3f f = currBSDF->eval(bRec);
-
-                    // Compute visibility;
-                    Ray3f shadowRay(its.p, eRec.wi, Epsilon, (1.0f - Epsilon) * eRec.dist);
-                    const float vis = scene->rayIntersect(shadowRay) ? 0.f : 1.f;
-
-                    // compute other terms and the final color
-                    const float cosTheta = std::abs(Frame::cosTheta(wi));
-                    Color3f L = Li * f * cosTheta * vis;
-                    return L;
-                }
-            }
-        }
-        return 0.f;
+        return shade(scene, sampler, ray, its);
     }
 
     // Integrator function that uses ray differentials
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const RayDifferential& rayDifferential) const {
         return Li(scene, sampler, rayDifferential.getRay());
     }
+
+    // Integrator function for camera rays that were intersected as a packet
+    virtual Color3f Li(const Scene *scene, Sampler *sampler,
+            const RayDifferential& rayDifferential, const Intersection *its) const {
+        if (its == nullptr)
+            return Color3f(0.f);
+        return shade(scene, sampler, rayDifferential, *its);
+    }
+
+    virtual bool usesPrimaryIntersection() const { return true; }
+
+    // Wavefront version: the shadow ray is queued instead of traced
+    virtual bool shadeWavefront(const Scene *scene, Sampler *sampler, uint32_t pathIndex,
+            WavefrontPath &path, std::vector<WavefrontShadowRay> &shadowRays) const {
+        WavefrontShadowRay shadowRay;
+        if (path.hit && sampleDirect(scene, sampler, path.ray, path.its, shadowRay.ray, shadowRay.contribution)) {
+            shadowRay.contribution *= path.throughput;
+            shadowRay.path = pathIndex;
+            shadowRays.push_back(shadowRay);
+        }
+        // Direct illumination only: the path ends here
+        return false;
+    }
+
+    virtual bool supportsWavefront() const { return true; }
+
+private:
+    // Direct illumination at the first intersection along a ray
+    Color3f shade(const Scene *scene, Sampler *sampler, const Ray3f &ray, const Intersection &its) const {
+        Ray3f shadowRay;
+        Color3f L;
+        if (!sampleDirect(scene, sampler, ray, its, shadowRay, L))
+            return 0.f;
+
+        // Compute visibility;
+        const float vis = scene->rayIntersect(shadowRay) ? 0.f : 1.f;
+        return L * vis;
+    }
+
+    // Sample a light source and compute the unoccluded contribution
+    // along with the shadow ray that determines its visibility
+    bool sampleDirect(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+            const Intersection &its, Ray3f &shadowRay, Color3f &L) const {
+        const BSDF* currBSDF = its.mesh->getBSDF();
+        if (currBSDF != nullptr) {
+            // create the emitter query record and sample a light source
+            // assuming just one light source for now.
+            EmitterQueryRecord eRec;
+            const Emitter* light = scene->getLights()[0];
+            if (light != nullptr) {
+                // Sample the light source
+                eRec.ref = its.p;
+                Color3f Li = light->sample(eRec, sampler->next2D());
+
+                // compute the bsdf contribution
+                const Vector3f wo = its.shFrame.toLocal(-ray.d.normalized());
+                const Vector3f wi = its.shFrame.toLocal(eRec.wi);
+                BSDFQueryRecord bRec(wo, wi, ESolidAngle);
+                const Color3f f = currBSDF->eval(bRec);
+
+                shadowRay = Ray3f(its.p, eRec.wi, Epsilon, (1.0f - Epsilon) * eRec.dist);
+
+                // compute other terms and the final color
+                const float cosTheta = std::abs(Frame::cosTheta(wi));
+                L = Li * f * cosTheta;
+                return true;
+            }
+        }
+        return false;
+    }
 };
 
 NORI_REGISTER_CLASS(PathIntegrator, "path")
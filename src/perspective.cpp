@@ -171,6 +171,41 @@ public:
         return Color3f(1.0f);
     }
 
+    virtual void sampleRayPacket(RayDifferential *rays, RayPacket &packet,
+            Color3f *weights, const Point2f *samplePositions,
+            const Point2f *apertureSamples, int count) const {
+        /* Ray stencils are generated by the per-ray code path */
+        if (m_rayStencilQuality > 0) {
+            Camera::sampleRayPacket(rays, packet, weights,
+                samplePositions, apertureSamples, count);
+            return;
+        }
+
+        /* All rays of the pinhole camera share the same origin */
+        Point3f origin = m_cameraToWorld * Point3f(0, 0, 0);
+
+        packet.active = 0;
+        for (int i = 0; i < count; ++i) {
+            Point3f nearP = m_sampleToCamera * Point3f(
+                samplePositions[i].x() * m_invOutputSize.x(),
+                samplePositions[i].y() * m_invOutputSize.y(), 0.0f);
+
+            Vector3f d = nearP.normalized();
+            float invZ = 1.0f / d.z();
+
+            RayDifferential &ray = rays[i];
+            ray.o = origin;
+            ray.d = m_cameraToWorld * d;
+            ray.mint = m_nearClip * invZ;
+            ray.maxt = m_farClip * invZ;
+            ray.update();
+            ray.setQuality(m_rayStencilQuality);
+
+            weights[i] = Color3f(1.0f);
+            packet.setRay(i, ray);
+        }
+    }
+
 
     virtual void addChild(NoriObject *obj) {
         switch (obj->getClassType()) {
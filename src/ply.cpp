@@ -0,0 +1,384 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <nori/trace.h>
+#include <filesystem/resolver.h>
+#include <cstring>
+#include <sstream>
+
+NORI_NAMESPACE_BEGIN
+
+/// Scalar types of PLY properties
+enum EPLYType {
+    EPLYInt8 = 0, EPLYUInt8, EPLYInt16, EPLYUInt16,
+    EPLYInt32, EPLYUInt32, EPLYFloat32, EPLYFloat64, EPLYInvalid
+};
+
+/// Size of the PLY types in bytes
+static const size_t plyTypeSize[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static EPLYType plyType(const std::string &name) {
+    if (name == "char" || name == "int8") return EPLYInt8;
+    if (name == "uchar" || name == "uint8") return EPLYUInt8;
+    if (name == "short" || name == "int16") return EPLYInt16;
+    if (name == "ushort" || name == "uint16") return EPLYUInt16;
+    if (name == "int" || name == "int32") return EPLYInt32;
+    if (name == "uint" || name == "uint32") return EPLYUInt32;
+    if (name == "float" || name == "float32") return EPLYFloat32;
+    if (name == "double" || name == "float64") return EPLYFloat64;
+    return EPLYInvalid;
+}
+
+/// Property of a PLY element
+struct PLYProperty {
+    std::string name;
+    EPLYType type = EPLYInvalid;      ///< Type of the value (or of the list entries)
+    EPLYType countType = EPLYInvalid; ///< Type of the list length (\c EPLYInvalid: no list)
+};
+
+/// Element declared in the header of a PLY file
+struct PLYElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PLYProperty> properties;
+};
+
+/* Read a little endian value of the given type */
+template <typename T> static inline T plyRead(const uint8_t *p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+static inline double plyReadValue(const uint8_t *p, EPLYType type) {
+    switch (type) {
+        case EPLYInt8:    return (double) plyRead<int8_t>(p);
+        case EPLYUInt8:   return (double) plyRead<uint8_t>(p);
+        case EPLYInt16:   return (double) plyRead<int16_t>(p);
+        case EPLYUInt16:  return (double) plyRead<uint16_t>(p);
+        case EPLYInt32:   return (double) plyRead<int32_t>(p);
+        case EPLYUInt32:  return (double) plyRead<uint32_t>(p);
+        case EPLYFloat32: return (double) plyRead<float>(p);
+        default:          return plyRead<double>(p);
+    }
+}
+
+static inline float plyReadFloat(const uint8_t *p, EPLYType type) {
+    return type == EPLYFloat32 ? plyRead<float>(p) : (float) plyReadValue(p, type);
+}
+
+static inline int64_t plyReadInteger(const uint8_t *p, EPLYType type) {
+    switch (type) {
+        case EPLYUInt8:  return plyRead<uint8_t>(p);
+        case EPLYInt32:  return plyRead<int32_t>(p);
+        case EPLYUInt32: return plyRead<uint32_t>(p);
+        default:         return (int64_t) plyReadValue(p, type);
+    }
+}
+
+/**
+ * \brief Loader for binary little endian PLY triangle meshes
+ *
+ * Reads the vertex positions, normals and texture coordinates as well
+ * as triangle and quad faces in a single pass over the memory mapped
+ * file. Vertices are used as they are, since PLY files are already
+ * indexed. Quads are split like in \ref WavefrontOBJ.
+ */
+class PLYMesh : public Mesh {
+public:
+    PLYMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        TraceScope trace("load", "PLYMesh");
+        trace.setDetail(filename.str());
+
+        std::unique_ptr<MemoryMappedFile> file;
+        try {
+            file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
+            throw NoriException("Unable to open PLY file \"%s\"!", filename);
+        }
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        Timer timer;
+
+        const uint8_t *data = file->getData();
+        const uint8_t *end = data + file->getSize();
+        std::vector<PLYElement> elements;
+        const uint8_t *ptr = parseHeader(filename.str(), data, end, elements);
+
+        for (const PLYElement &element : elements) {
+            if (element.name == "vertex")
+                ptr = readVertices(filename.str(), element, ptr, end, trafo);
+            else if (element.name == "face")
+                ptr = readFaces(filename.str(), element, ptr, end, elements);
+            else
+                ptr = skipElement(filename.str(), element, ptr, end);
+        }
+
+        if (m_V.size() == 0)
+            throw NoriException("PLY file \"%s\" does not contain any vertex positions!", filename);
+
+        m_name = filename.str();
+        cout << tfm::format("Loaded \"%s\" (V=%i, F=%i, took %s and %s)", filename,
+            m_V.cols(), m_F.cols(), timer.elapsedString(),
+            memString(m_F.size() * sizeof(uint32_t) +
+                      sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))) << endl;
+    }
+
+protected:
+    /// Parse the header, returns a pointer to the first byte of the data
+    static const uint8_t *parseHeader(const std::string &filename, const uint8_t *ptr,
+            const uint8_t *end, std::vector<PLYElement> &elements) {
+        std::string line;
+        auto nextLine = [&]() {
+            const uint8_t *lineEnd = (const uint8_t *) memchr(ptr, '\n', (size_t) (end - ptr));
+            if (!lineEnd)
+                throw NoriException("PLY file \"%s\": unexpected end of the header!", filename);
+            line.assign((const char *) ptr, (const char *) lineEnd);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            ptr = lineEnd + 1;
+        };
+
+        nextLine();
+        if (line != "ply")
+            throw NoriException("\"%s\" is not a PLY file!", filename);
+
+        while (true) {
+            nextLine();
+            std::istringstream tokens(line);
+            std::string keyword;
+            tokens >> keyword;
+
+            if (keyword == "end_header") {
+                break;
+            } else if (keyword == "format") {
+                std::string format;
+                tokens >> format;
+                if (format != "binary_little_endian")
+                    throw NoriException("PLY file \"%s\" has the format \"%s\", only "
+                        "binary_little_endian is supported!", filename, format);
+            } else if (keyword == "element") {
+                PLYElement element;
+                if (!(tokens >> element.name >> element.count))
+                    throw NoriException("PLY file \"%s\": invalid element declaration \"%s\"!",
+                        filename, line);
+                elements.push_back(element);
+            } else if (keyword == "property") {
+                PLYProperty property;
+                std::string type, countType;
+                tokens >> type;
+                if (type == "list") {
+                    tokens >> countType >> type;
+                    property.countType = plyType(countType);
+                }
+                tokens >> property.name;
+                property.type = plyType(type);
+                if (elements.empty() || property.name.empty() || property.type == EPLYInvalid ||
+                    (!countType.empty() && property.countType == EPLYInvalid))
+                    throw NoriException("PLY file \"%s\": invalid property declaration \"%s\"!",
+                        filename, line);
+                elements.back().properties.push_back(property);
+            } else if (keyword != "comment" && keyword != "obj_info" && !keyword.empty()) {
+                throw NoriException("PLY file \"%s\": unknown header line \"%s\"!", filename, line);
+            }
+        }
+        return ptr;
+    }
+
+    /// Read the vertex positions, normals and texture coordinates
+    const uint8_t *readVertices(const std::string &filename, const PLYElement &element,
+            const uint8_t *ptr, const uint8_t *end, const Transform &trafo) {
+        /* Byte offsets of the attributes within a vertex (-1: not present) */
+        enum { EX = 0, EY, EZ, ENX, ENY, ENZ, EU, EV, EAttributeCount };
+        int offset[EAttributeCount];
+        EPLYType type[EAttributeCount];
+        for (int i = 0; i < EAttributeCount; ++i) {
+            offset[i] = -1;
+            type[i] = EPLYInvalid;
+        }
+
+        size_t stride = 0;
+        for (const PLYProperty &property : element.properties) {
+            if (property.countType != EPLYInvalid)
+                throw NoriException("PLY file \"%s\": list properties of vertices are not supported!",
+                    filename);
+            const std::string &n = property.name;
+            int attribute = -1;
+            if (n == "x") attribute = EX;
+            else if (n == "y") attribute = EY;
+            else if (n == "z") attribute = EZ;
+            else if (n == "nx") attribute = ENX;
+            else if (n == "ny") attribute = ENY;
+            else if (n == "nz") attribute = ENZ;
+            else if (n == "u" || n == "s" || n == "texture_u" || n == "texture_s") attribute = EU;
+            else if (n == "v" || n == "t" || n == "texture_v" || n == "texture_t") attribute = EV;
+            if (attribute >= 0) {
+                offset[attribute] = (int) stride;
+                type[attribute] = property.type;
+            }
+            stride += plyTypeSize[property.type];
+        }
+
+        if (offset[EX] < 0 || offset[EY] < 0 || offset[EZ] < 0)
+            throw NoriException("PLY file \"%s\": the vertices have no positions!", filename);
+        if ((size_t) (end - ptr) / std::max(stride, (size_t) 1) < element.count)
+            throw NoriException("PLY file \"%s\" is truncated!", filename);
+
+        bool hasNormals = offset[ENX] >= 0 && offset[ENY] >= 0 && offset[ENZ] >= 0;
+        bool hasTexCoords = offset[EU] >= 0 && offset[EV] >= 0;
+        uint32_t count = (uint32_t) element.count;
+
+        m_V.resize(3, count);
+        if (hasNormals)
+            m_N.resize(3, count);
+        if (hasTexCoords)
+            m_UV.resize(2, count);
+
+        for (uint32_t i = 0; i < count; ++i, ptr += stride) {
+            Point3f p(plyReadFloat(ptr + offset[EX], type[EX]),
+                      plyReadFloat(ptr + offset[EY], type[EY]),
+                      plyReadFloat(ptr + offset[EZ], type[EZ]));
+            p = trafo * p;
+            m_bbox.expandBy(p);
+            m_V.col(i) = p;
+
+            if (hasNormals) {
+                Normal3f n(plyReadFloat(ptr + offset[ENX], type[ENX]),
+                           plyReadFloat(ptr + offset[ENY], type[ENY]),
+                           plyReadFloat(ptr + offset[ENZ], type[ENZ]));
+                m_N.col(i) = (trafo * n).normalized();
+            }
+
+            if (hasTexCoords)
+                m_UV.col(i) = Point2f(plyReadFloat(ptr + offset[EU], type[EU]),
+                                      plyReadFloat(ptr + offset[EV], type[EV]));
+        }
+        return ptr;
+    }
+
+    /// Read the triangles and quads, and split the quads into two triangles
+    const uint8_t *readFaces(const std::string &filename, const PLYElement &element,
+            const uint8_t *ptr, const uint8_t *end, const std::vector<PLYElement> &elements) {
+        size_t vertexCount = 0;
+        for (const PLYElement &e : elements) {
+            if (e.name == "vertex")
+                vertexCount = e.count;
+        }
+
+        /* Resolve the layout of a face once: runs of scalar properties are
+           skipped as a whole, only the lists have to be decoded per face */
+        struct FaceList {
+            size_t skipBefore;      ///< Bytes of scalar properties in front of the list
+            EPLYType countType, type;
+            bool indices;           ///< Is this the list of vertex indices?
+        };
+        std::vector<FaceList> lists;
+        size_t skipBefore = 0;
+        bool hasIndices = false;
+        for (const PLYProperty &property : element.properties) {
+            if (property.countType == EPLYInvalid) {
+                skipBefore += plyTypeSize[property.type];
+                continue;
+            }
+            bool indices = !hasIndices &&
+                (property.name == "vertex_indices" || property.name == "vertex_index");
+            hasIndices |= indices;
+            lists.push_back({ skipBefore, property.countType, property.type, indices });
+            skipBefore = 0;
+        }
+        size_t skipAfter = skipBefore;
+        if (!hasIndices)
+            throw NoriException("PLY file \"%s\": the faces have no vertex indices!", filename);
+
+        /* Every face has at least one triangle, more columns are allocated for quads */
+        m_F.resize(3, element.count);
+        uint32_t triangleCount = 0;
+
+        for (size_t i = 0; i < element.count; ++i) {
+            for (const FaceList &list : lists) {
+                const uint8_t *count = skip(filename, ptr, end, list.skipBefore);
+                const uint8_t *items = skip(filename, count, end, plyTypeSize[list.countType]);
+                int64_t n = plyReadInteger(count, list.countType);
+                size_t itemSize = plyTypeSize[list.type];
+                ptr = skip(filename, items, end, (size_t) std::max(n, (int64_t) 0) * itemSize);
+
+                if (!list.indices)
+                    continue;
+                if (n != 3 && n != 4)
+                    throw NoriException("PLY file \"%s\": face %i has %i vertices, only "
+                        "triangles and quads are supported!", filename, i, n);
+
+                uint32_t v[4];
+                for (int j = 0; j < n; ++j, items += itemSize) {
+                    int64_t index = plyReadInteger(items, list.type);
+                    if (index < 0 || (size_t) index >= vertexCount)
+                        throw NoriException("PLY file \"%s\": face %i refers to the invalid "
+                            "vertex %i!", filename, i, index);
+                    v[j] = (uint32_t) index;
+                }
+
+                if (triangleCount + 2 > (uint32_t) m_F.cols())
+                    m_F.conservativeResize(3, std::max(2 * m_F.cols(), (Eigen::Index) triangleCount + 2));
+                m_F.col(triangleCount++) << v[0], v[1], v[2];
+                if (n == 4) {
+                    /* This is a quad, split into two triangles */
+                    m_F.col(triangleCount++) << v[3], v[0], v[2];
+                }
+            }
+            ptr = skip(filename, ptr, end, skipAfter);
+        }
+
+        if ((uint32_t) m_F.cols() != triangleCount)
+            m_F.conservativeResize(3, triangleCount);
+        return ptr;
+    }
+
+    /// Skip over an element that is not needed
+    static const uint8_t *skipElement(const std::string &filename, const PLYElement &element,
+            const uint8_t *ptr, const uint8_t *end) {
+        for (size_t i = 0; i < element.count; ++i) {
+            for (const PLYProperty &property : element.properties) {
+                if (property.countType == EPLYInvalid) {
+                    ptr = skip(filename, ptr, end, plyTypeSize[property.type]);
+                } else {
+                    const uint8_t *items = skip(filename, ptr, end, plyTypeSize[property.countType]);
+                    int64_t n = plyReadInteger(ptr, property.countType);
+                    ptr = skip(filename, items, end,
+                        (size_t) std::max(n, (int64_t) 0) * plyTypeSize[property.type]);
+                }
+            }
+        }
+        return ptr;
+    }
+
+    /// Advance by the given number of bytes, throws if the file ends before
+    static const uint8_t *skip(const std::string &filename, const uint8_t *ptr,
+            const uint8_t *end, size_t size) {
+        if ((size_t) (end - ptr) < size)
+            throw NoriException("PLY file \"%s\" is truncated!", filename);
+        return ptr + size;
+    }
+};
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
@@ -25,11 +25,15 @@
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
-#include <nori/gui.h>
+#include <nori/wavefront.h>
+#include <nori/stats.h>
+#include <nori/trace.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
+#include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
 #include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
 
 
 NORI_NAMESPACE_BEGIN
@@ -39,6 +43,8 @@ RenderThread::RenderThread(ImageBlock & block) :
 {
     m_render_status = 0;
     m_progress = 1.f;
+    m_render_failed = false;
+    m_rayCount = 0;
 }
 RenderThread::~RenderThread() {
     stopRendering();
@@ -62,6 +68,23 @@ void RenderThread::stopRendering() {
     }
 }
 
+bool RenderThread::waitUntilDone() {
+    if (m_render_thread.joinable())
+        m_render_thread.join();
+    m_render_status = 0;
+    return !m_render_failed;
+}
+
+void RenderThread::updateBlock() {
+    /* The film is only replaced by renderScene(), which requires the
+       previous rendering to be finished */
+    if (m_render_status != 1 && m_render_status != 2)
+        return;
+    m_block.lock();
+    m_film->snapshot(m_block);
+    m_block.unlock();
+}
+
 float RenderThread::getProgress() {
     if(isBusy()) {
         return m_progress;
@@ -69,15 +92,57 @@ float RenderThread::getProgress() {
     else return 1.f;
 }
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+/* Render a block by tracing the camera rays of 4x2 pixel groups as packets */
+static void renderBlockPackets(const Scene *scene, Sampler *sampler, ImageBlock &block) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
+    const int groupWidth = 4, groupHeight = RayPacket::Size / groupWidth;
 
     Point2i offset = block.getOffset();
     Vector2i size  = block.getSize();
 
-    /* Clear the block contents */
-    block.clear();
+    Point2f pixelSamples[RayPacket::Size], apertureSamples[RayPacket::Size];
+    RayDifferential rays[RayPacket::Size];
+    Color3f weights[RayPacket::Size];
+    Intersection its[RayPacket::Size];
+    RayPacket packet;
+
+    for (int y0 = 0; y0 < size.y(); y0 += groupHeight) {
+        for (int x0 = 0; x0 < size.x(); x0 += groupWidth) {
+            /* Create the samples of all group pixels inside the block */
+            int count = 0;
+            for (int y = y0; y < std::min(y0 + groupHeight, size.y()); ++y) {
+                for (int x = x0; x < std::min(x0 + groupWidth, size.x()); ++x) {
+                    pixelSamples[count] = Point2f((float)(x + offset.x()), (float)(y + offset.y())) + sampler->next2D();
+                    apertureSamples[count++] = sampler->next2D();
+                }
+            }
+
+            /* Sample the camera rays and find their first intersections */
+            camera->sampleRayPacket(rays, packet, weights, pixelSamples, apertureSamples, count);
+            uint32_t hits = scene->rayIntersect(packet, its);
+
+            /* Compute the incident radiance and store it in the image block */
+            for (int i = 0; i < count; ++i) {
+                const Intersection *primary = (hits & (1u << i)) ? &its[i] : nullptr;
+                Color3f value = weights[i] * integrator->Li(scene, sampler, rays[i], primary);
+                block.put(pixelSamples[i], value);
+            }
+        }
+    }
+}
+
+static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+    const Camera *camera = scene->getCamera();
+    const Integrator *integrator = scene->getIntegrator();
+
+    if (integrator->usesPrimaryIntersection()) {
+        renderBlockPackets(scene, sampler, block);
+        return;
+    }
+
+    Point2i offset = block.getOffset();
+    Vector2i size  = block.getSize();
 
     /* For each pixel and pixel sample sample */
     for (int y=0; y<size.y(); ++y) {
@@ -115,7 +180,7 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     }
 }
 
-void RenderThread::renderScene(const std::string & filename, bool singleThreaded) {
+bool RenderThread::renderScene(const std::string & filename, bool singleThreaded) {
 
     filesystem::path path(filename);
 
@@ -126,97 +191,229 @@ void RenderThread::renderScene(const std::string & filename, bool singleThreaded
 
     cout << "Single Threaded? : " << singleThreaded << std::endl;
 
-    NoriObject* root = loadFromXML(filename);
+    /* Record the phases of this run, they are written once it is done */
+    if (!m_traceName.empty())
+        Tracer::start();
+
+    /* Loading the meshes, building the BVH and preprocessing the scene
+       happen on this thread, so they need the configured scheduler too */
+    tbb::task_scheduler_init init(m_threadCount);
+
+    /* Scene properties that were overridden by the caller */
+    PropertyList sceneProperties;
+    if (!m_bvhBuilder.empty())
+        sceneProperties.setString("bvhBuilder", m_bvhBuilder);
+    if (m_bvhPerMesh)
+        sceneProperties.setBoolean("bvhPerMesh", true);
+
+    Timer loadTimer;
+    NoriObject* root = loadFromXML(filename, sceneProperties);
+    m_loadTime = loadTimer.elapsed();
+    m_buildTime = m_preprocessTime = m_renderTime = 0;
+    m_rayCount = 0;
 
     // When the XML root object is a scene, start rendering it ..
     if (root->getClassType() == NoriObject::EScene) {
         m_scene = static_cast<Scene *>(root);
+        m_buildTime = m_scene->getBuildTime();
+        m_loadTime = std::max(m_loadTime - m_buildTime, 0.0);
+
+        if (m_sampleCount > 0)
+            m_scene->getSampler()->setSampleCount(m_sampleCount);
 
         const Camera *camera_ = m_scene->getCamera();
-        m_scene->getIntegrator()->preprocess(m_scene);
+        {
+            TraceScope trace("render", "Integrator::preprocess");
+            Timer preprocessTimer;
+            m_scene->getIntegrator()->preprocess(m_scene);
+            m_preprocessTime = preprocessTimer.elapsed();
+        }
 
         /* Allocate memory for the entire output image and clear it */
+        m_block.lock();
         m_block.init(camera_->getOutputSize(), camera_->getReconstructionFilter());
         m_block.clear();
+        m_block.unlock();
+
+        /* The render workers accumulate into a separate lock-free film */
+        m_film.reset(new Film(camera_->getOutputSize(),
+            camera_->getReconstructionFilter(), NORI_BLOCK_SIZE));
 
         /* Determine the filename of the output bitmap */
-        std::string outputName = filename;
-        size_t lastdot = outputName.find_last_of(".");
-        if (lastdot != std::string::npos)
-            outputName.erase(lastdot, std::string::npos);
-        outputName += ".exr";
+        std::string outputName = m_outputName;
+        if (outputName.empty()) {
+            outputName = filename;
+            size_t lastdot = outputName.find_last_of(".");
+            if (lastdot != std::string::npos)
+                outputName.erase(lastdot, std::string::npos);
+            outputName += ".exr";
+        }
 
         /* Do the following in parallel and asynchronously */
         m_render_status = 1;
-        m_render_thread = std::thread([this,outputName, singleThreaded] {
-            const Camera *camera = m_scene->getCamera();
-            Vector2i outputSize = camera->getOutputSize();
-
-            /* Create a block generator (i.e. a work scheduler) */
-            BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
-
-            cout << "Rendering .. ";
-            cout.flush();
-            Timer timer;
-
-            auto numSamples = m_scene->getSampler()->getSampleCount();
-            auto numBlocks = blockGenerator.getBlockCount();
-
-            tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
-            samplers.resize(numBlocks);
-
-            for (uint32_t k = 0; k < numSamples ; ++k) {
-                m_progress = k/float(numSamples);
-                if(m_render_status == 2)
-                    break;
-
-                tbb::blocked_range<int> range(0, numBlocks);
-
-                auto map = [&](const tbb::blocked_range<int> &range) {
-                    // Allocate memory for a small image block to be rendered by the current thread
-                    ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                                     camera->getReconstructionFilter());
-
-                    for (int i = range.begin(); i < range.end(); ++i) {
-                        // Request an image block from the block generator
-                        blockGenerator.next(block);
+        m_render_failed = false;
+        int threadCount = m_threadCount;
+        uint32_t samplesPerPass = m_samplesPerPass;
+        std::string traceName = m_traceName;
+
+        /* Use the wavefront renderer if requested and supported */
+        bool wavefront = m_wavefront;
+        if (wavefront && !m_scene->getIntegrator()->supportsWavefront()) {
+            cerr << "Warning: the integrator does not support wavefront rendering, "
+                    "falling back to the default renderer" << endl;
+            wavefront = false;
+        }
 
-                        // Get block id to continue using the same sampler
-                        auto blockId = block.getBlockId();
-                        if(k == 0) { // Initialize the sampler for the first sample
-                            std::unique_ptr<Sampler> sampler(m_scene->getSampler()->clone());
-                            sampler->prepare(block);
-                            samplers.at(blockId) = std::move(sampler);
+        m_render_thread = std::thread([this, filename, outputName, traceName, singleThreaded, threadCount, samplesPerPass, wavefront] {
+            /* The scheduler is initialized per thread, so configure it again here */
+            tbb::task_scheduler_init init(threadCount);
+
+            try {
+                const Camera *camera = m_scene->getCamera();
+                Vector2i outputSize = camera->getOutputSize();
+
+                /* Create a block generator (i.e. a work scheduler) */
+                BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+
+                cout << "Rendering .. ";
+                cout.flush();
+                NORI_STATS(Statistics::reset());
+                Timer timer;
+
+                uint32_t numSamples = (uint32_t) m_scene->getSampler()->getSampleCount();
+                auto numBlocks = blockGenerator.getBlockCount();
+
+                /* Number of samples that a tile task renders before it is merged into
+                   the image. Every pass ends with a barrier, so batching many samples
+                   per task avoids idling while waiting for the slowest tile */
+                uint32_t batchSize = samplesPerPass == 0 ? numSamples
+                    : std::min(samplesPerPass, numSamples);
+                std::atomic<uint64_t> samplesDone(0);
+                uint64_t samplesTotal = (uint64_t) numSamples * numBlocks;
+
+                tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
+                samplers.resize(numBlocks);
+
+                /* Every worker keeps its wavefront renderer (and thereby the
+                   allocated ray queues) for all tiles and passes it renders */
+                tbb::enumerable_thread_specific< std::unique_ptr<WavefrontRenderer> > wavefrontRenderers;
+
+                for (uint32_t k = 0; k < numSamples ; k += batchSize) {
+                    if(m_render_status == 2)
+                        break;
+
+                    uint32_t passSamples = std::min(batchSize, numSamples - k);
+                    TraceScope passTrace("render", "Pass");
+
+                    /* Tiles are handed out one at a time, and idle workers steal
+                       the remaining ones from the TBB scheduler */
+                    tbb::blocked_range<int> range(0, numBlocks, 1);
+
+                    auto map = [&](const tbb::blocked_range<int> &range) {
+                        // Allocate memory for a small image block to be rendered by the current thread
+                        ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
+                                         camera->getReconstructionFilter());
+
+                        WavefrontRenderer *wavefrontRenderer = nullptr;
+                        if (wavefront) {
+                            std::unique_ptr<WavefrontRenderer> &local = wavefrontRenderers.local();
+                            if (!local)
+                                local.reset(new WavefrontRenderer(m_scene));
+                            wavefrontRenderer = local.get();
                         }
 
-                        // Render all contained pixels
-                        renderBlock(m_scene, samplers.at(blockId).get(), block);
+                        for (int i = range.begin(); i < range.end(); ++i) {
+                            NORI_STATS(double blockStart = Statistics::now());
+                            uint64_t blockRays = localRayCount();
+
+                            TraceScope blockTrace("render", "Block");
+
+                            // Request an image block from the block generator
+                            blockGenerator.next(block);
+
+                            // Get block id to continue using the same sampler
+                            auto blockId = block.getBlockId();
+                            if (blockTrace.isActive())
+                                blockTrace.setDetail(tfm::format("block %i, samples %i-%i",
+                                    blockId, k, k + passSamples - 1));
+                            if(k == 0) { // Initialize the sampler for the first sample
+                                std::unique_ptr<Sampler> sampler(m_scene->getSampler()->clone());
+                                sampler->prepare(block);
+                                samplers.at(blockId) = std::move(sampler);
+                            }
+
+                            // Render all contained pixels for the samples of this pass
+                            block.clear();
+                            if (wavefrontRenderer) {
+                                if (m_render_status != 2) {
+                                    wavefrontRenderer->render(samplers.at(blockId).get(), block, passSamples);
+                                    samplesDone += passSamples;
+                                    m_progress = (float) (samplesDone / (double) samplesTotal);
+                                }
+                            } else {
+                                for (uint32_t j = 0; j < passSamples; ++j) {
+                                    if (m_render_status == 2)
+                                        break;
+                                    renderBlock(m_scene, samplers.at(blockId).get(), block);
+                                    m_progress = (float) (++samplesDone / (double) samplesTotal);
+                                }
+                            }
+
+                            // The image block has been processed. Now add it to the film that represents the entire image
+                            m_film->put(block);
+                            m_rayCount += localRayCount() - blockRays;
+
+                            NORI_STATS(
+                                ThreadStatistics &stats = Statistics::local();
+                                stats.blocks++;
+                                stats.samples += (uint64_t) passSamples * block.getSize().prod();
+                                stats.busyTime += Statistics::now() - blockStart;
+                            )
+                        }
+                    };
 
-                        // The image block has been processed. Now add it to the "big" block that represents the entire image
-                        m_block.put(block);
-                    }
-                };
+                    /// Uncomment the following line for single threaded rendering
+                    if(singleThreaded)
+                        map(range);
 
-                /// Uncomment the following line for single threaded rendering
-                if(singleThreaded)
-                    map(range);
+                    /// Default: parallel rendering
+                    else tbb::parallel_for(range, map);
 
-                /// Default: parallel rendering
-                else tbb::parallel_for(range, map);
+                    /* No block is being rendered now, merge the overlapping borders */
+                    m_film->resolveBorders();
+                    blockGenerator.reset();
+                }
 
-                blockGenerator.reset();
+                m_renderTime = timer.elapsed();
+                cout << "done. (took " << timeString(m_renderTime) << ")" << endl;
+
+#if defined(NORI_STATISTICS)
+                /* Report the performance counters, and store them next to the image */
+                cout << Statistics::report(m_renderTime);
+                std::string statsName = outputName;
+                size_t lastdot = statsName.find_last_of(".");
+                if (lastdot != std::string::npos)
+                    statsName.erase(lastdot, std::string::npos);
+                Statistics::writeJSON(statsName + "_stats.json", filename, m_renderTime);
+#endif
+
+                /* Now turn the rendered image into
+                   a properly normalized bitmap */
+                std::unique_ptr<Bitmap> bitmap(m_film->toBitmap());
+                updateBlock();
+
+                /* Save using the OpenEXR format, or as a PNG if requested */
+                if (filesystem::path(outputName).extension() == "png")
+                    bitmap->saveToLDR(outputName);
+                else
+                    bitmap->save(outputName);
+            } catch (const std::exception &e) {
+                cerr << "Fatal error: " << e.what() << endl;
+                m_render_failed = true;
             }
 
-            cout << "done. (took " << timer.elapsedString() << ")" << endl;
-
-            /* Now turn the rendered image block into
-               a properly normalized bitmap */
-            m_block.lock();
-            std::unique_ptr<Bitmap> bitmap(m_block.toBitmap());
-            m_block.unlock();
-
-            /* Save using the OpenEXR format */
-            bitmap->save(outputName);
+            if (!traceName.empty())
+                Tracer::write(traceName);
 
             delete m_scene;
             m_scene = nullptr;
@@ -224,12 +421,13 @@ void RenderThread::renderScene(const std::string & filename, bool singleThreaded
             m_render_status = 3;
         });
 
+        return true;
     }
     else {
         delete root;
+        return false;
     }
 
 }
 
-
 NORI_NAMESPACE_END
\ No newline at end of file
@@ -0,0 +1,500 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <tbb/tbb.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Spatial split BVH (SBVH) builder
+ *
+ * In addition to partitioning the triangles of a node into two sets
+ * (object splits), this builder considers splitting the node with an
+ * axis-aligned plane (spatial splits). Triangles that straddle the plane
+ * are then referenced by both children, each with bounds that are chopped
+ * to its side of the plane. This reduces the node overlap caused by large
+ * or long and thin triangles at the cost of a slower build and duplicate
+ * triangle references. For details, refer to the paper
+ *
+ * "Spatial Splits in Bounding Volume Hierarchies"
+ * by Martin Stich, Heiko Friedrich, and Andreas Dietrich
+ * (Proc. High-Performance Graphics 2009)
+ *
+ * The builder writes the binary nodes in depth-first order and without
+ * gaps, hence the left child of a node directly follows it. Large subtrees
+ * are built in parallel into separate arrays, which are then appended.
+ */
+class SpatialSplitBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Number of bins used to find the best spatial split
+        SPATIAL_BINS = 32,
+
+        /// Maximum depth of the binary tree (limits the traversal stack size)
+        MAX_DEPTH = 64,
+
+        /// Leaves with more references than this are always split
+        MAX_LEAF_SIZE = 65536,
+
+        /// Heuristic cost value for traversal operations
+        TRAVERSAL_COST = 1,
+
+        /// Heuristic cost value for intersection operations
+        INTERSECTION_COST = 1,
+
+        /// Build the children of nodes with more references than this in parallel
+        PARALLEL_THRESHOLD = 4096
+    };
+
+    /**
+     * \brief Prepare the build
+     *
+     * \param splitBudget
+     *    Limits the number of triangle references created by spatial splits
+     *    to the given fraction of the triangle count (e.g. 0.5: 50% more)
+     */
+    SpatialSplitBuilder(BVH &bvh, float splitBudget) : m_bvh(bvh) {
+        uint32_t size = bvh.getTriangleCount();
+        m_budget = (int64_t) (std::max(splitBudget, 0.0f) * size);
+
+        /* Only attempt spatial splits where the children of the best object
+           split overlap noticeably (relative to the size of the scene) */
+        m_minOverlap = 1e-5f * bvh.m_bbox.getSurfaceArea();
+    }
+
+    /// Build the binary tree into \ref BVH::m_nodes and \ref BVH::m_indices
+    void build() {
+        uint32_t size = m_bvh.getTriangleCount();
+
+        std::vector<Reference> refs(size);
+        for (uint32_t i = 0; i < size; ++i) {
+            refs[i].index = i;
+            refs[i].bbox = m_bvh.getBoundingBox(i);
+        }
+
+        Subtree tree;
+        tree.nodes.reserve(2 * size);
+        tree.indices.reserve(size);
+
+        buildNode(tree, refs, m_bvh.m_bbox, 0, m_budget);
+
+        tree.nodes.shrink_to_fit();
+        tree.indices.shrink_to_fit();
+        m_bvh.m_nodes = std::move(tree.nodes);
+        m_bvh.m_indices = std::move(tree.indices);
+    }
+
+private:
+    /// Output of a subtree that is built by a single thread
+    struct Subtree {
+        std::vector<BVH::BVHNode> nodes; ///< Binary nodes in depth-first order
+        std::vector<uint32_t> indices;   ///< Triangle indices of the leaves
+        std::vector<float> rightAreas;   ///< Scratch space of the object split sweep
+    };
+
+    /// Triangle reference with (possibly chopped) bounds
+    struct Reference {
+        uint32_t index;
+        BoundingBox3f bbox;
+    };
+
+    /// Best object partitioning of a set of references
+    struct ObjectSplit {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        uint32_t leftCount = 0;
+        BoundingBox3f leftBounds, rightBounds;
+    };
+
+    /// Best spatial split plane of a node
+    struct SpatialSplit {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        float position = 0;
+    };
+
+    /// Bin used during the spatial split search
+    struct SpatialBin {
+        BoundingBox3f bbox;
+        uint32_t enter = 0, exit = 0;
+    };
+
+    /**
+     * \brief Create the subtree for the given references (which are consumed)
+     *
+     * \param budget
+     *    Number of duplicate references that spatial splits may create
+     *    within the subtree
+     *
+     * \return The part of the budget that the subtree did not use
+     */
+    int64_t buildNode(Subtree &tree, std::vector<Reference> &refs,
+            const BoundingBox3f &bounds, int depth, int64_t budget) {
+        uint32_t node_idx = (uint32_t) tree.nodes.size();
+        tree.nodes.emplace_back();
+        tree.nodes[node_idx].bbox = bounds;
+
+        uint32_t size = (uint32_t) refs.size();
+        float leafCost = (float) INTERSECTION_COST * size;
+        if (size <= 1 || depth >= MAX_DEPTH) {
+            createLeaf(tree, node_idx, refs);
+            return budget;
+        }
+
+        float invArea = 1.0f / bounds.getSurfaceArea();
+        ObjectSplit objectSplit = findObjectSplit(tree, refs, invArea);
+
+        /* Only look for a spatial split if the object split produces
+           overlapping children and the reference budget is not exhausted */
+        SpatialSplit spatialSplit;
+        BoundingBox3f overlap = objectSplit.leftBounds;
+        overlap.clip(objectSplit.rightBounds);
+        if (budget > 0 && overlap.isValid() &&
+            overlap.getSurfaceArea() > m_minOverlap)
+            spatialSplit = findSpatialSplit(refs, bounds, invArea);
+
+        float bestCost = std::min(objectSplit.cost, spatialSplit.cost);
+        if (bestCost >= leafCost && size <= (uint32_t) MAX_LEAF_SIZE) {
+            createLeaf(tree, node_idx, refs);
+            return budget;
+        }
+
+        std::vector<Reference> left, right;
+        BoundingBox3f leftBounds, rightBounds;
+        int axis;
+
+        if (spatialSplit.cost < objectSplit.cost &&
+            performSpatialSplit(refs, spatialSplit, left, right, leftBounds, rightBounds, budget)) {
+            axis = spatialSplit.axis;
+        } else {
+            axis = objectSplit.axis;
+            leftBounds = objectSplit.leftBounds;
+            rightBounds = objectSplit.rightBounds;
+            left.assign(refs.begin(), refs.begin() + objectSplit.leftCount);
+            right.assign(refs.begin() + objectSplit.leftCount, refs.end());
+        }
+
+        /* Release the memory of this level before recursing */
+        std::vector<Reference>().swap(refs);
+
+        /* Each child gets a share of the remaining budget in proportion to its
+           number of references, which keeps the tree independent of the order
+           in which the subtrees are built */
+        int64_t leftBudget = (int64_t) ((double) budget * left.size() / (left.size() + right.size()));
+        int64_t rightBudget = budget - leftBudget;
+
+        uint32_t rightChild;
+        if (size > PARALLEL_THRESHOLD) {
+            Subtree leftTree, rightTree;
+            tbb::parallel_invoke(
+                [&] { leftBudget = buildNode(leftTree, left, leftBounds, depth + 1, leftBudget); },
+                [&] { rightBudget = buildNode(rightTree, right, rightBounds, depth + 1, rightBudget); }
+            );
+            append(tree, leftTree);
+            rightChild = (uint32_t) tree.nodes.size();
+            append(tree, rightTree);
+            budget = leftBudget + rightBudget;
+        } else {
+            /* The right child may also use what is left over on the left side */
+            leftBudget = buildNode(tree, left, leftBounds, depth + 1, leftBudget);
+            rightChild = (uint32_t) tree.nodes.size();
+            budget = buildNode(tree, right, rightBounds, depth + 1, rightBudget + leftBudget);
+        }
+
+        BVH::BVHNode &node = tree.nodes[node_idx];
+        node.inner.rightChild = rightChild;
+        node.inner.axis = axis;
+        node.inner.flag = 0;
+        return budget;
+    }
+
+    /// Turn the node into a leaf referencing the given triangles
+    static void createLeaf(Subtree &tree, uint32_t node_idx, const std::vector<Reference> &refs) {
+        BVH::BVHNode &node = tree.nodes[node_idx];
+        node.leaf.flag = 1;
+        node.leaf.size = (uint32_t) refs.size();
+        node.leaf.start = (uint32_t) tree.indices.size();
+        for (const Reference &ref : refs)
+            tree.indices.push_back(ref.index);
+    }
+
+    /// Append a separately built subtree, adjusting its node and index references
+    static void append(Subtree &tree, const Subtree &subtree) {
+        uint32_t nodeOffset = (uint32_t) tree.nodes.size(),
+                 indexOffset = (uint32_t) tree.indices.size();
+        for (BVH::BVHNode node : subtree.nodes) {
+            if (node.isLeaf())
+                node.leaf.start += indexOffset;
+            else
+                node.inner.rightChild += nodeOffset;
+            tree.nodes.push_back(node);
+        }
+        tree.indices.insert(tree.indices.end(), subtree.indices.begin(), subtree.indices.end());
+    }
+
+    /**
+     * \brief Find the best object split using a full SAH sweep over the
+     * reference centroids along each axis. On return, \c refs is sorted
+     * along the axis of the best split.
+     */
+    ObjectSplit findObjectSplit(Subtree &tree, std::vector<Reference> &refs, float invArea) {
+        ObjectSplit best;
+        uint32_t size = (uint32_t) refs.size();
+        std::vector<float> &rightAreas = tree.rightAreas;
+        rightAreas.resize(size);
+
+        for (int axis = 0; axis < 3; ++axis) {
+            sortReferences(refs, axis);
+
+            BoundingBox3f bbox;
+            for (uint32_t i = size - 1; i > 0; --i) {
+                bbox.expandBy(refs[i].bbox);
+                rightAreas[i] = bbox.getSurfaceArea();
+            }
+
+            bbox.reset();
+            for (uint32_t i = 1; i < size; ++i) {
+                bbox.expandBy(refs[i - 1].bbox);
+                float cost = 2.0f * TRAVERSAL_COST + INTERSECTION_COST * invArea *
+                    (i * bbox.getSurfaceArea() + (size - i) * rightAreas[i]);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.leftCount = i;
+                }
+            }
+        }
+
+        sortReferences(refs, best.axis);
+        for (uint32_t i = 0; i < size; ++i)
+            (i < best.leftCount ? best.leftBounds : best.rightBounds).expandBy(refs[i].bbox);
+
+        return best;
+    }
+
+    /// Sort the references by their centroids (ties are broken by index)
+    static void sortReferences(std::vector<Reference> &refs, int axis) {
+        std::sort(refs.begin(), refs.end(),
+            [axis](const Reference &r1, const Reference &r2) {
+                float c1 = r1.bbox.min[axis] + r1.bbox.max[axis],
+                      c2 = r2.bbox.min[axis] + r2.bbox.max[axis];
+                return c1 < c2 || (c1 == c2 && r1.index < r2.index);
+            }
+        );
+    }
+
+    /// Find the best spatial split plane by chopping the references into bins
+    SpatialSplit findSpatialSplit(const std::vector<Reference> &refs,
+            const BoundingBox3f &bounds, float invArea) const {
+        SpatialSplit best;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            float origin = bounds.min[axis];
+            float binSize = (bounds.max[axis] - origin) / SPATIAL_BINS;
+            if (!(binSize > 0))
+                continue;
+            float invBinSize = 1.0f / binSize;
+
+            SpatialBin bins[SPATIAL_BINS];
+            for (const Reference &ref : refs) {
+                int firstBin = clampBin((int) ((ref.bbox.min[axis] - origin) * invBinSize));
+                int lastBin = std::max(firstBin,
+                    clampBin((int) ((ref.bbox.max[axis] - origin) * invBinSize)));
+
+                /* Chop the reference into the bins it overlaps */
+                Reference current = ref;
+                for (int i = firstBin; i < lastBin; ++i) {
+                    Reference leftRef, rightRef;
+                    splitReference(current, axis, origin + binSize * (i + 1), leftRef, rightRef);
+                    bins[i].bbox.expandBy(leftRef.bbox);
+                    current = rightRef;
+                }
+                bins[lastBin].bbox.expandBy(current.bbox);
+                bins[firstBin].enter++;
+                bins[lastBin].exit++;
+            }
+
+            /* Sweep over the planes between the bins */
+            float rightAreas[SPATIAL_BINS];
+            uint32_t rightCounts[SPATIAL_BINS];
+            BoundingBox3f bbox;
+            uint32_t count = 0;
+            for (int i = SPATIAL_BINS - 1; i > 0; --i) {
+                bbox.expandBy(bins[i].bbox);
+                count += bins[i].exit;
+                rightAreas[i] = bbox.getSurfaceArea();
+                rightCounts[i] = count;
+            }
+
+            bbox.reset();
+            count = 0;
+            for (int i = 1; i < SPATIAL_BINS; ++i) {
+                bbox.expandBy(bins[i - 1].bbox);
+                count += bins[i - 1].enter;
+                if (count == 0 || rightCounts[i] == 0)
+                    continue;
+                float cost = 2.0f * TRAVERSAL_COST + INTERSECTION_COST * invArea *
+                    (count * bbox.getSurfaceArea() + rightCounts[i] * rightAreas[i]);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.position = origin + binSize * i;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    static int clampBin(int bin) {
+        return std::min(std::max(bin, 0), (int) SPATIAL_BINS - 1);
+    }
+
+    /**
+     * \brief Distribute the references to the two sides of a spatial split
+     *
+     * Straddling references are either duplicated or, if this is cheaper
+     * in terms of the SAH, moved entirely to one side ("reference
+     * unsplitting"). Returns \c false if one of the sides would be empty,
+     * otherwise the duplicates are subtracted from \c budget.
+     */
+    bool performSpatialSplit(const std::vector<Reference> &refs, const SpatialSplit &split,
+            std::vector<Reference> &left, std::vector<Reference> &right,
+            BoundingBox3f &leftBounds, BoundingBox3f &rightBounds, int64_t &budget) {
+        int axis = split.axis;
+        float position = split.position;
+
+        std::vector<const Reference *> straddling;
+        leftBounds.reset();
+        rightBounds.reset();
+        for (const Reference &ref : refs) {
+            if (ref.bbox.max[axis] <= position) {
+                left.push_back(ref);
+                leftBounds.expandBy(ref.bbox);
+            } else if (ref.bbox.min[axis] >= position) {
+                right.push_back(ref);
+                rightBounds.expandBy(ref.bbox);
+            } else {
+                straddling.push_back(&ref);
+            }
+        }
+
+        size_t duplicates = 0;
+        for (const Reference *ref : straddling) {
+            Reference leftRef, rightRef;
+            splitReference(*ref, axis, position, leftRef, rightRef);
+
+            /* A degenerate part means that the triangle lies on one side */
+            if (!leftRef.bbox.isValid()) {
+                right.push_back(*ref);
+                rightBounds.expandBy(ref->bbox);
+                continue;
+            } else if (!rightRef.bbox.isValid()) {
+                left.push_back(*ref);
+                leftBounds.expandBy(ref->bbox);
+                continue;
+            }
+
+            float leftCount = (float) left.size(), rightCount = (float) right.size();
+            float duplicateCost =
+                BoundingBox3f::merge(leftBounds, leftRef.bbox).getSurfaceArea() * (leftCount + 1) +
+                BoundingBox3f::merge(rightBounds, rightRef.bbox).getSurfaceArea() * (rightCount + 1);
+            float unsplitLeftCost =
+                BoundingBox3f::merge(leftBounds, ref->bbox).getSurfaceArea() * (leftCount + 1) +
+                rightBounds.getSurfaceArea() * rightCount;
+            float unsplitRightCost =
+                leftBounds.getSurfaceArea() * leftCount +
+                BoundingBox3f::merge(rightBounds, ref->bbox).getSurfaceArea() * (rightCount + 1);
+
+            if (unsplitLeftCost < duplicateCost && unsplitLeftCost <= unsplitRightCost) {
+                left.push_back(*ref);
+                leftBounds.expandBy(ref->bbox);
+            } else if (unsplitRightCost < duplicateCost) {
+                right.push_back(*ref);
+                rightBounds.expandBy(ref->bbox);
+            } else {
+                left.push_back(leftRef);
+                leftBounds.expandBy(leftRef.bbox);
+                right.push_back(rightRef);
+                rightBounds.expandBy(rightRef.bbox);
+                duplicates++;
+            }
+        }
+
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+            return false;
+        }
+
+        budget = std::max(budget - (int64_t) duplicates, (int64_t) 0);
+        return true;
+    }
+
+    /// Split a reference with an axis-aligned plane, clipping the triangle itself
+    void splitReference(const Reference &ref, int axis, float position,
+            Reference &left, Reference &right) const {
+        uint32_t idx = ref.index;
+        const Mesh *mesh = m_bvh.m_meshes[m_bvh.findMesh(idx)];
+        MatrixXfView V = mesh->getVertexPositions();
+        MatrixXuView F = mesh->getIndices();
+
+        left.index = right.index = ref.index;
+        left.bbox.reset();
+        right.bbox.reset();
+
+        /* Walk along the triangle edges and add the vertices
+           and plane intersections to the respective sides */
+        Point3f v1 = V.col(F(2, idx));
+        for (int i = 0; i < 3; ++i) {
+            Point3f v0 = v1;
+            v1 = V.col(F(i, idx));
+            float p0 = v0[axis], p1 = v1[axis];
+
+            if (p0 <= position)
+                left.bbox.expandBy(v0);
+            if (p0 >= position)
+                right.bbox.expandBy(v0);
+
+            if ((p0 < position && p1 > position) || (p0 > position && p1 < position)) {
+                float t = clamp((position - p0) / (p1 - p0), 0.0f, 1.0f);
+                Point3f p = (1 - t) * v0 + t * v1;
+                left.bbox.expandBy(p);
+                right.bbox.expandBy(p);
+            }
+        }
+
+        /* Intersect with the bounds of the original reference */
+        left.bbox.max[axis] = position;
+        right.bbox.min[axis] = position;
+        left.bbox.clip(ref.bbox);
+        right.bbox.clip(ref.bbox);
+    }
+
+    BVH &m_bvh;
+    int64_t m_budget; ///< Duplicate references of the whole tree
+    float m_minOverlap;
+};
+
+void BVH::buildSpatialSplits() {
+    SpatialSplitBuilder(*this, m_splitBudget).build();
+}
+
+NORI_NAMESPACE_END
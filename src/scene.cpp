@@ -22,24 +22,133 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
+Scene::Scene(const PropertyList &propList) {
     m_bvh = new BVH();
+
+    /* BVH construction algorithm: "sah" (default), "sbvh", or the
+       faster but lower quality "lbvh" and "hlbvh" */
+    std::string bvhBuilder = propList.getString("bvhBuilder", "sah");
+    if (bvhBuilder == "sbvh")
+        m_bvh->setBuildMethod(BVH::ESBVH);
+    else if (bvhBuilder == "lbvh")
+        m_bvh->setBuildMethod(BVH::ELBVH);
+    else if (bvhBuilder == "hlbvh")
+        m_bvh->setBuildMethod(BVH::EHLBVH);
+    else if (bvhBuilder != "sah")
+        throw NoriException("Scene: unknown BVH builder \"%s\"!", bvhBuilder);
+
+    /* Extra triangle references that the SBVH builder may create, relative
+       to the triangle count. Default: 0.5 (i.e. up to 50% more) */
+    m_bvh->setSplitBudget(propList.getFloat("bvhSplitBudget", 0.5f));
+
+    /* Number of bins per axis used by the SAH builder. Default: 16 */
+    m_bvh->setBinCount((uint32_t) propList.getInteger("bvhBins", 16));
+
+    /* Relative SAH cost increase after which a refit turns into a full
+       rebuild (for animated geometry). Default: 1.5 */
+    m_bvh->setRebuildThreshold(propList.getFloat("bvhRebuildThreshold", 1.5f));
+
+    /* Optional directory for caching the BVH across runs. Default: none */
+    std::string bvhCache = propList.getString("bvhCache", "");
+    if (!bvhCache.empty())
+        m_bvh->setCacheDirectory(getFileResolver()->resolve(bvhCache).str());
+
+    /* Build a separate BVH for every mesh as soon as it has been loaded,
+       and a top-level BVH over these at activation. This hides most of
+       the construction time behind the loading of the remaining files,
+       at the price of a somewhat lower quality hierarchy. Default: false */
+    m_bvhPerMesh = propList.getBoolean("bvhPerMesh", false);
     m_primitiveIds = -1;
     m_objectIds = -1;
 }
 
 Scene::~Scene() {
     delete m_bvh;
+    for (BVH *bvh : m_bottomLevel)
+        delete bvh;
+    for (auto &entry : m_meshBVHs)
+        delete entry.second;
+    for (Instance *instance : m_instances)
+        delete instance;
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
 }
 
 void Scene::activate() {
+    Timer timer;
+    if (m_instances.empty() && !m_bvhPerMesh) {
+        for (Mesh *mesh : m_meshes)
+            m_bvh->addMesh(mesh);
+    } else {
+        /* Two-level hierarchy: every mesh that is referenced by instances gets
+           a bottom-level BVH, which is shared by all of its instances. The
+           other meshes are combined into one more bottom-level BVH (or get
+           one each in the 'bvhPerMesh' mode), and the scene's BVH is built
+           over the instances of these */
+        std::vector<BVH *> pending;
+        auto createBVH = [&]() {
+            BVH *bvh = new BVH();
+            bvh->copyParameters(*m_bvh);
+            m_bottomLevel.push_back(bvh);
+            pending.push_back(bvh);
+            return bvh;
+        };
+
+        /* Return the BVH of a single mesh, which prepareChild() may already have built */
+        auto meshBVH = [&](Mesh *mesh) {
+            auto it = m_meshBVHs.find(mesh);
+            if (it == m_meshBVHs.end()) {
+                BVH *bvh = createBVH();
+                bvh->addMesh(mesh);
+                return bvh;
+            }
+            BVH *bvh = it->second;
+            m_meshBVHs.erase(it);
+            m_bottomLevel.push_back(bvh);
+            return bvh;
+        };
+
+        std::map<const Mesh *, BVH *> shared;
+        for (Instance *instance : m_instances) {
+            Mesh *mesh = instance->getMesh();
+            if (shared.find(mesh) != shared.end())
+                continue;
+            if (mesh->isEmitter())
+                throw NoriException("Scene: the instanced mesh \"%s\" cannot be an emitter!",
+                    mesh->getName());
+            shared[mesh] = meshBVH(mesh);
+        }
+
+        std::vector<BVH *> placed;
+        for (Mesh *mesh : m_meshes) {
+            if (shared.find(mesh) != shared.end())
+                continue;
+            if (m_bvhPerMesh) {
+                placed.push_back(meshBVH(mesh));
+            } else {
+                if (placed.empty())
+                    placed.push_back(createBVH());
+                placed[0]->addMesh(mesh);
+            }
+        }
+
+        for (BVH *bvh : pending)
+            bvh->build();
+
+        for (BVH *bvh : placed)
+            m_bvh->addInstance(bvh, Transform());
+        for (Instance *instance : m_instances)
+            m_bvh->addInstance(shared[instance->getMesh()], instance->getTransform());
+    }
     m_bvh->build();
+    m_buildTime = timer.elapsed();
 
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
@@ -62,7 +171,6 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_bvh->addMesh(mesh);
                 m_meshes.push_back(mesh);
                 if(mesh->isEmitter())
                     m_emitters.push_back(mesh->getEmitter());
@@ -73,6 +181,10 @@ void Scene::addChild(NoriObject *obj) {
             m_emitters.push_back(static_cast<Emitter *>(obj));
             break;
 
+        case EInstance:
+            m_instances.push_back(static_cast<Instance *>(obj));
+            break;
+
         case ESampler:
             if (m_sampler)
                 throw NoriException("There can only be one sampler per scene!");
@@ -97,6 +209,20 @@ void Scene::addChild(NoriObject *obj) {
     }
 }
 
+void Scene::prepareChild(NoriObject *obj) {
+    if (!m_bvhPerMesh || obj->getClassType() != EMesh)
+        return;
+
+    /* Runs on the thread that loaded the mesh */
+    BVH *bvh = new BVH();
+    bvh->copyParameters(*m_bvh);
+    bvh->addMesh(static_cast<Mesh *>(obj));
+    bvh->build();
+
+    std::lock_guard<std::mutex> lock(m_meshBVHMutex);
+    m_meshBVHs[static_cast<Mesh *>(obj)] = bvh;
+}
+
 std::string Scene::toString() const {
     std::string meshes;
     for (size_t i=0; i<m_meshes.size(); ++i) {
@@ -121,6 +247,7 @@ std::string Scene::toString() const {
         "  camera = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
+        "  instances = %i,\n"
         "  emitters = {\n"
         "  %s  }\n"
         "]",
@@ -128,6 +255,7 @@ std::string Scene::toString() const {
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
         indent(meshes, 2),
+        m_instances.size(),
         indent(lights,2)
     );
 }
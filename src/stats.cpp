@@ -0,0 +1,165 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/stats.h>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+void ThreadStatistics::add(const ThreadStatistics &other) {
+    rays += other.rays;
+    shadowRays += other.shadowRays;
+    packets += other.packets;
+    packetRays += other.packetRays;
+    nodeVisits += other.nodeVisits;
+    triangleTests += other.triangleTests;
+    samples += other.samples;
+    blocks += other.blocks;
+    busyTime += other.busyTime;
+}
+
+/* Records of all threads that ever updated a counter. They are never
+   released, so that the counts of finished threads are kept as well */
+static std::mutex &registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::vector<std::unique_ptr<ThreadStatistics>> &registry() {
+    static std::vector<std::unique_ptr<ThreadStatistics>> records;
+    return records;
+}
+
+ThreadStatistics &Statistics::local() {
+    thread_local ThreadStatistics *stats = nullptr;
+    if (!stats) {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        registry().emplace_back(new ThreadStatistics());
+        stats = registry().back().get();
+    }
+    return *stats;
+}
+
+void Statistics::reset() {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    for (auto &stats : registry())
+        *stats = ThreadStatistics();
+}
+
+std::vector<ThreadStatistics> Statistics::getThreads() {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    std::vector<ThreadStatistics> result;
+    for (auto &stats : registry()) {
+        if (stats->rays + stats->shadowRays + stats->samples > 0)
+            result.push_back(*stats);
+    }
+    return result;
+}
+
+double Statistics::now() {
+    auto time = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double, std::milli>(time).count();
+}
+
+/* Quantities that are derived from the summed up counters */
+struct StatisticsSummary {
+    ThreadStatistics total;
+    uint64_t rays = 0;
+    double mraysPerSecond = 0, nodeVisitsPerRay = 0, triangleTestsPerRay = 0;
+    double avgBusyTime = 0, maxBusyTime = 0, loadBalance = 1;
+
+    StatisticsSummary(const std::vector<ThreadStatistics> &threads, double renderTime) {
+        for (const ThreadStatistics &stats : threads) {
+            total.add(stats);
+            maxBusyTime = std::max(maxBusyTime, stats.busyTime);
+        }
+        rays = total.rays + total.shadowRays;
+        if (renderTime > 0)
+            mraysPerSecond = rays / (renderTime * 1000.0);
+        if (rays > 0) {
+            nodeVisitsPerRay = total.nodeVisits / (double) rays;
+            triangleTestsPerRay = total.triangleTests / (double) rays;
+        }
+        if (!threads.empty())
+            avgBusyTime = total.busyTime / threads.size();
+        if (maxBusyTime > 0)
+            loadBalance = avgBusyTime / maxBusyTime;
+    }
+};
+
+std::string Statistics::report(double renderTime) {
+    std::vector<ThreadStatistics> threads = getThreads();
+    StatisticsSummary summary(threads, renderTime);
+    const ThreadStatistics &total = summary.total;
+
+    return tfm::format(
+        "Render statistics:\n"
+        "  Rays          : %llu (%llu shadow rays = %.1f%%)\n"
+        "  Throughput    : %.2f Mrays/s\n"
+        "  Per ray       : %.2f node visits, %.2f triangle tests\n"
+        "  Packets       : %llu (%.2f rays per packet)\n"
+        "  Samples       : %llu in %llu blocks\n"
+        "  Threads       : %i, busy %s on average, %s at most (load balance %.1f%%)\n",
+        (unsigned long long) summary.rays, (unsigned long long) total.shadowRays,
+        summary.rays > 0 ? 100.0 * total.shadowRays / summary.rays : 0.0,
+        summary.mraysPerSecond,
+        summary.nodeVisitsPerRay, summary.triangleTestsPerRay,
+        (unsigned long long) total.packets,
+        total.packets > 0 ? (double) total.packetRays / total.packets : 0.0,
+        (unsigned long long) total.samples, (unsigned long long) total.blocks,
+        (int) threads.size(), timeString(summary.avgBusyTime, true),
+        timeString(summary.maxBusyTime, true), 100.0 * summary.loadBalance);
+}
+
+void Statistics::writeJSON(const std::string &filename, const std::string &scene,
+        double renderTime) {
+    std::vector<ThreadStatistics> threads = getThreads();
+    StatisticsSummary summary(threads, renderTime);
+    const ThreadStatistics &total = summary.total;
+
+    std::string busyTimes;
+    for (size_t i = 0; i < threads.size(); ++i)
+        busyTimes += tfm::format("%s%.3f", i > 0 ? ", " : "", threads[i].busyTime);
+
+    std::ofstream os(filename);
+    os << "{" << endl
+       << "  \"scene\": " << jsonString(scene) << "," << endl
+       << tfm::format("  \"renderTime\": %.3f,", renderTime) << endl
+       << "  \"rays\": " << summary.rays << "," << endl
+       << "  \"shadowRays\": " << total.shadowRays << "," << endl
+       << "  \"packets\": " << total.packets << "," << endl
+       << "  \"packetRays\": " << total.packetRays << "," << endl
+       << "  \"nodeVisits\": " << total.nodeVisits << "," << endl
+       << "  \"triangleTests\": " << total.triangleTests << "," << endl
+       << "  \"samples\": " << total.samples << "," << endl
+       << "  \"blocks\": " << total.blocks << "," << endl
+       << tfm::format("  \"mraysPerSecond\": %.4f,", summary.mraysPerSecond) << endl
+       << tfm::format("  \"nodeVisitsPerRay\": %.4f,", summary.nodeVisitsPerRay) << endl
+       << tfm::format("  \"triangleTestsPerRay\": %.4f,", summary.triangleTestsPerRay) << endl
+       << tfm::format("  \"loadBalance\": %.4f,", summary.loadBalance) << endl
+       << "  \"threadBusyTimes\": [" << busyTimes << "]" << endl
+       << "}" << endl;
+
+    if (!os.good())
+        cerr << "Warning: unable to write the statistics file \"" << filename << "\"" << endl;
+}
+
+NORI_NAMESPACE_END
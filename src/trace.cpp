@@ -0,0 +1,130 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/trace.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+/* A single complete event (begin and end) */
+struct TraceEvent {
+    const char *category;
+    const char *name;
+    std::string detail;
+    double start, end;
+};
+
+/* Events recorded by one thread */
+struct TraceBuffer {
+    uint32_t thread;
+    std::vector<TraceEvent> events;
+};
+
+static std::atomic<bool> traceEnabled(false);
+static std::chrono::steady_clock::time_point traceOrigin;
+
+/* Buffers of all threads that ever recorded an event */
+static std::mutex &registryMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+static std::vector<std::unique_ptr<TraceBuffer>> &registry() {
+    static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    return buffers;
+}
+
+static TraceBuffer &localBuffer() {
+    thread_local TraceBuffer *buffer = nullptr;
+    if (!buffer) {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        registry().emplace_back(new TraceBuffer());
+        buffer = registry().back().get();
+        buffer->thread = (uint32_t) registry().size();
+    }
+    return *buffer;
+}
+
+void Tracer::start() {
+    std::lock_guard<std::mutex> lock(registryMutex());
+    for (auto &buffer : registry())
+        buffer->events.clear();
+    traceOrigin = std::chrono::steady_clock::now();
+    traceEnabled = true;
+}
+
+bool Tracer::isEnabled() {
+    return traceEnabled.load(std::memory_order_relaxed);
+}
+
+double Tracer::now() {
+    auto time = std::chrono::steady_clock::now() - traceOrigin;
+    return std::chrono::duration<double, std::micro>(time).count();
+}
+
+void Tracer::record(const char *category, const char *name,
+        const std::string &detail, double start, double end) {
+    localBuffer().events.push_back(TraceEvent { category, name, detail, start, end });
+}
+
+void Tracer::write(const std::string &filename) {
+    traceEnabled = false;
+
+    std::ofstream os(filename);
+    os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << endl;
+
+    std::lock_guard<std::mutex> lock(registryMutex());
+    size_t eventCount = 0;
+    bool first = true;
+    for (auto &buffer : registry()) {
+        if (buffer->events.empty())
+            continue;
+
+        /* Metadata event that names the thread */
+        os << (first ? "  " : ",\n  ")
+           << tfm::format("{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, "
+                          "\"tid\": %i, \"args\": {\"name\": \"Thread %i\"}}",
+                          buffer->thread, buffer->thread);
+        first = false;
+
+        for (const TraceEvent &event : buffer->events) {
+            os << ",\n  "
+               << tfm::format("{\"ph\": \"X\", \"cat\": \"%s\", \"name\": \"%s\", "
+                              "\"pid\": 1, \"tid\": %i, \"ts\": %.3f, \"dur\": %.3f",
+                              event.category, event.name, buffer->thread,
+                              event.start, event.end - event.start);
+            if (!event.detail.empty())
+                os << ", \"args\": {\"detail\": " << jsonString(event.detail) << "}";
+            os << "}";
+        }
+        eventCount += buffer->events.size();
+        buffer->events.clear();
+    }
+    os << endl << "]}" << endl;
+
+    if (os.good())
+        cout << "Wrote " << eventCount << " trace events to \"" << filename << "\"." << endl;
+    else
+        cerr << "Warning: unable to write the trace file \"" << filename << "\"" << endl;
+}
+
+NORI_NAMESPACE_END
@@ -47,9 +47,9 @@ float Warp::squareToUniformSquarePdf(const Point2f &sample) {
 }
 
 Point2f Warp::squareToUniformDisk(const Point2f &sample) {
-    float r = std::sqrtf(sample.x());
+    float r = std::sqrt(sample.x());
     float theta = 2 * M_PI * sample.y();
-    return Point2f(r * std::cosf(theta), r * std::sinf(theta));
+    return Point2f(r * std::cos(theta), r * std::sin(theta));
 }
 
 float Warp::squareToUniformDiskPdf(const Point2f &p) {
@@ -66,7 +66,7 @@ float Warp::squareToUniformSphereCapPdf(const Vector3f &v, float cosThetaMax) {
 }
 
 Vector3f Warp::squareToUniformSphere(const Point2f &sample) {
-    float theta = std::acosf(1.0f - 2 * sample.x());
+    float theta = std::acos(1.0f - 2 * sample.x());
     float phi = 2 * M_PI * sample.y();
     return Vector3f(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
 }
@@ -76,7 +76,7 @@ float Warp::squareToUniformSpherePdf(const Vector3f &v) {
 }
 
 Vector3f Warp::squareToUniformHemisphere(const Point2f &sample) {
-    float theta = std::acosf(1.0f - sample.x());
+    float theta = std::acos(1.0f - sample.x());
     float phi = 2.f * M_PI * sample.y();
     return Vector3f(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
 }
@@ -0,0 +1,147 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/wavefront.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/block.h>
+#include <nori/sampler.h>
+#include <nori/integrator.h>
+
+NORI_NAMESPACE_BEGIN
+
+WavefrontRenderer::WavefrontRenderer(const Scene *scene, uint32_t waveSize)
+    : m_scene(scene), m_waveSize(waveSize) { }
+
+void WavefrontRenderer::render(Sampler *sampler, ImageBlock &block, uint32_t sampleCount) {
+    const Camera *camera = m_scene->getCamera();
+    const Integrator *integrator = m_scene->getIntegrator();
+
+    Point2i offset = block.getOffset();
+    Vector2i size  = block.getSize();
+    uint32_t pixelCount = (uint32_t) (size.x() * size.y());
+    if (pixelCount == 0)
+        return;
+
+    /* Number of samples per pixel that fit into one wave */
+    uint32_t samplesPerWave = std::max(1u, std::min(sampleCount, m_waveSize / pixelCount));
+
+    for (uint32_t s0 = 0; s0 < sampleCount; s0 += samplesPerWave) {
+        uint32_t waveSamples = std::min(samplesPerWave, sampleCount - s0);
+
+        /* Stage 1: generate the camera rays of all samples in the wave. Rays
+           of neighboring pixels are stored next to each other, so that the
+           packets of the next stage are coherent */
+        m_paths.resize((size_t) waveSamples * pixelCount);
+        m_active.clear();
+        uint32_t index = 0;
+        for (uint32_t s = 0; s < waveSamples; ++s) {
+            for (int y = 0; y < size.y(); ++y) {
+                for (int x = 0; x < size.x(); ++x) {
+                    WavefrontPath &path = m_paths[index];
+                    path.pixelSample = Point2f((float) (x + offset.x()),
+                        (float) (y + offset.y())) + sampler->next2D();
+                    Point2f apertureSample = sampler->next2D();
+                    path.throughput = camera->sampleRay(path.ray, path.pixelSample, apertureSample);
+                    path.radiance = Color3f(0.0f);
+                    path.depth = 0;
+                    m_active.push_back(index++);
+                }
+            }
+        }
+
+        while (!m_active.empty()) {
+            /* Stage 2: intersect the rays of all active paths */
+            intersect();
+
+            /* Stage 3: sort the paths by the mesh (and thereby the BSDF) they hit,
+               so that the shading stage accesses one material after the other.
+               The sort is stable to keep neighboring pixels together */
+            std::stable_sort(m_active.begin(), m_active.end(),
+                [&](uint32_t a, uint32_t b) {
+                    const WavefrontPath &pa = m_paths[a], &pb = m_paths[b];
+                    const Mesh *ma = pa.hit ? pa.its.mesh : nullptr,
+                               *mb = pb.hit ? pb.its.mesh : nullptr;
+                    return ma < mb;
+                }
+            );
+
+            /* Stage 4: shade, which queues shadow rays and extension rays */
+            m_next.clear();
+            m_shadowRays.clear();
+            for (uint32_t i : m_active) {
+                WavefrontPath &path = m_paths[i];
+                if (integrator->shadeWavefront(m_scene, sampler, i, path, m_shadowRays)) {
+                    path.depth++;
+                    m_next.push_back(i);
+                }
+            }
+
+            /* Stage 5: resolve the visibility of the queued shadow rays */
+            traceShadowRays();
+
+            m_active.swap(m_next);
+        }
+
+        /* Store the finished samples in the image block */
+        for (const WavefrontPath &path : m_paths)
+            block.put(path.pixelSample, path.radiance);
+    }
+}
+
+void WavefrontRenderer::intersect() {
+    Intersection its[RayPacket::Size];
+
+    for (size_t i = 0; i < m_active.size(); i += RayPacket::Size) {
+        int count = (int) std::min((size_t) RayPacket::Size, m_active.size() - i);
+
+        RayPacket packet;
+        for (int k = 0; k < count; ++k)
+            packet.setRay(k, m_paths[m_active[i + k]].ray);
+
+        uint32_t hits = m_scene->rayIntersect(packet, its);
+
+        for (int k = 0; k < count; ++k) {
+            WavefrontPath &path = m_paths[m_active[i + k]];
+            path.hit = (hits & (1u << k)) != 0;
+            if (path.hit)
+                path.its = its[k];
+        }
+    }
+}
+
+void WavefrontRenderer::traceShadowRays() {
+    for (size_t i = 0; i < m_shadowRays.size(); i += RayPacket::Size) {
+        int count = (int) std::min((size_t) RayPacket::Size, m_shadowRays.size() - i);
+
+        RayPacket packet;
+        for (int k = 0; k < count; ++k)
+            packet.setRay(k, m_shadowRays[i + k].ray);
+
+        uint32_t occluded = m_scene->rayIntersect(packet);
+
+        for (int k = 0; k < count; ++k) {
+            if (occluded & (1u << k))
+                continue;
+            const WavefrontShadowRay &shadowRay = m_shadowRays[i + k];
+            m_paths[shadowRay.path].radiance += shadowRay.contribution;
+        }
+    }
+}
+
+NORI_NAMESPACE_END